@@ -0,0 +1,82 @@
+/* Irid ahead-of-time compiler
+   Copyright (c) 2023-2024 bellrise */
+
+#include "aot.h"
+
+#include <algorithm>
+
+/*
+ * Code is discovered by walking all static control flow from the reset
+ * vector. Every branch target, every fall-through after a conditional
+ * branch & every return address after a call starts a new block.
+ *
+ * Indirect jumps (callr, interrupt handlers, computed return addresses) are
+ * not followed. If the CPU lands somewhere which was not discovered here, the
+ * program falls back to the interpreter until the next branch.
+ */
+
+std::vector<u16> find_leaders(const image& img)
+{
+    std::vector<bool> seen(IRID_MAX_ADDR + 1);
+    std::vector<u16> worklist;
+    std::vector<u16> leaders;
+    aot_insn insn;
+    bool ends;
+
+    auto add = [&](u16 addr) {
+        if (seen[addr])
+            return;
+        seen[addr] = true;
+        worklist.push_back(addr);
+    };
+
+    add(0x0000);
+
+    while (!worklist.empty()) {
+        u16 addr = worklist.back();
+        worklist.pop_back();
+
+        if (!decode(img, addr, insn))
+            continue;
+        leaders.push_back(addr);
+
+        /* Walk the straight-line code until the block ends. */
+
+        for (u16 ip = addr; decode(img, ip, insn); ip += 4) {
+            ends = true;
+
+            switch (insn.op) {
+            case I_JMP:
+                add(insn.imm16at1);
+                break;
+            case I_JEQ:
+                add(insn.imm16at1);
+                add(ip + 4);
+                break;
+            case I_JNZ:
+                add(insn.imm16at2);
+                add(ip + 4);
+                break;
+            case I_CALL:
+                add(insn.imm16at1);
+                add(ip + 4);
+                break;
+            case I_CALLR:
+                add(ip + 4);
+                break;
+            case I_RET:
+            case I_RTI:
+                break;
+            default:
+                ends = false;
+                break;
+            }
+
+            if (ends || ip > IRID_MAX_ADDR - 4)
+                break;
+        }
+    }
+
+    std::sort(leaders.begin(), leaders.end());
+    return leaders;
+}
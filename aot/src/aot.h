@@ -0,0 +1,70 @@
+/* aot.h - ahead-of-time compiler for Irid images
+   Copyright (c) 2023-2024 bellrise */
+
+#pragma once
+
+#include <irid/arch.h>
+#include <string>
+#include <vector>
+
+#define AOT_VER_MAJOR 0
+#define AOT_VER_MINOR 1
+
+struct image_argument
+{
+    std::string path;
+    u16 offset;
+};
+
+struct options
+{
+    std::vector<image_argument> images;
+    std::string output;
+    std::string cxx;
+    std::vector<std::string> include_dirs;
+    std::string library;
+    bool source_only;
+};
+
+void opt_set_defaults(options&);
+void opt_parse(options&, int argc, char **argv);
+
+void die(const char *fmt, ...);
+void warn(const char *fmt, ...);
+
+/* Guest address space, with a map of bytes which were loaded from images.
+   Only loaded code is translated. */
+struct image
+{
+    u8 mem[IRID_MAX_ADDR + 1];
+    bool loaded[IRID_MAX_ADDR + 1];
+    std::vector<std::string> paths;
+};
+
+void image_load(image&, const image_argument&);
+
+/* A single decoded instruction. Which immediate is used depends on the
+   opcode, same as in irid-emul. */
+struct aot_insn
+{
+    u16 addr;
+    u8 op;
+    u8 a;
+    u8 b;
+    u16 imm16at1;
+    u16 imm16at2;
+};
+
+/* Decode the instruction at `addr`, returns false if any of its bytes was
+   not loaded from an image. */
+bool decode(const image&, u16 addr, aot_insn& insn);
+
+/* Find all addresses which start a basic block, walking the code reachable
+   from the reset vector. Returned in ascending order. */
+std::vector<u16> find_leaders(const image&);
+
+/* Generate the C++ source of a program running the image. */
+std::string generate(const image&, const std::vector<u16>& leaders);
+
+/* Compile the generated source into an executable. */
+void compile(const options&, const std::string& source);
@@ -0,0 +1,60 @@
+/* Irid ahead-of-time compiler
+   Copyright (c) 2023-2024 bellrise */
+
+#include "aot.h"
+
+#include <errno.h>
+#include <fstream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+void compile(const options& opts, const std::string& source)
+{
+    char path[] = "/tmp/irid-aot-XXXXXX.cc";
+    std::vector<std::string> args;
+    std::vector<char *> argv;
+    int status;
+    pid_t pid;
+    int fd;
+
+    if (access(opts.library.c_str(), R_OK))
+        die("cannot read the emulator library %s, set the runtime with -r",
+            opts.library.c_str());
+
+    fd = mkstemps(path, 3);
+    if (fd == -1)
+        die("failed to create a temporary file: %s", strerror(errno));
+
+    if (write(fd, source.data(), source.size()) != (ssize_t) source.size())
+        die("failed to write %s: %s", path, strerror(errno));
+    close(fd);
+
+    /* The generated code is linked against the emulator, which provides
+       main(), the interpreter & all devices. */
+
+    args = {opts.cxx, "-O2"};
+    for (const std::string& dir : opts.include_dirs)
+        args.push_back("-I" + dir);
+    args.insert(args.end(), {"-o", opts.output, path, opts.library, "-pthread"});
+
+    for (std::string& arg : args)
+        argv.push_back(arg.data());
+    argv.push_back(nullptr);
+
+    pid = fork();
+    if (pid == -1)
+        die("failed to fork: %s", strerror(errno));
+
+    if (pid == 0) {
+        execvp(argv[0], argv.data());
+        die("failed to run %s: %s", argv[0], strerror(errno));
+    }
+
+    waitpid(pid, &status, 0);
+    unlink(path);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        die("%s failed to compile the generated code", opts.cxx.c_str());
+}
@@ -0,0 +1,34 @@
+/* Irid ahead-of-time compiler
+   Copyright (c) 2023-2024 bellrise */
+
+#include "aot.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void die(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+
+    fprintf(stderr, "irid-aot: \033[1;31merror: \033[1;39m");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\033[0m\n");
+
+    va_end(args);
+
+    exit(1);
+}
+
+void warn(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+
+    fprintf(stderr, "irid-aot: \033[1;35mwarning: \033[1;39m");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\033[0m\n");
+
+    va_end(args);
+}
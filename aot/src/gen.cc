@@ -0,0 +1,835 @@
+/* Irid ahead-of-time compiler
+   Copyright (c) 2023-2024 bellrise */
+
+#include "aot.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+/*
+ * The image is translated into a single C++ function. Each basic block gets
+ * a label, guest registers live in local variables & static branches become
+ * plain gotos, so the host compiler is free to keep everything in registers.
+ * Each instruction mirrors the semantics of its implementation in
+ * emul/src/cpu.cc.
+ *
+ * The function has the same contract as the JIT: it runs until the budget
+ * runs out at a block boundary, or an instruction has to be interpreted, and
+ * returns the amount of executed instructions. Anything which can fault,
+ * touches CPU state outside the register file (cpucall, rti, sti, dsi) or
+ * jumps indirectly through a register (callr) is left to the interpreter,
+ * which runs the rest of the block & returns to native code at the next
+ * branch.
+ *
+ * All translated code is watched in memory. A store into it invalidates the
+ * affected blocks, which are interpreted from then on.
+ */
+
+static std::string format(const char *fmt, ...)
+{
+    va_list args;
+    char buf[256];
+
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    return buf;
+}
+
+static const char *mnemonic(u8 op)
+{
+    switch (op) {
+    case I_NOP:
+        return "nop";
+    case I_CPUCALL:
+        return "cpucall";
+    case I_RTI:
+        return "rti";
+    case I_STI:
+        return "sti";
+    case I_DSI:
+        return "dsi";
+    case I_WFI:
+        return "wfi";
+    case I_PUSH:
+        return "push";
+    case I_PUSH8:
+        return "push8";
+    case I_PUSH16:
+        return "push16";
+    case I_POP:
+        return "pop";
+    case I_MOV:
+        return "mov";
+    case I_MOV8:
+        return "mov8";
+    case I_MOV16:
+        return "mov16";
+    case I_LOAD:
+        return "load";
+    case I_STORE:
+        return "store";
+    case I_NULL:
+        return "null";
+    case I_CMP:
+        return "cmp";
+    case I_CMP8:
+        return "cmp8";
+    case I_CMP16:
+        return "cmp16";
+    case I_CMG:
+        return "cmg";
+    case I_CMG8:
+        return "cmg8";
+    case I_CMG16:
+        return "cmg16";
+    case I_CML:
+        return "cml";
+    case I_CML8:
+        return "cml8";
+    case I_CML16:
+        return "cml16";
+    case I_LOAD16:
+        return "load16";
+    case I_STORE16:
+        return "store16";
+    case I_CFS:
+        return "cfs";
+    case I_JMP:
+        return "jmp";
+    case I_JNZ:
+        return "jnz";
+    case I_JEQ:
+        return "jeq";
+    case I_CALL:
+        return "call";
+    case I_CALLR:
+        return "callr";
+    case I_RET:
+        return "ret";
+    case I_ADD:
+        return "add";
+    case I_ADD8:
+        return "add8";
+    case I_ADD16:
+        return "add16";
+    case I_SUB:
+        return "sub";
+    case I_SUB8:
+        return "sub8";
+    case I_SUB16:
+        return "sub16";
+    case I_AND:
+        return "and";
+    case I_AND8:
+        return "and8";
+    case I_AND16:
+        return "and16";
+    case I_OR:
+        return "or";
+    case I_OR8:
+        return "or8";
+    case I_OR16:
+        return "or16";
+    case I_NOT:
+        return "not";
+    case I_SHR:
+        return "shr";
+    case I_SHR8:
+        return "shr8";
+    case I_SHL:
+        return "shl";
+    case I_SHL8:
+        return "shl8";
+    case I_MUL:
+        return "mul";
+    case I_MUL8:
+        return "mul8";
+    case I_MUL16:
+        return "mul16";
+    default:
+        return "(unknown)";
+    }
+}
+
+static bool is_half(u8 id)
+{
+    return id >= R_H0 && id <= R_L3;
+}
+
+/* A guest register as a C expression, or an empty string if the register
+   has to be accessed by the interpreter. Reading ip gives the address of the
+   current instruction. */
+static std::string reg_read(u8 id, u16 ip)
+{
+    if (id <= R_R7)
+        return format("r%d", id);
+    if (id >= R_H0 && id <= R_H3)
+        return format("(u8) r%d", id - R_H0);
+    if (id >= R_L0 && id <= R_L3)
+        return format("(u8) (r%d >> 8)", id - R_L0);
+    if (id == R_SP)
+        return "sp";
+    if (id == R_BP)
+        return "bp";
+    if (id == R_IP)
+        return format("0x%04x", ip);
+    return "";
+}
+
+/* Store a value into a guest register, truncating it to the register width.
+   Writing ip is a jump, which is left to the interpreter. */
+static std::string reg_write(u8 id, const std::string& value)
+{
+    if (id <= R_R7)
+        return format("r%d = (u16) (%s);", id, value.c_str());
+    if (id >= R_H0 && id <= R_H3)
+        return format("r%d = (r%d & 0xff00) | (u8) (%s);", id - R_H0,
+                      id - R_H0, value.c_str());
+    if (id >= R_L0 && id <= R_L3)
+        return format("r%d = (r%d & 0x00ff) | (u8) (%s) << 8;", id - R_L0,
+                      id - R_L0, value.c_str());
+    if (id == R_SP)
+        return format("sp = (u16) (%s);", value.c_str());
+    if (id == R_BP)
+        return format("bp = (u16) (%s);", value.c_str());
+    return "";
+}
+
+struct generator
+{
+    const image& img;
+    const std::vector<u16>& leaders;
+    std::vector<bool> is_leader;
+    std::string out;
+
+    generator(const image& img, const std::vector<u16>& leaders)
+        : img(img)
+        , leaders(leaders)
+        , is_leader(IRID_MAX_ADDR + 1)
+    {
+        for (u16 addr : leaders)
+            is_leader[addr] = true;
+    }
+
+    void emit(const std::string& line)
+    {
+        out += line;
+        out += '\n';
+    }
+
+    /* Continue at `addr`, directly if it was translated. */
+    std::string jump(u16 addr)
+    {
+        if (is_leader[addr])
+            return format("goto L_%04x;", addr);
+        return format("EXIT(0x%04x);", addr);
+    }
+
+    /* Leave native code before the instruction at `ip` if a 16-bit access
+       at `addr` would wrap around the end of memory. */
+    void wrap_check(const std::string& addr, u16 ip)
+    {
+        emit(format("    if (%s == IRID_MAX_ADDR)", addr.c_str()));
+        emit(format("        EXIT(0x%04x);", ip));
+    }
+
+    void prelude();
+    void image_data();
+    void block_table(const std::vector<unsigned>& ends);
+    void block(size_t index, u16 start, std::vector<unsigned>& ends);
+    bool instruction(const aot_insn& insn, bool& ends_block);
+    void run(const std::string& body);
+    void epilogue();
+};
+
+void generator::prelude()
+{
+    std::string from;
+
+    for (const std::string& path : img.paths)
+        from += (from.empty() ? "" : ", ") + path;
+
+    emit(format("/* Generated by irid-aot %d.%d from ", AOT_VER_MAJOR,
+                AOT_VER_MINOR)
+         + from + " */");
+    emit("");
+    emit("#include \"emul.h\"");
+    emit("");
+    emit("#define N_BLOCKS " + std::to_string(leaders.size()));
+    emit("");
+    emit("/* Leave native code, the CPU continues at `addr`. */");
+    emit("#define EXIT(addr)                                                  "
+         "           \\");
+    emit("    do {                                                            "
+         "           \\");
+    emit("        ip = (addr);                                                "
+         "           \\");
+    emit("        goto out;                                                   "
+         "           \\");
+    emit("    } while (0)");
+    emit("");
+    emit("#define LOAD8(addr)  m[(u16) (addr)]");
+    emit("#define LOAD16(addr) ((u16) (m[(u16) (addr)] | m[(u16) (addr) + 1] "
+         "<< 8))");
+    emit("");
+    emit("static bool dead[N_BLOCKS];");
+    emit("static unsigned block_index[IRID_MAX_ADDR + 1];");
+    emit("static bool dirty;");
+    emit("");
+    emit("/* Stores into watched code go through memory, so the CPU can "
+         "invalidate\n   decoded & translated instructions. Returns true if "
+         "translated code\n   was hit. */");
+    emit("static inline bool store8(memory& mem, u8 *m, const u8 *code, u16 "
+         "addr,\n                          u8 value)");
+    emit("{");
+    emit("    if (code[addr]) {");
+    emit("        mem.write8(addr, value);");
+    emit("        return dirty;");
+    emit("    }");
+    emit("    m[addr] = value;");
+    emit("    return false;");
+    emit("}");
+    emit("");
+    emit("static inline bool store16(memory& mem, u8 *m, const u8 *code, u16 "
+         "addr,\n                           u16 value)");
+    emit("{");
+    emit("    if (code[addr] || code[addr + 1]) {");
+    emit("        mem.write16(addr, value);");
+    emit("        return dirty;");
+    emit("    }");
+    emit("    m[addr] = value & 0xff;");
+    emit("    m[addr + 1] = value >> 8;");
+    emit("    return false;");
+    emit("}");
+    emit("");
+}
+
+void generator::image_data()
+{
+    std::vector<std::pair<size_t, size_t>> segments;
+    size_t addr;
+
+    /* Each contiguous range of loaded bytes becomes a segment. */
+
+    for (addr = 0; addr <= IRID_MAX_ADDR; addr++) {
+        if (!img.loaded[addr])
+            continue;
+        if (segments.empty() || segments.back().second != addr)
+            segments.push_back({addr, addr});
+        segments.back().second = addr + 1;
+    }
+
+    for (size_t i = 0; i < segments.size(); i++) {
+        emit(format("static const u8 segment%zu[] = {", i));
+        for (addr = segments[i].first; addr < segments[i].second; addr++) {
+            size_t col = (addr - segments[i].first) % 12;
+
+            if (col == 0)
+                out += "   ";
+            out += format(" 0x%02x,", img.mem[addr]);
+            if (col == 11 || addr + 1 == segments[i].second)
+                out += '\n';
+        }
+        emit("};");
+        emit("");
+    }
+
+    emit("static const aot_segment segments[] = {");
+    for (size_t i = 0; i < segments.size(); i++) {
+        emit(format("    {0x%04zx, sizeof(segment%zu), segment%zu},",
+                    segments[i].first, i, i));
+    }
+    emit("};");
+    emit("");
+}
+
+/* Translate a single instruction. Returns false if it has to be left to the
+   interpreter, in which case the block exits before it. */
+bool generator::instruction(const aot_insn& in, bool& ends_block)
+{
+    std::string x = reg_read(in.a, in.addr);
+    std::string y = reg_read(in.b, in.addr);
+    std::string next = format("0x%04x", (u16) (in.addr + 4));
+    bool x_ok = !x.empty();
+    bool y_ok = !y.empty();
+    bool dest_ok = !reg_write(in.a, "").empty();
+    const char *op = nullptr;
+
+    ends_block = false;
+
+    /* Leave faults to the interpreter: a push with sp at 0, and any 16-bit
+       access at the last address, which would wrap around. */
+
+    switch (in.op) {
+    case I_PUSH:
+    case I_PUSH8:
+    case I_PUSH16:
+    case I_CALL:
+        if (in.op == I_PUSH && !x_ok)
+            return false;
+        if (in.op == I_PUSH8 || (in.op == I_PUSH && is_half(in.a)))
+            emit("    if (!sp)");
+        else
+            emit("    if (sp < 2)");
+        emit(format("        EXIT(0x%04x);", in.addr));
+        break;
+    case I_POP:
+        if (!dest_ok)
+            return false;
+        if (!is_half(in.a))
+            wrap_check("sp", in.addr);
+        break;
+    case I_RET:
+        wrap_check("sp", in.addr);
+        break;
+    case I_LOAD:
+    case I_STORE:
+        if (in.op == I_LOAD ? !dest_ok : !x_ok)
+            return false;
+        if (!y_ok || is_half(in.b))
+            return false;
+        if (!is_half(in.a))
+            wrap_check(y, in.addr);
+        break;
+    case I_LOAD16:
+    case I_STORE16:
+        if (!is_half(in.a) && in.imm16at2 == IRID_MAX_ADDR)
+            return false;
+        break;
+    default:
+        break;
+    }
+
+    switch (in.op) {
+    case I_NOP:
+        emit("    n++;");
+        return true;
+
+    case I_PUSH:
+        /* The value is read before sp changes, so push sp works. */
+        emit("    n++;");
+        emit("    ip = " + x + ";");
+        if (is_half(in.a)) {
+            emit("    sp -= 1;");
+            emit("    if (store8(mem, m, code, sp, ip))");
+        } else {
+            emit("    sp -= 2;");
+            emit("    if (store16(mem, m, code, sp, ip))");
+        }
+        emit("        EXIT(" + next + ");");
+        return true;
+    case I_PUSH8:
+        emit("    n++;");
+        emit("    sp -= 1;");
+        emit(format("    if (store8(mem, m, code, sp, 0x%02x))", in.a));
+        emit("        EXIT(" + next + ");");
+        return true;
+    case I_PUSH16:
+        emit("    n++;");
+        emit("    sp -= 2;");
+        emit(format("    if (store16(mem, m, code, sp, 0x%04x))",
+                    in.imm16at1));
+        emit("        EXIT(" + next + ");");
+        return true;
+    case I_POP:
+        if (!dest_ok)
+            return false;
+        emit("    n++;");
+        if (is_half(in.a)) {
+            emit("    " + reg_write(in.a, "LOAD8(sp)"));
+            emit("    sp += 1;");
+        } else {
+            /* Popping into sp itself keeps the popped value. */
+            emit("    ip = LOAD16(sp);");
+            emit("    sp += 2;");
+            emit("    " + reg_write(in.a, "ip"));
+        }
+        return true;
+
+    case I_MOV:
+        if (!dest_ok || !y_ok)
+            return false;
+        emit("    n++;");
+        emit("    " + reg_write(in.a, y));
+        return true;
+    case I_MOV8:
+        if (!dest_ok)
+            return false;
+        emit("    n++;");
+        emit("    " + reg_write(in.a, format("0x%02x", in.b)));
+        return true;
+    case I_MOV16:
+        if (!dest_ok)
+            return false;
+        emit("    n++;");
+        emit("    " + reg_write(in.a, format("0x%04x", in.imm16at2)));
+        return true;
+    case I_NULL:
+        if (!dest_ok)
+            return false;
+        emit("    n++;");
+        emit("    " + reg_write(in.a, "0"));
+        return true;
+
+    case I_LOAD:
+        if (!dest_ok || !y_ok || is_half(in.b))
+            return false;
+        emit("    n++;");
+        emit("    " + reg_write(in.a, format(is_half(in.a) ? "LOAD8(%s)"
+                                                           : "LOAD16(%s)",
+                                             y.c_str())));
+        return true;
+    case I_LOAD16:
+        if (!dest_ok)
+            return false;
+        emit("    n++;");
+        emit("    " + reg_write(in.a, format(is_half(in.a) ? "LOAD8(0x%04x)"
+                                                           : "LOAD16(0x%04x)",
+                                             in.imm16at2)));
+        return true;
+    case I_STORE:
+    case I_STORE16:
+        if (!x_ok)
+            return false;
+        if (in.op == I_STORE && (!y_ok || is_half(in.b)))
+            return false;
+        if (in.op == I_STORE16)
+            y = format("0x%04x", in.imm16at2);
+        emit("    n++;");
+        emit(format("    if (store%d(mem, m, code, %s, %s))",
+                    is_half(in.a) ? 8 : 16, y.c_str(), x.c_str()));
+        emit("        EXIT(" + next + ");");
+        return true;
+
+    case I_CMP:
+    case I_CMG:
+    case I_CML:
+        if (!x_ok || !y_ok)
+            return false;
+        op = in.op == I_CMP ? "==" : in.op == I_CMG ? ">" : "<";
+        emit("    n++;");
+        emit(format("    cf = %s %s %s;", x.c_str(), op, y.c_str()));
+        return true;
+    case I_CMP8:
+        if (!x_ok)
+            return false;
+        emit("    n++;");
+        emit(format("    cf = %s == 0x%02x;", x.c_str(), in.b));
+        return true;
+    case I_CMG8:
+    case I_CML8:
+        if (!x_ok)
+            return false;
+        op = in.op == I_CMG8 ? ">" : "<";
+        emit("    n++;");
+        emit(format("    cf = (u8) (%s) %s 0x%02x;", x.c_str(), op, in.b));
+        return true;
+    case I_CMP16:
+    case I_CMG16:
+    case I_CML16:
+        if (!x_ok)
+            return false;
+        op = in.op == I_CMP16 ? "==" : in.op == I_CMG16 ? ">" : "<";
+        emit("    n++;");
+        emit(format("    cf = %s %s 0x%04x;", x.c_str(), op, in.imm16at2));
+        return true;
+    case I_CFS:
+        emit("    n++;");
+        emit("    cf = !cf;");
+        return true;
+
+    case I_ADD:
+    case I_SUB:
+    case I_AND:
+    case I_OR:
+    case I_MUL:
+        if (!dest_ok || !y_ok)
+            return false;
+        break;
+    case I_ADD8:
+    case I_SUB8:
+    case I_AND8:
+    case I_OR8:
+    case I_MUL8:
+        if (!dest_ok)
+            return false;
+        y = format("0x%02x", in.b);
+        break;
+    case I_ADD16:
+    case I_SUB16:
+    case I_AND16:
+    case I_OR16:
+    case I_MUL16:
+        if (!dest_ok)
+            return false;
+        y = format("0x%04x", in.imm16at2);
+        break;
+
+    case I_NOT:
+        if (!dest_ok)
+            return false;
+        emit("    n++;");
+        emit("    " + reg_write(in.a, "~" + x));
+        return true;
+
+    case I_SHR:
+    case I_SHL:
+        if (!dest_ok || !y_ok)
+            return false;
+        op = in.op == I_SHR ? ">>" : "<<";
+        emit("    n++;");
+        emit("    " + reg_write(in.a, format("%s %s ((u8) (%s) & 31)",
+                                             x.c_str(), op, y.c_str())));
+        return true;
+    case I_SHR8:
+    case I_SHL8:
+        if (!dest_ok)
+            return false;
+        op = in.op == I_SHR8 ? ">>" : "<<";
+        emit("    n++;");
+        emit("    " + reg_write(in.a, format("%s %s %d", x.c_str(), op,
+                                             in.b & 31)));
+        return true;
+
+    case I_JMP:
+        emit("    n++;");
+        emit("    " + jump(in.imm16at1));
+        ends_block = true;
+        return true;
+    case I_JEQ:
+        emit("    n++;");
+        emit("    if (cf)");
+        emit("        " + jump(in.imm16at1));
+        emit("    " + jump(in.addr + 4));
+        ends_block = true;
+        return true;
+    case I_JNZ:
+        if (!x_ok)
+            return false;
+        emit("    n++;");
+        emit(format("    if (%s)", x.c_str()));
+        emit("        " + jump(in.imm16at2));
+        emit("    " + jump(in.addr + 4));
+        ends_block = true;
+        return true;
+    case I_CALL:
+        emit("    n++;");
+        emit("    sp -= 2;");
+        emit(format("    if (store16(mem, m, code, sp, 0x%04x))",
+                    (u16) (in.addr + 4)));
+        emit(format("        EXIT(0x%04x);", in.imm16at1));
+        emit("    " + jump(in.imm16at1));
+        ends_block = true;
+        return true;
+    case I_RET:
+        emit("    n++;");
+        emit("    ip = LOAD16(sp);");
+        emit("    sp += 2;");
+        emit("    goto dispatch;");
+        ends_block = true;
+        return true;
+
+    case I_CPUCALL:
+    case I_RTI:
+    case I_STI:
+    case I_DSI:
+    case I_WFI:
+    case I_CALLR:
+        return false;
+
+    default:
+        /* Unknown instructions are skipped over. */
+        emit("    n++;");
+        return true;
+    }
+
+    /* Arithmetic, all wrapping to the width of the destination. */
+
+    switch (in.op) {
+    case I_ADD:
+    case I_ADD8:
+    case I_ADD16:
+        op = "+";
+        break;
+    case I_SUB:
+    case I_SUB8:
+    case I_SUB16:
+        op = "-";
+        break;
+    case I_AND:
+    case I_AND8:
+    case I_AND16:
+        op = "&";
+        break;
+    case I_OR:
+    case I_OR8:
+    case I_OR16:
+        op = "|";
+        break;
+    default:
+        op = "*";
+        break;
+    }
+
+    emit("    n++;");
+    emit("    " + reg_write(in.a, format("(unsigned) %s %s %s", x.c_str(), op,
+                                         y.c_str())));
+    return true;
+}
+
+void generator::block(size_t index, u16 start, std::vector<unsigned>& ends)
+{
+    aot_insn insn;
+    bool ends_block;
+    unsigned ip;
+
+    emit(format("L_%04x:", start));
+    emit(format("    if (n >= budget || dead[%zu])", index));
+    emit(format("        EXIT(0x%04x);", start));
+
+    ip = start;
+    while (1) {
+        if (ip > IRID_MAX_ADDR || !decode(img, ip, insn)) {
+            emit(format("    EXIT(0x%04x);", (u16) ip));
+            break;
+        }
+
+        /* Run straight into the next block. */
+        if (ip != start && is_leader[ip]) {
+            emit(format("    goto L_%04x;", ip));
+            break;
+        }
+
+        emit(format("    /* %04x: %s */", ip, mnemonic(insn.op)));
+        if (!instruction(insn, ends_block)) {
+            emit(format("    EXIT(0x%04x);", ip));
+            break;
+        }
+
+        ip += 4;
+        if (ends_block)
+            break;
+    }
+
+    ends[index] = ip;
+    emit("");
+}
+
+void generator::block_table(const std::vector<unsigned>& ends)
+{
+    emit("static const aot_block blocks[N_BLOCKS] = {");
+    for (size_t i = 0; i < leaders.size(); i++)
+        emit(format("    {0x%04x, 0x%04x},", leaders[i], ends[i]));
+    emit("};");
+    emit("");
+}
+
+void generator::run(const std::string& body)
+{
+    emit("static size_t aot_run(const void *, irid_reg& reg, memory& mem,");
+    emit("                      size_t budget)");
+    emit("{");
+    emit("    u8 *m = mem.host_base();");
+    emit("    const u8 *code = mem.code_map();");
+    for (int i = 0; i < 8; i++)
+        emit(format("    u16 r%d = reg.r%d;", i, i));
+    emit("    u16 sp = reg.sp;");
+    emit("    u16 bp = reg.bp;");
+    emit("    u16 ip = reg.ip;");
+    emit("    bool cf = reg.cf;");
+    emit("    size_t n = 0;");
+    emit("");
+    emit("    dirty = false;");
+    emit("");
+    emit("dispatch:");
+    emit("    switch (ip) {");
+    for (u16 addr : leaders)
+        emit(format("    case 0x%04x:\n        goto L_%04x;", addr, addr));
+    emit("    default:");
+    emit("        goto out;");
+    emit("    }");
+    emit("");
+
+    out += body;
+
+    emit("out:");
+    for (int i = 0; i < 8; i++)
+        emit(format("    reg.r%d = r%d;", i, i));
+    emit("    reg.sp = sp;");
+    emit("    reg.bp = bp;");
+    emit("    reg.ip = ip;");
+    emit("    reg.cf = cf;");
+    emit("    return n;");
+    emit("}");
+    emit("");
+}
+
+void generator::epilogue()
+{
+    emit("static const void *aot_lookup(u16 addr)");
+    emit("{");
+    emit("    unsigned i = block_index[addr];");
+    emit("");
+    emit("    if (!i || dead[i - 1])");
+    emit("        return nullptr;");
+    emit("    return &blocks[i - 1];");
+    emit("}");
+    emit("");
+    emit("static void aot_invalidate(u16 addr, u16 n)");
+    emit("{");
+    emit("    size_t end = (size_t) addr + n;");
+    emit("");
+    emit("    for (size_t i = 0; i < N_BLOCKS; i++) {");
+    emit("        if (blocks[i].start < end && addr < blocks[i].end) {");
+    emit("            dead[i] = true;");
+    emit("            dirty = true;");
+    emit("        }");
+    emit("    }");
+    emit("}");
+    emit("");
+    emit("static const aot_program program = {");
+    emit("    segments,   sizeof(segments) / sizeof(*segments),");
+    emit("    blocks,     N_BLOCKS,");
+    emit("    aot_lookup, aot_run,");
+    emit("    aot_invalidate,");
+    emit("};");
+    emit("");
+    emit("/* Register the program before main() runs. */");
+    emit("static struct aot_register");
+    emit("{");
+    emit("    aot_register()");
+    emit("    {");
+    emit("        /* A block which starts with an untranslated instruction is "
+         "left to the\n           interpreter entirely. */");
+    emit("        for (size_t i = 0; i < N_BLOCKS; i++) {");
+    emit("            if (blocks[i].end != blocks[i].start)");
+    emit("                block_index[blocks[i].start] = i + 1;");
+    emit("        }");
+    emit("        aot_builtin = &program;");
+    emit("    }");
+    emit("} registration;");
+}
+
+std::string generate(const image& img, const std::vector<u16>& leaders)
+{
+    generator gen(img, leaders);
+    std::vector<unsigned> ends(leaders.size());
+    std::string body;
+
+    /* Translate the blocks first, the block table needs to know where each
+       of them ends. */
+
+    for (size_t i = 0; i < leaders.size(); i++)
+        gen.block(i, leaders[i], ends);
+    body.swap(gen.out);
+
+    gen.prelude();
+    gen.image_data();
+    gen.block_table(ends);
+    gen.run(body);
+    gen.epilogue();
+
+    return gen.out;
+}
@@ -0,0 +1,50 @@
+/* Irid ahead-of-time compiler
+   Copyright (c) 2023-2024 bellrise */
+
+#include "aot.h"
+
+#include <fstream>
+#include <iterator>
+
+void image_load(image& img, const image_argument& arg)
+{
+    std::ifstream file(arg.path, std::ios::binary);
+    std::vector<char> buf;
+
+    if (!file.is_open())
+        die("cannot access %s", arg.path.c_str());
+
+    buf.assign(std::istreambuf_iterator<char>(file),
+               std::istreambuf_iterator<char>());
+
+    if (arg.offset + buf.size() > IRID_MAX_ADDR + 1)
+        die("%s does not fit in memory at 0x%04x", arg.path.c_str(),
+            arg.offset);
+
+    for (size_t i = 0; i < buf.size(); i++) {
+        img.mem[arg.offset + i] = buf[i];
+        img.loaded[arg.offset + i] = true;
+    }
+
+    img.paths.push_back(arg.path);
+}
+
+bool decode(const image& img, u16 addr, aot_insn& insn)
+{
+    if (addr > IRID_MAX_ADDR - 3)
+        return false;
+
+    for (int i = 0; i < 4; i++) {
+        if (!img.loaded[addr + i])
+            return false;
+    }
+
+    insn.addr = addr;
+    insn.op = img.mem[addr];
+    insn.a = img.mem[addr + 1];
+    insn.b = img.mem[addr + 2];
+    insn.imm16at1 = img.mem[addr + 1] | (img.mem[addr + 2] << 8);
+    insn.imm16at2 = img.mem[addr + 2] | (img.mem[addr + 3] << 8);
+
+    return true;
+}
@@ -0,0 +1,35 @@
+/* Irid ahead-of-time compiler
+   Copyright (c) 2023-2024 bellrise */
+
+#include "aot.h"
+
+#include <fstream>
+
+int main(int argc, char **argv)
+{
+    options opts;
+    image *img;
+    std::vector<u16> leaders;
+    std::string source;
+
+    opt_set_defaults(opts);
+    opt_parse(opts, argc, argv);
+
+    img = new image{};
+    for (const image_argument& arg : opts.images)
+        image_load(*img, arg);
+
+    leaders = find_leaders(*img);
+    source = generate(*img, leaders);
+    delete img;
+
+    if (!opts.source_only) {
+        compile(opts, source);
+        return 0;
+    }
+
+    std::ofstream dest_file(opts.output);
+    if (!dest_file.is_open())
+        die("failed to open output file `%s`", opts.output.c_str());
+    dest_file << source;
+}
@@ -0,0 +1,174 @@
+/* Irid ahead-of-time compiler
+   Copyright (c) 2023-2024 bellrise */
+
+#include "aot.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void short_usage();
+static void usage();
+static void version();
+static image_argument parse_image_argument(const char *str);
+static void set_runtime_dir(options& opts, const std::string& dir);
+static std::string installed_runtime_dir();
+
+void opt_set_defaults(options& opts)
+{
+    const char *cxx;
+    const char *dir;
+    std::string installed;
+
+    opts.output = "a.out";
+    opts.source_only = false;
+
+    cxx = getenv("CXX");
+    opts.cxx = cxx && *cxx ? cxx : "c++";
+
+    /* The emulator runtime is looked up in $IRID_AOT_DIR, then next to the
+       installed tool, then in the source tree irid-aot was built in. */
+    opts.include_dirs = {AOT_EMUL_DIR "/src", AOT_INCLUDE_DIR};
+    opts.library = AOT_EMUL_DIR "/build/libirid-emul.a";
+
+    installed = installed_runtime_dir();
+    if (!installed.empty())
+        set_runtime_dir(opts, installed);
+
+    dir = getenv("IRID_AOT_DIR");
+    if (dir && *dir)
+        set_runtime_dir(opts, dir);
+}
+
+void opt_parse(options& opts, int argc, char **argv)
+{
+    int opt_index;
+    int c;
+
+    static struct option long_opts[] = {{"help", no_argument, 0, 'h'},
+                                        {"output", required_argument, 0, 'o'},
+                                        {"runtime", required_argument, 0, 'r'},
+                                        {"source", no_argument, 0, 'S'},
+                                        {"version", no_argument, 0, 'v'},
+                                        {0, 0, 0, 0}};
+
+    opt_index = 0;
+
+    if (argc == 1) {
+        short_usage();
+        exit(0);
+    }
+
+    while (1) {
+        c = getopt_long(argc, argv, "ho:r:Sv", long_opts, &opt_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'h':
+            usage();
+            exit(0);
+        case 'o':
+            opts.output = optarg;
+            break;
+        case 'r':
+            set_runtime_dir(opts, optarg);
+            break;
+        case 'S':
+            opts.source_only = true;
+            break;
+        case 'v':
+            version();
+            exit(0);
+        default:
+            exit(1);
+        }
+    }
+
+    while (optind < argc)
+        opts.images.push_back(parse_image_argument(argv[optind++]));
+
+    if (opts.images.empty())
+        die("no images given");
+}
+
+static image_argument parse_image_argument(const char *str)
+{
+    image_argument image;
+    const char *middle;
+
+    /* Same format as irid-emul takes, path[:hex offset]. */
+
+    middle = strchr(str, ':');
+    if (!middle) {
+        image.path = str;
+        image.offset = 0;
+        return image;
+    }
+
+    image.path = std::string(str, middle - str);
+    image.offset = strtol(middle + 1, NULL, 16);
+
+    return image;
+}
+
+/* An installed runtime directory holds the emulator library & an include
+   directory with its headers, irid/ included. */
+static void set_runtime_dir(options& opts, const std::string& dir)
+{
+    opts.include_dirs = {dir + "/include"};
+    opts.library = dir + "/libirid-emul.a";
+}
+
+/* `make install` puts the runtime in lib/irid-aot, next to bin/irid-aot. */
+static std::string installed_runtime_dir()
+{
+    char exe[4096];
+    std::string dir;
+    ssize_t len;
+    size_t slash;
+
+    len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len == -1)
+        return "";
+    exe[len] = 0;
+
+    dir = exe;
+    slash = dir.rfind('/');
+    if (slash == std::string::npos)
+        return "";
+
+    dir = dir.substr(0, slash) + "/../lib/irid-aot";
+    if (access((dir + "/libirid-emul.a").c_str(), R_OK))
+        return "";
+    return dir;
+}
+
+static void short_usage()
+{
+    puts("usage: irid-aot [-h] [-o OUTPUT] [-r DIR] <image[:addr]> ...");
+}
+
+static void usage()
+{
+    short_usage();
+    puts("\nTranslate raw Irid images into a native executable. The images "
+         "are\nloaded the same way irid-emul loads them, and the reachable "
+         "code is\ncompiled ahead of time with the host C++ compiler ($CXX).\n\n"
+         "The emulator runtime is taken from --runtime, $IRID_AOT_DIR, the\n"
+         "lib/irid-aot directory next to the installed tool, or the source\n"
+         "tree, in that order.\n");
+    printf("Options:\n"
+           "  -h, --help            show this usage page\n"
+           "  -o, --output OUTPUT   output to a file (default a.out)\n"
+           "  -r, --runtime DIR     use the emulator library & headers in DIR\n"
+           "  -S, --source          only write the generated C++ source\n"
+           "  -v, --version         show the compiler version\n");
+}
+
+static void version()
+{
+    printf("irid-aot %d.%d\n", AOT_VER_MAJOR, AOT_VER_MINOR);
+}
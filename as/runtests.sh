@@ -1,16 +1,22 @@
 #!/bin/sh
 # Run the assembler testing suite.
 
+AS=${AS:-build/irid-as}
+LD=${LD:-../ld/build/irid-ld}
+
 sources=$(find tests -name '*.i')
 total=0
 failed=0
 
+mkdir -p build
+
 for source in $sources; do
     name=$(echo $(basename "$source") | cut -d'.' -f1)
 
     total=$(($total + 1))
-    irid-as -o build/result.iof tests/$name.i
-    irid-ld -o build/result.bin build/result.iof
+    rm -f build/result.bin
+    $AS -o build/result.iof tests/$name.i
+    $LD -o build/result.bin build/result.iof
     [ ! -f build/result.bin ] && {
         echo "[-] Failed $name"
         failed=$(($failed + 1))
@@ -21,13 +27,14 @@ for source in $sources; do
     r2=$(md5sum tests/$name.bin | cut -d' ' -f1)
 
     [ "$r1" = "$r2" ] && {
-        echo -e "[\033[32m+\033[0m] Passed $name"
+        printf "[\033[32m+\033[0m] Passed $name\n"
     } || {
-        echo -e "[\033[31m-\033[0m] Failed $name"
+        printf "[\033[31m-\033[0m] Failed $name\n"
         failed=$(($failed + 1))
     }
 done
 
 [ $failed = 0 ] || {
-    echo -e "\033[31m[-] Failed $failed out of $total test(s)\033[0m"
+    printf "\033[31m[-] Failed $failed out of $total test(s)\033[0m\n"
+    exit 1
 }
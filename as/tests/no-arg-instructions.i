@@ -4,3 +4,4 @@ restart:
     rti
     dsi
     ret
+    wfi
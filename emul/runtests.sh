@@ -0,0 +1,76 @@
+#!/bin/sh
+# Run the emulator testing suite.
+#
+# Each program in tests/ is linked with the sys/ entry point & I/O library,
+# then run by the interpreter, without fusion, with the JIT & built by
+# irid-aot. Every run has to print the output in tests/NAME.out. The program
+# gets tests/NAME.in as its input if there is one, & the emulator options
+# from a `; args:` line in its source.
+
+AS=${AS:-$(realpath ../as/build/irid-as)}
+LD=${LD:-$(realpath ../ld/build/irid-ld)}
+EMUL=${EMUL:-$(realpath build/irid-emul)}
+AOT=${AOT:-$(realpath ../aot/build/irid-aot)}
+
+tests=$(realpath tests)
+out=$(realpath build)/tests
+sys=$(realpath ../sys)
+total=0
+failed=0
+
+mkdir -p $out
+
+# The libraries read arch.i from the current directory.
+(cd $sys && $AS -o $out/entry.o entry.i && $AS -o $out/io.o io.i) || {
+    echo "[-] Failed to assemble sys/"
+    exit 1
+}
+
+fail() {
+    printf "[\033[31m-\033[0m] Failed %s (%s)\n" $name $1
+    failed=$(($failed + 1))
+}
+
+# run MODE COMMAND..., with the options of the test added to the command
+run() {
+    mode=$1
+    shift
+
+    input=/dev/null
+    [ -f $tests/$name.in ] && input=$tests/$name.in
+
+    timeout 10 "$@" $args < $input > $out/$name.$mode 2>&1
+    cmp -s $out/$name.$mode $tests/$name.out || {
+        fail $mode
+        return 1
+    }
+}
+
+for source in $tests/*.i; do
+    name=$(basename $source .i)
+    args=$(sed -n 's/^; args: //p' $source)
+    total=$(($total + 1))
+
+    (cd $sys && $AS -o $out/$name.o $source) \
+        && $LD -o $out/$name.bin $out/entry.o $out/io.o $out/$name.o \
+        || {
+            fail build
+            continue
+        }
+
+    $AOT -o $out/$name-aot $out/$name.bin > /dev/null || {
+        fail aot
+        continue
+    }
+
+    run interp $EMUL -i max $out/$name.bin \
+        && run nofusion $EMUL -i max -F $out/$name.bin \
+        && run jit $EMUL -i max -j $out/$name.bin \
+        && run aot $out/$name-aot -i max \
+        && printf "[\033[32m+\033[0m] Passed %s\n" $name
+done
+
+[ $failed = 0 ] || {
+    printf "\033[31m[-] Failed %d out of %d test(s)\033[0m\n" $failed $total
+    exit 1
+}
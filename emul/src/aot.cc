@@ -0,0 +1,7 @@
+/* Ahead-of-time compiled programs
+   Copyright (c) 2023-2024 bellrise */
+
+#include "emul.h"
+
+/* Set by the code generated by irid-aot, see aot_program. */
+const aot_program *aot_builtin = nullptr;
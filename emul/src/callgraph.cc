@@ -0,0 +1,171 @@
+/* Call graph profiler
+   Copyright (c) 2023-2024 bellrise */
+
+#include "emul.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+/* The ret_sp of a frame which is not left by a ret, above any 16-bit sp. */
+#define CALL_NO_RETURN 0x10000
+
+/* Follow every call, ret & interrupt, keeping a shadow call stack next to the
+   one of the program, so each instruction is counted for the function it ran
+   in & for all the calls on the way there. */
+void cpu::enable_callgraph()
+{
+    m_callgraph = true;
+}
+
+/* Leave every function, & start again from the one the CPU is in. */
+void cpu::reset_call_stack()
+{
+    while (!m_call_stack.empty())
+        leave_function(instructions(false));
+
+    enter_function({m_symbols.function(m_reg.ip), m_reg.ip, CALL_NO_RETURN,
+                    false, instructions(false), 0});
+}
+
+void cpu::enter_function(const call_frame& frame)
+{
+    m_call_stack.push_back(frame);
+}
+
+/* Leave the innermost function, counting what it ran for itself & for the
+   call which entered it. */
+void cpu::leave_function(uint64_t now)
+{
+    call_frame frame;
+    uint64_t inclusive;
+
+    frame = m_call_stack.back();
+    m_call_stack.pop_back();
+
+    inclusive = now - frame.start;
+    m_self_cost[frame.fn] += inclusive - frame.children;
+    if (m_call_stack.empty())
+        return;
+
+    call_frame& caller = m_call_stack.back();
+    call_cost& cost = m_call_costs[{caller.fn, frame.site, frame.fn}];
+    caller.children += inclusive;
+    cost.calls++;
+    cost.inclusive += inclusive;
+}
+
+/* Called by call & callr once the return address is pushed, before jumping
+   to `addr`. The call itself is counted for the caller. */
+void cpu::trace_call(u16 addr)
+{
+    /* The stack only grows while calls are made, so a function with its
+       return address at or above the new one was left without a ret, like
+       with a jmp out of it. */
+    while (!m_call_stack.empty() && !m_call_stack.back().interrupt
+           && m_call_stack.back().ret_sp <= m_reg.sp)
+        leave_function(instructions(false));
+
+    enter_function({m_symbols.function(addr), m_reg.ip, m_reg.sp, false,
+                    instructions(true), 0});
+}
+
+/* Called by ret with the sp it took the return address from. Only returns
+   to a call on the stack leave any function, else the ret is just a jump. */
+void cpu::trace_ret(u16 sp)
+{
+    size_t i;
+
+    for (i = m_call_stack.size(); i > 0; i--) {
+        if (m_call_stack[i - 1].interrupt)
+            return;
+        if (m_call_stack[i - 1].ret_sp == sp)
+            break;
+    }
+
+    if (!i)
+        return;
+
+    while (m_call_stack.size() >= i)
+        leave_function(instructions(true));
+}
+
+/* An interrupt is counted as a call from the function it came in, before the
+   instruction at ip. */
+void cpu::trace_interrupt(u16 addr, uint64_t now)
+{
+    enter_function({m_symbols.function(addr), m_reg.ip, CALL_NO_RETURN, true,
+                    now, 0});
+}
+
+/* Leave the handler & anything it did not return from. */
+void cpu::trace_rti()
+{
+    size_t i;
+
+    for (i = m_call_stack.size(); i > 0; i--) {
+        if (m_call_stack[i - 1].interrupt)
+            break;
+    }
+
+    if (!i)
+        return;
+
+    while (m_call_stack.size() >= i)
+        leave_function(instructions(true));
+}
+
+/* Write the call graph in the callgrind format, with the cost of each
+   function at its address & the cost of each call at the call site. There
+   are no source files, which callgrind itself names ???. Any function still
+   running is left first. */
+void cpu::write_callgraph(const std::string& path)
+{
+    uint64_t total;
+    FILE *out;
+
+    while (!m_call_stack.empty())
+        leave_function(instructions(false));
+
+    out = fopen(path.c_str(), "w");
+    if (!out) {
+        warn("failed to open %s: %s", path.c_str(), strerror(errno));
+        return;
+    }
+
+    total = 0;
+    for (const auto& fn : m_self_cost)
+        total += fn.second;
+
+    fprintf(out, "# callgrind format\n"
+                 "version: 1\n"
+                 "creator: irid-emul %s\n"
+                 "positions: instr\n"
+                 "events: Ir\n"
+                 "summary: %" PRIu64 "\n"
+                 "\n"
+                 "fl=???\n",
+            IRID_EMUL_VERSION, total);
+
+    for (const auto& fn : m_self_cost) {
+        fprintf(out, "fn=%s\n", m_symbols.name(fn.first).c_str());
+        fprintf(out, "0x%04x %" PRIu64 "\n", fn.first, fn.second);
+
+        /* Calls are sorted by their caller first. */
+        for (auto it = m_call_costs.lower_bound({fn.first, 0, 0});
+             it != m_call_costs.end() && std::get<0>(it->first) == fn.first;
+             it++) {
+            fprintf(out, "cfn=%s\n",
+                    m_symbols.name(std::get<2>(it->first)).c_str());
+            fprintf(out, "calls=%zu 0x%04x\n", it->second.calls,
+                    std::get<2>(it->first));
+            fprintf(out, "0x%04x %" PRIu64 "\n", std::get<1>(it->first),
+                    it->second.inclusive);
+        }
+        fputc('\n', out);
+    }
+
+    if (fclose(out))
+        warn("failed to write %s: %s", path.c_str(), strerror(errno));
+}
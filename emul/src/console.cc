@@ -3,25 +3,33 @@
 
 #include "emul.h"
 
-#include <ctype.h>
-#include <poll.h>
-#include <queue>
+#include <string.h>
+#include <string>
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <unistd.h>
 
 struct console_state
 {
-    int in;
     int out;
     bool control_mode;
-    std::queue<u8> readbuffer;
 };
 
 static u8 console_read(device&);
 static void console_write(device&, u8);
 static bool console_poll(device&);
 static void console_close(device&);
+static void console_write_range(device&, const u8 *, size_t);
+static size_t console_read_range(device&, u8 *, size_t);
+static void console_sink(int fd, const void *buf, size_t n);
+
+static const device_ops console_ops = {
+    console_close, console_write,       console_read,
+    console_poll,  console_write_range, console_read_range,
+    nullptr,       nullptr,             nullptr,
+    nullptr,       nullptr,             nullptr,
+    nullptr,       nullptr,             nullptr,
+};
 
 static inline console_state *state(device& self)
 {
@@ -33,16 +41,13 @@ device console_create(int in, int out)
     device console = {0x1000, "console"};
 
     console.state = new console_state;
+    console.input = new device_input(in);
+    console.output = new device_output(out, console_sink);
 
-    state(console)->readbuffer = std::queue<u8>();
     state(console)->control_mode = false;
-    state(console)->in = in;
     state(console)->out = out;
 
-    console.read = console_read;
-    console.write = console_write;
-    console.poll = console_poll;
-    console.close = console_close;
+    console.ops = &console_ops;
 
     return console;
 }
@@ -51,26 +56,19 @@ static u8 console_read(device& self)
 {
     u8 c;
 
-    /* First empty our own readbuffer. */
-    if (state(self)->readbuffer.size()) {
-        c = state(self)->readbuffer.front();
-        state(self)->readbuffer.pop();
-        return c;
-    }
-
-    /* Make this non-blocking by returning a NUL if stdin is empty. */
-    if (!console_poll(self))
-        return 0;
+    self.output->flush();
 
-    if (read(state(self)->in, &c, 1) <= 0)
+    /* Make this non-blocking by returning a NUL if stdin is empty. Control
+       replies are queued before any input. */
+    if (!self.input->read(c))
         return 0;
     return c;
 }
 
-static void queue_write_word(std::queue<u8>& buf, u16 word)
+static void queue_write_word(device_input *input, u16 word)
 {
-    buf.push(word & 0xff);
-    buf.push(word >> 8);
+    input->unread(word & 0xff);
+    input->unread(word >> 8);
 }
 
 static void cctl_size(device& self)
@@ -86,8 +84,8 @@ static void cctl_size(device& self)
         h = siz.ws_row;
     }
 
-    queue_write_word(state(self)->readbuffer, w);
-    queue_write_word(state(self)->readbuffer, h);
+    queue_write_word(self.input, w);
+    queue_write_word(self.input, h);
 }
 
 static void control(device& self, u8 code)
@@ -106,46 +104,86 @@ static void console_write(device& self, u8 byte)
         return;
     }
 
-    /* Writing to the console will only let printable characters through
-       to the console, while "firewalling" escape & control codes. */
+    /* If the user sends the control marker (17d / 11h), the console
+       will drop into a special control mode. */
 
-    if (isprint(byte) || byte == ' ' || byte == '\n' || byte == '\r'
-        || byte == 0x7F || byte == '\t') {
-        write(state(self)->out, &byte, 1);
+    if (byte == CONSOLE_CTRL) {
+        state(self)->control_mode = true;
         return;
     }
 
-    /* Clear screen command. */
+    /* Anything else is buffered, & filtered once the buffer is flushed. */
+    self.output->put(byte);
+}
 
-    if (byte == '\f') {
-        write(state(self)->out, "\033[2J\033[1;1H", 10);
+static void console_write_range(device& self, const u8 *buf, size_t n)
+{
+    /* Control codes are rare, so go byte by byte if there are any. */
+    if (state(self)->control_mode || memchr(buf, CONSOLE_CTRL, n)) {
+        for (size_t i = 0; i < n; i++)
+            console_write(self, buf[i]);
         return;
     }
 
-    /* If the user sends the control marker (17d / 11h), the console
-       will drop into a special control mode. */
+    self.output->put(buf, n);
+}
 
-    if (byte == CONSOLE_CTRL)
-        state(self)->control_mode = true;
+static size_t console_read_range(device& self, u8 *buf, size_t n)
+{
+    self.output->flush();
+    return self.input->read(buf, n);
 }
 
-static bool console_poll(device& self)
+/* Bytes which are let through to the console as they are. */
+static inline u8 is_plain(u8 byte)
+{
+    return (byte >= 0x20 && byte <= 0x7f) | (byte == '\n') | (byte == '\r')
+         | (byte == '\t');
+}
+
+static void console_sink(int fd, const void *buf, size_t n)
 {
-    /* First check our own readbuffer. */
-    if (state(self)->readbuffer.size())
-        return true;
+    const u8 *bytes = static_cast<const u8 *>(buf);
+    std::string filtered;
+    u8 blocked;
 
-    struct pollfd poll_rq;
-    poll_rq.fd = state(self)->in;
-    poll_rq.events = POLLIN;
+    /* Writing to the console will only let printable characters through
+       to the console, while "firewalling" escape & control codes. Nearly all
+       output is plain text, so the whole buffer is first checked in a loop
+       without branches, which the compiler can vectorize. */
+
+    blocked = 0;
+    for (size_t i = 0; i < n; i++)
+        blocked |= !is_plain(bytes[i]);
 
-    if (poll(&poll_rq, 1, 0) == -1)
-        return false;
+    if (!blocked) {
+        write_all(fd, buf, n);
+        return;
+    }
 
-    return (bool) (poll_rq.revents & POLLIN);
+    filtered.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        if (is_plain(bytes[i]))
+            filtered.push_back(bytes[i]);
+
+        /* Clear screen command. */
+        else if (bytes[i] == '\f')
+            filtered.append("\033[2J\033[1;1H");
+    }
+
+    write_all(fd, filtered.data(), filtered.size());
+}
+
+static bool console_poll(device& self)
+{
+    self.output->flush();
+    return self.input->ready();
 }
 
 static void console_close(device& self)
 {
+    self.output->flush();
     delete static_cast<console_state *>(self.state);
+    delete self.input;
+    delete self.output;
 }
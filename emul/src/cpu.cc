@@ -5,6 +5,7 @@
 
 #include <algorithm>
 #include <cstring>
+#include <inttypes.h>
 #include <stdio.h>
 #include <sys/signal.h>
 #include <termios.h>
@@ -13,17 +14,80 @@
 
 cpu::cpu(memory& memory)
     : m_mem(memory)
+    , m_aot(nullptr)
+    , m_native(false)
     , m_interrupts(false)
     , m_in_interrupt(false)
-    , m_cycle_ns(0)
-    , m_target_ips(0)
-    , m_total_instructions(0)
+    , m_pacer()
+    , m_next_pace(0)
+    , m_cycles(0)
+    , m_extra_cycles(0)
+    , m_cycle_costs()
+    , m_counting(false)
+    , m_loads(0)
+    , m_stores(0)
+    , m_branches(0)
+    , m_perf_base()
+    , m_histogram(false)
+    , m_slot_ops()
+    , m_stats()
+    , m_virtual_time(false)
+    , m_clock_hz(0)
+    , m_fusion(true)
+    , m_fused()
     , m_devices()
-{
+    , m_pending()
+    , m_irq_mask(0)
+    , m_irq_handlers(0)
+    , m_irq_masked(0)
+    , m_irq_levels()
+    , m_irq_count(0)
+    , m_irq_chained(0)
+    , m_idle_waits(0)
+    , m_idle_ns(0)
+    , m_idle_cycles(0)
+    , m_next_deadline(UINT64_MAX)
+    , m_spin_detect(false)
+    , m_spin_probing(false)
+    , m_spin_next(0)
+    , m_spin_interval(0)
+    , m_spin_resume(0)
+    , m_spin_irqs(0)
+    , m_spin_steps(0)
+    , m_spin_start()
+    , m_spin_parks(0)
+    , m_spin_skipped(0)
+    , m_profile(false)
+    , m_sample_interval(0)
+    , m_sample_next(0)
+    , m_symbols()
+    , m_samples()
+    , m_callgraph(false)
+    , m_call_stack()
+    , m_self_cost()
+    , m_call_costs()
+    , m_elapsed_ns(0)
+{
+    m_mem.on_code_write = [this](u16 addr, u16 n) {
+        m_icache.invalidate(addr, n);
+        if (m_jit)
+            m_jit->invalidate(addr, n);
+        if (m_aot)
+            m_aot->invalidate(addr, n);
+    };
+
+    /* Native code is only run on a flat layout, so only decoded instructions
+       depend on the mapping. */
+    m_mem.on_remap = [this](u16 addr, u16 n) { m_icache.invalidate(addr, n); };
+
     initialize();
 }
 
-cpu::~cpu() { }
+cpu::~cpu()
+{
+    m_mem.on_code_write = nullptr;
+    m_mem.on_remap = nullptr;
+}
 
 void handle_ctrlc(int __attribute__((unused)) sig)
 {
@@ -47,297 +111,1535 @@ void cpu::start()
     signal(SIGINT, handle_ctrlc);
 
     clock_gettime(CLOCK_MONOTONIC, &m_start_time);
+    m_next_pace = m_pacer.start(m_cycles);
+    schedule_events();
+    if (m_virtual_time)
+        run_timers();
+    if (m_callgraph)
+        reset_call_stack();
 
     while (1) {
         try {
-            mainloop();
+            if (m_native)
+                nativeloop();
+            else
+                mainloop();
         } catch (const cpu_fault& fault) {
+            flush_devices();
             dump_registers();
             die("CPU fault: %x", fault.fault);
         } catch (const cpucall_request& rq) {
+            flush_devices();
             if (rq.request == rq.RQ_RESTART) {
                 initialize();
+                if (m_callgraph)
+                    reset_call_stack();
                 continue;
             } else if (rq.request == rq.RQ_POWEROFF) {
                 break;
             }
         }
     }
+
+    m_elapsed_ns = now_ns() - ((long long) m_start_time.tv_sec * 1000000000
+                               + m_start_time.tv_nsec);
 }
 
 void cpu::set_target_ips(int target_ips)
 {
-    if (target_ips <= 0)
+    m_clock_hz = target_ips;
+    if (!m_virtual_time)
+        m_pacer.set_target_ips(target_ips);
+}
+
+void cpu::set_virtual_time(bool enabled)
+{
+    /* Guest time no longer follows the host clock, so there is nothing to
+       wait for. The target speed becomes the rate of the guest clock. */
+    m_virtual_time = enabled;
+    m_pacer.set_target_ips(enabled ? 0 : m_clock_hz);
+}
+
+/* Busy-wait detection. Once in a while, the CPU is stepped through the next
+   few instructions. If it gets back to the same registers without doing
+   anything but reading memory & polling devices, the program is stuck in a
+   loop until some device changes, so the CPU can sleep until one does. */
+
+/* Cycles between two probes, about a millisecond of guest time. */
+#define SPIN_MIN_INTERVAL 64
+#define SPIN_MAX_INTERVAL 65536
+
+/* Longest loop which is recognised, in dispatches. */
+#define SPIN_MAX_STEPS 16
+
+/* Longest single sleep, so devices which cannot wake the CPU, like the ones
+   past the first 64, still get polled by the loop now & then. */
+#define SPIN_PARK_NS 10000000
+
+cycle_costs::cycle_costs()
+{
+    std::fill(of, of + 256, 1);
+}
+
+bool cycle_costs::uniform() const
+{
+    return std::all_of(of, of + 256, [](u8 cost) { return cost == 1; });
+}
+
+/* Changing the costs drops all decoded instructions, as they carry their
+   own. */
+void cpu::set_cycle_costs(const cycle_costs& costs)
+{
+    m_cycle_costs = costs;
+    m_icache.flush();
+}
+
+void cpu::set_spin_detection(bool enabled)
+{
+    m_spin_detect = enabled;
+    m_spin_interval = SPIN_MAX_INTERVAL;
+    if (m_clock_hz) {
+        m_spin_interval = std::clamp(m_clock_hz / 1000, SPIN_MIN_INTERVAL,
+                                     SPIN_MAX_INTERVAL);
+    }
+}
+
+/* Called once the cycle count reaches m_next_pace. */
+void cpu::pace()
+{
+    if (m_spin_probing) {
+        probe_spin();
+        return;
+    }
+
+    if (m_profile && m_cycles >= m_sample_next)
+        sample();
+
+    m_next_pace = m_pacer.pace(m_cycles);
+    if (m_virtual_time)
+        run_timers();
+
+    /* A probe resumes at the next pace, which has to include the next
+       sample. */
+    if (m_spin_detect && m_cycles >= m_spin_next) {
+        if (m_profile)
+            m_next_pace = std::min(m_next_pace, m_sample_next);
+        start_spin_probe();
+    } else {
+        schedule_events();
+    }
+}
+
+/* Bring the next pace forward to the next busy-wait probe or sample. */
+void cpu::schedule_events()
+{
+    if (m_spin_detect)
+        m_next_pace = std::min(m_next_pace, m_spin_next);
+    if (m_profile)
+        m_next_pace = std::min(m_next_pace, m_sample_next);
+}
+
+void cpu::start_spin_probe()
+{
+    m_spin_probing = true;
+    m_spin_resume = m_next_pace;
+    m_spin_irqs = m_irq_count;
+    m_spin_steps = 0;
+    m_spin_start = m_reg;
+
+    if (!spin_safe()) {
+        stop_spin_probe();
+        return;
+    }
+
+    m_next_pace = m_cycles + 1;
+}
+
+/* Called after every instruction of the probe. */
+void cpu::probe_spin()
+{
+    /* The probe never holds back the pacer or a timer. */
+    if (m_cycles >= m_spin_resume) {
+        stop_spin_probe();
+        pace();
+        return;
+    }
+
+    /* An interrupt handler may return to the same registers, but it did
+       something in between. */
+    if (m_irq_count != m_spin_irqs || ++m_spin_steps > SPIN_MAX_STEPS) {
+        stop_spin_probe();
+        return;
+    }
+
+    if (memcmp(&m_reg, &m_spin_start, sizeof(m_reg))) {
+        if (!spin_safe())
+            stop_spin_probe();
+        else
+            m_next_pace = m_cycles + 1;
+        return;
+    }
+
+    /* Every device which is pending now was already polled by the loop, so
+       only a new one can change its outcome. */
+    m_spin_parks++;
+    m_spin_skipped += idle(~m_pending.load(), SPIN_PARK_NS);
+
+    /* Look again straight away, in case the loop is still waiting. */
+    m_spin_probing = false;
+    m_spin_next = m_cycles;
+    m_next_pace = m_cycles + 1;
+}
+
+void cpu::stop_spin_probe()
+{
+    m_spin_probing = false;
+    m_spin_next = m_cycles + m_spin_interval;
+    m_next_pace = std::min(m_spin_resume, m_spin_next);
+}
+
+/* Check if the instruction about to run cannot change anything but the
+   registers, so running it again with the same registers does the same. */
+bool cpu::spin_safe()
+{
+    switch (fetch()->handler) {
+    case H_CPUCALL:
+        return m_reg.r0 == CPUCALL_DEVICEPOLL || m_reg.r0 == CPUCALL_CLOCK;
+    case H_DECODE:
+    case H_RTI:
+    case H_STI:
+    case H_DSI:
+    case H_WFI:
+    case H_PUSH_W:
+    case H_PUSH_H:
+    case H_PUSH8:
+    case H_PUSH16:
+    case H_STORE_W:
+    case H_STORE_H:
+    case H_STORE16_W:
+    case H_STORE16_H:
+    case H_CALL:
+    case H_CALLR:
+    case H_BP_STORE_W:
+    case H_BP_STORE_H:
+    case H_PUSH2:
+        return false;
+    default:
+        return true;
+    }
+}
+
+/* Expire the virtual timers which are due, & stop at the cycle where the
+   next one is. */
+void cpu::run_timers()
+{
+    uint64_t deadline;
+    uint64_t now;
+    size_t at;
+
+    now = guest_time();
+    deadline = UINT64_MAX;
+    for (device& dev : m_devices) {
+        if (dev.ops && dev.ops->tick)
+            deadline = std::min(deadline, dev.ops->tick(dev, now));
+    }
+
+    m_next_deadline = deadline;
+    if (deadline == UINT64_MAX)
+        return;
+
+    /* Round up, so the timer is never early. */
+    at = ((unsigned __int128) deadline * m_clock_hz + 999999999) / 1000000000;
+    at = at > m_idle_cycles ? at - m_idle_cycles : 0;
+    m_next_pace = std::min(m_next_pace, std::max(at, m_cycles + 1));
+}
+
+/* Guest time in nanoseconds, since the CPU started. */
+uint64_t cpu::guest_time() const
+{
+    struct timespec now;
+
+    if (m_virtual_time) {
+        return (unsigned __int128) (m_cycles + m_idle_cycles)
+             * 1000000000 / m_clock_hz;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) (now.tv_sec - m_start_time.tv_sec) * 1000000000
+         + (now.tv_nsec - m_start_time.tv_nsec);
+}
+
+void cpu::enable_jit()
+{
+    if (!jit::supported()) {
+        warn("the JIT is not supported on this host, using the interpreter");
+        return;
+    }
+
+    m_jit = std::make_unique<jit>(m_mem);
+    m_native = true;
+}
+
+void cpu::enable_aot(const aot_program& program)
+{
+    /* Writes into translated code have to invalidate it. */
+    for (size_t i = 0; i < program.n_blocks; i++) {
+        const aot_block& block = program.blocks[i];
+        for (unsigned addr = block.start; addr < block.end; addr += 4)
+            m_mem.watch_code(addr);
+    }
+
+    m_aot = &program;
+    m_native = true;
+}
+
+void cpu::set_fusion(bool enabled)
+{
+    m_fusion = enabled;
+    m_icache.flush();
+}
+
+/* Called after an instruction which takes more than a cycle, or for every
+   instruction while events are counted. */
+void cpu::account(const insn *in)
+{
+    stall(in->stall & ~STALL_COUNT);
+    if (in->stall & STALL_COUNT)
+        count(in);
+}
+
+/* Count the events of an instruction which just ran. It is only known by its
+   slot, which is at the address it ran from. */
+void cpu::count(const insn *in)
+{
+    uint32_t ops;
+    bool taken;
+    u16 addr;
+
+    addr = in - &m_icache.at(0);
+
+    if (m_histogram) {
+        ops = m_slot_ops[addr];
+        for (int i = ops >> 24; i; i--, ops >>= 8)
+            m_stats.opcodes[ops & 0xff]++;
+    }
+
+    switch (in->handler) {
+    case H_LOAD_W:
+    case H_LOAD_H:
+    case H_LOAD16_W:
+    case H_LOAD16_H:
+    case H_POP_W:
+    case H_POP_H:
+    case H_BP_LOAD_W:
+    case H_BP_LOAD_H:
+        m_loads++;
+        break;
+    case H_POP2:
+        m_loads += 2;
+        break;
+    case H_STORE_W:
+    case H_STORE_H:
+    case H_STORE16_W:
+    case H_STORE16_H:
+    case H_PUSH_W:
+    case H_PUSH_H:
+    case H_PUSH8:
+    case H_PUSH16:
+    case H_BP_STORE_W:
+    case H_BP_STORE_H:
+        m_stores++;
+        break;
+    case H_PUSH2:
+        m_stores += 2;
+        break;
+    case H_JMP:
+    case H_ADD_JMP_W:
+    case H_ADD_JMP_H:
+        m_branches++;
+        break;
+    case H_CALL:
+    case H_CALLR:
+        m_stores++;
+        m_branches++;
+        break;
+    case H_RET:
+        m_loads++;
+        m_branches++;
+        break;
+    case H_JNZ_W:
+    case H_JNZ_H:
+        taken = m_reg.ip != (u16) (addr + 4);
+        m_branches += taken;
+        m_stats.jnz_taken += taken;
+        m_stats.jnz_not_taken += !taken;
+        break;
+    case H_JEQ:
+        taken = m_reg.ip != (u16) (addr + 4);
+        m_branches += taken;
+        m_stats.jeq_taken += taken;
+        m_stats.jeq_not_taken += !taken;
+        break;
+    case H_CMP_JEQ_WW:
+    case H_CMP_JEQ_WH:
+    case H_CMP_JEQ_HW:
+    case H_CMP_JEQ_HH:
+    case H_CMP8_JEQ_W:
+    case H_CMP8_JEQ_H:
+    case H_CMP16_JEQ_W:
+    case H_CMP16_JEQ_H:
+    case H_CFS_JEQ:
+        taken = m_reg.ip != (u16) (addr + 8);
+        m_branches += taken;
+        m_stats.jeq_taken += taken;
+        m_stats.jeq_not_taken += !taken;
+        break;
+    }
+}
+
+/* Counting events takes a call after every instruction, so it only starts
+   once the program asks for them. Native code does not count anything, so
+   from then on only the interpreter runs. */
+void cpu::start_counting()
+{
+    if (m_counting)
         return;
 
-    m_cycle_ns = 1000000000 / target_ips;
-    m_target_ips = target_ips;
+    m_counting = true;
+    m_native = false;
+    m_icache.flush();
 }
 
-void cpu::print_perf()
+/* Count every opcode the program runs from the start, see cpu::count(). */
+void cpu::enable_histogram()
 {
-    struct timespec cur_time;
-    double avg_ips;
-    double avg_cycle;
-    char prefix = ' ';
+    m_histogram = true;
+    m_slot_ops.assign(icache::size, 0);
+    start_counting();
+}
 
-    clock_gettime(CLOCK_MONOTONIC, &cur_time);
-    avg_ips = cur_time.tv_sec - m_start_time.tv_sec;
-    if (avg_ips == 0)
-        avg_ips = 1;
-    avg_ips = m_total_instructions / avg_ips;
+uint32_t cpu::slot_ops(u16 addr, u16 handler)
+{
+    uint32_t ops;
+    int n;
 
-    if (avg_ips > 1000) {
-        prefix = 'k';
-        avg_ips /= 1000;
+    switch (handler) {
+    case H_BP_LOAD_W:
+    case H_BP_LOAD_H:
+    case H_BP_STORE_W:
+    case H_BP_STORE_H:
+        n = 3;
+        break;
+    case H_CMP_JEQ_WW:
+    case H_CMP_JEQ_WH:
+    case H_CMP_JEQ_HW:
+    case H_CMP_JEQ_HH:
+    case H_CMP8_JEQ_W:
+    case H_CMP8_JEQ_H:
+    case H_CMP16_JEQ_W:
+    case H_CMP16_JEQ_H:
+    case H_CFS_JEQ:
+    case H_BP_OFFSET:
+    case H_PUSH2:
+    case H_POP2:
+    case H_ADD_JMP_W:
+    case H_ADD_JMP_H:
+        n = 2;
+        break;
+    default:
+        n = 1;
     }
 
-    avg_cycle = (double) (cur_time.tv_sec - m_start_time.tv_sec)
-              / m_total_instructions * 1000000;
+    /* The parts of a superinstruction were all fetched when it was fused. */
+    ops = n << 24;
+    for (int i = 0; i < n; i++)
+        ops |= (uint32_t) (u8) m_mem.fetch32(addr + 4 * i) << 8 * i;
+
+    return ops;
+}
+
+uint64_t cpu::perf_counter(int counter) const
+{
+    switch (counter) {
+    case IRID_PERF_INSTRUCTIONS:
+        return m_cycles - m_extra_cycles;
+    case IRID_PERF_CYCLES:
+        return m_cycles;
+    case IRID_PERF_LOADS:
+        return m_loads;
+    case IRID_PERF_STORES:
+        return m_stores;
+    case IRID_PERF_BRANCHES:
+        return m_branches;
+    case IRID_PERF_INTERRUPTS:
+        return m_irq_count;
+    }
 
-    puts("\nCPU performance results:\n");
-    printf("  total instructions    %zu\n", m_total_instructions);
-    printf("  average IPS           %.2lf %.1sHz\n", avg_ips,
-           prefix == ' ' ? "" : &prefix);
-    printf("  average cycle time    %.2lf us\n", avg_cycle);
-    printf("  target IPS            %d Hz\n", m_target_ips);
-    fputc('\n', stdout);
+    return 0;
 }
 
 void cpu::add_device(const device& dev)
 {
+    size_t index = m_devices.size();
+
     m_devices.push_back(dev);
+    m_registry.add(dev.id, index);
+    if (dev.output)
+        m_io.watch(dev.output);
+
+    /* Each device gets its own bit in the pending mask, so the ones which
+       can interrupt are limited to the first 64. Any other device is only
+       polled, its input never becomes pending. */
+    if (index < 64)
+        m_devices[index].bit = (uint64_t) 1 << index;
+    if (!dev.input)
+        return;
+
+    if (m_devices[index].bit) {
+        dev.input->pending = &m_pending;
+        dev.input->bit = m_devices[index].bit;
+    }
+    if (dev.input->fd != -1)
+        m_io.watch(dev.input);
 }
 
 void cpu::remove_devices()
 {
+    /* The I/O thread writes into device input, which is freed by close. */
+    m_io.stop();
+
     for (device& dev : m_devices) {
-        if (dev.close)
-            dev.close(dev);
+        if (dev.ops && dev.ops->close)
+            dev.ops->close(dev);
     }
 
     m_devices.clear();
-}
+    m_registry.clear();
+}
+
+/* Threaded dispatch: each handler jumps straight to the next one through
+   the dispatch table, instead of going back to the top of a loop. */
+#ifdef IRID_COMPUTED_GOTO
+# define _label_addr(NAME) &&L_##NAME,
+# define HANDLER(NAME)     L_##NAME
+# define DISPATCH()        goto *dispatch_table[in->handler]
+# define DISPATCH_BEGIN()  DISPATCH();
+# define DISPATCH_END
+#else
+# define HANDLER(NAME)    case H_##NAME
+# define DISPATCH()       goto dispatch
+# define DISPATCH_BEGIN() dispatch: switch (in->handler) {
+# define DISPATCH_END     }
+#endif
+
+/* Finish the current instruction and jump to the next one. The pacer is only
+   consulted once every quantum of clock cycles.
+
+   Before we load & run another instruction, check if any device has incoming
+   data. We also have to wait with issuing interrupts after we exit any
+   currently-being-processed interrupts. */
+#define NEXT()                                                                 \
+    do {                                                                       \
+        if (in->stall)                                                         \
+            account(in);                                                       \
+        if (++m_cycles >= m_next_pace)                                         \
+            pace();                                                            \
+        if (interrupt_pending())                                               \
+            poll_devices();                                                    \
+        in = fetch();                                                          \
+        DISPATCH();                                                            \
+    } while (0)
+
+/* Finish a control transfer. With native code enabled, the interpreter only
+   runs a single basic block at a time, so return to nativeloop(). */
+#define BRANCH()                                                               \
+    do {                                                                       \
+        if (m_native) {                                                        \
+            if (in->stall)                                                     \
+                account(in);                                                   \
+            m_cycles++;                                                        \
+            return;                                                            \
+        }                                                                      \
+        NEXT();                                                                \
+    } while (0)
+
+/* Step over the current instruction and run the next one. */
+#define STEP()                                                                 \
+    do {                                                                       \
+        m_reg.ip += 4;                                                         \
+        NEXT();                                                                \
+    } while (0)
+
+/* Handlers for an instruction specialized on the width of its register
+   operands, see IRID_HANDLERS. */
+#define HANDLERS_W_H(NAME, FN, ...)                                            \
+    HANDLER(NAME##_W):                                                         \
+        FN<u16>(__VA_ARGS__);                                                  \
+        STEP();                                                                \
+    HANDLER(NAME##_H):                                                         \
+        FN<u8>(__VA_ARGS__);                                                   \
+        STEP();
+
+#define HANDLERS_WW_HH(NAME, FN, ...)                                          \
+    HANDLER(NAME##_WW):                                                        \
+        FN<u16, u16>(__VA_ARGS__);                                             \
+        STEP();                                                                \
+    HANDLER(NAME##_WH):                                                        \
+        FN<u16, u8>(__VA_ARGS__);                                              \
+        STEP();                                                                \
+    HANDLER(NAME##_HW):                                                        \
+        FN<u8, u16>(__VA_ARGS__);                                              \
+        STEP();                                                                \
+    HANDLER(NAME##_HH):                                                        \
+        FN<u8, u8>(__VA_ARGS__);                                               \
+        STEP();
+
+/* Account for a superinstruction of N instructions, the last of which is
+   counted by STEP() or BRANCH(). */
+#define FUSED(KIND, N)                                                         \
+    do {                                                                       \
+        m_fused[KIND]++;                                                       \
+        m_cycles += (N) - 1;                                                   \
+    } while (0)
+
+/* Run the jeq of a fused compare & jeq. Both outcomes get their own
+   dispatch, so the jump stays a predicted branch instead of becoming a
+   conditional move, which would make the next dispatch wait on the compare. */
+#define JEQ_AFTER(KIND, TARGET)                                                \
+    do {                                                                       \
+        FUSED(KIND, 2);                                                        \
+        if (m_reg.cf) {                                                        \
+            m_reg.ip = (TARGET);                                               \
+            BRANCH();                                                          \
+        }                                                                      \
+        m_reg.ip += 8;                                                         \
+        BRANCH();                                                              \
+    } while (0)
+
+#define HANDLERS_W_H_JEQ(NAME, FN, TARGET, ...)                                \
+    HANDLER(NAME##_W):                                                         \
+        FN<u16>(__VA_ARGS__);                                                  \
+        JEQ_AFTER(FUSE_CMP_JEQ, TARGET);                                       \
+    HANDLER(NAME##_H):                                                         \
+        FN<u8>(__VA_ARGS__);                                                   \
+        JEQ_AFTER(FUSE_CMP_JEQ, TARGET);
+
+#define HANDLERS_WW_HH_JEQ(NAME, FN, TARGET, ...)                              \
+    HANDLER(NAME##_WW):                                                        \
+        FN<u16, u16>(__VA_ARGS__);                                             \
+        JEQ_AFTER(FUSE_CMP_JEQ, TARGET);                                       \
+    HANDLER(NAME##_WH):                                                        \
+        FN<u16, u8>(__VA_ARGS__);                                              \
+        JEQ_AFTER(FUSE_CMP_JEQ, TARGET);                                       \
+    HANDLER(NAME##_HW):                                                        \
+        FN<u8, u16>(__VA_ARGS__);                                              \
+        JEQ_AFTER(FUSE_CMP_JEQ, TARGET);                                       \
+    HANDLER(NAME##_HH):                                                        \
+        FN<u8, u8>(__VA_ARGS__);                                               \
+        JEQ_AFTER(FUSE_CMP_JEQ, TARGET);
 
 void cpu::mainloop()
 {
-    struct timespec instr_time_start;
-    struct timespec instr_time_end;
-    struct timespec sleep_time;
-    int nsec;
-    u8 instr;
+#ifdef IRID_COMPUTED_GOTO
+    static const void *const dispatch_table[] = {
+        IRID_HANDLERS(_label_addr)};
+#endif
+    insn *in;
+
+    if (interrupt_pending())
+        poll_devices();
+    in = fetch();
+
+    /* Run instruction. */
+    DISPATCH_BEGIN()
+
+    HANDLER(DECODE):
+        decode(m_reg.ip, *in);
+        DISPATCH();
+    HANDLER(NOP):
+        STEP();
+    HANDLER(CPUCALL):
+        cpucall();
+        STEP();
+    HANDLER(RTI):
+        rti();
+        BRANCH();
+    HANDLER(STI):
+        m_interrupts = true;
+        STEP();
+    HANDLER(DSI):
+        m_interrupts = false;
+        STEP();
+    HANDLER(WFI):
+        wait_for_interrupt();
+        STEP();
+    HANDLERS_W_H(PUSH, push, in->dest)
+    HANDLER(PUSH8):
+        push8(in->dest);
+        STEP();
+    HANDLER(PUSH16):
+        push16(in->imm);
+        STEP();
+    HANDLERS_W_H(POP, pop, in->dest)
+    HANDLERS_WW_HH(MOV, mov, in->dest, in->src)
+    HANDLERS_W_H(MOV8, mov8, in->dest, in->src)
+    HANDLERS_W_H(MOV16, mov16, in->dest, in->imm)
+    HANDLERS_W_H(LOAD, load, in->dest, in->src)
+    HANDLERS_W_H(STORE, store, in->dest, in->src)
+    HANDLERS_W_H(LOAD16, load16, in->dest, in->imm)
+    HANDLERS_W_H(STORE16, store16, in->dest, in->imm)
+    HANDLERS_W_H(NULL, null, in->dest)
+    HANDLERS_WW_HH(CMP, cmp, in->dest, in->src)
+    HANDLERS_W_H(CMP8, cmp8, in->dest, in->src)
+    HANDLERS_W_H(CMP16, cmp16, in->dest, in->imm)
+    HANDLERS_WW_HH(CMG, cmg, in->dest, in->src)
+    HANDLER(CMG8):
+        cmg8(in->dest, in->src);
+        STEP();
+    HANDLERS_W_H(CMG16, cmg16, in->dest, in->imm)
+    HANDLERS_WW_HH(CML, cml, in->dest, in->src)
+    HANDLER(CML8):
+        cml8(in->dest, in->src);
+        STEP();
+    HANDLERS_W_H(CML16, cml16, in->dest, in->imm)
+    HANDLER(CFS):
+        cfs();
+        STEP();
+    HANDLER(JMP):
+        jmp(in->imm);
+        BRANCH();
+    HANDLER(JNZ_W):
+        jnz<u16>(in->dest, in->imm);
+        BRANCH();
+    HANDLER(JNZ_H):
+        jnz<u8>(in->dest, in->imm);
+        BRANCH();
+    HANDLER(JEQ):
+        jeq(in->imm);
+        BRANCH();
+    HANDLER(CALL):
+        call(in->imm);
+        BRANCH();
+    HANDLER(CALLR):
+        callr(in->dest);
+        BRANCH();
+    HANDLER(RET):
+        ret();
+        BRANCH();
+    HANDLERS_WW_HH(ADD, add, in->dest, in->src)
+    HANDLERS_W_H(ADD8, add8, in->dest, in->src)
+    HANDLERS_W_H(ADD16, add16, in->dest, in->imm)
+    HANDLERS_WW_HH(SUB, sub, in->dest, in->src)
+    HANDLERS_W_H(SUB8, sub8, in->dest, in->src)
+    HANDLERS_W_H(SUB16, sub16, in->dest, in->imm)
+    HANDLERS_WW_HH(AND, and_, in->dest, in->src)
+    HANDLERS_W_H(AND8, and8, in->dest, in->src)
+    HANDLERS_W_H(AND16, and16, in->dest, in->imm)
+    HANDLERS_WW_HH(OR, or_, in->dest, in->src)
+    HANDLERS_W_H(OR8, or8, in->dest, in->src)
+    HANDLERS_W_H(OR16, or16, in->dest, in->imm)
+    HANDLERS_W_H(NOT, not_, in->dest)
+    HANDLERS_W_H(SHR, shr, in->dest, in->src)
+    HANDLERS_W_H(SHR8, shr8, in->dest, in->src)
+    HANDLERS_W_H(SHL, shl, in->dest, in->src)
+    HANDLERS_W_H(SHL8, shl8, in->dest, in->src)
+    HANDLERS_WW_HH(MUL, mul, in->dest, in->src)
+    HANDLERS_W_H(MUL8, mul8, in->dest, in->src)
+    HANDLERS_W_H(MUL16, mul16, in->dest, in->imm)
+
+    /* Superinstructions. Each part moves ip as the single instruction would,
+       so a fault in a later part is reported at the right address. */
+
+    HANDLERS_WW_HH_JEQ(CMP_JEQ, cmp, in->imm, in->dest, in->src)
+    HANDLERS_W_H_JEQ(CMP8_JEQ, cmp8, in->imm, in->dest, in->src)
+    HANDLERS_W_H_JEQ(CMP16_JEQ, cmp16, in->imm2, in->dest, in->imm)
+    HANDLER(CFS_JEQ):
+        cfs();
+        JEQ_AFTER(FUSE_CFS_JEQ, in->imm);
+    HANDLER(BP_OFFSET):
+        reg<u16>(in->dest) = m_reg.bp - in->imm;
+        m_reg.ip += 4;
+        FUSED(FUSE_BP_OFFSET, 2);
+        STEP();
+    HANDLER(BP_LOAD_W):
+        reg<u16>(in->dest) = m_reg.bp - in->imm;
+        m_reg.ip += 8;
+        load<u16>(in->src, in->dest);
+        FUSED(FUSE_BP_LOAD, 3);
+        STEP();
+    HANDLER(BP_LOAD_H):
+        reg<u16>(in->dest) = m_reg.bp - in->imm;
+        m_reg.ip += 8;
+        load<u8>(in->src, in->dest);
+        FUSED(FUSE_BP_LOAD, 3);
+        STEP();
+    HANDLER(BP_STORE_W):
+        reg<u16>(in->dest) = m_reg.bp - in->imm;
+        m_reg.ip += 8;
+        store<u16>(in->src, in->dest);
+        FUSED(FUSE_BP_STORE, 3);
+        STEP();
+    HANDLER(BP_STORE_H):
+        reg<u16>(in->dest) = m_reg.bp - in->imm;
+        m_reg.ip += 8;
+        store<u8>(in->src, in->dest);
+        FUSED(FUSE_BP_STORE, 3);
+        STEP();
+    HANDLER(PUSH2):
+        push<u16>(in->dest);
+        m_reg.ip += 4;
+        /* The first push may have overwritten the second one. */
+        if (in->handler == H_DECODE)
+            NEXT();
+        push<u16>(in->src);
+        FUSED(FUSE_PUSH2, 2);
+        STEP();
+    HANDLER(POP2):
+        pop<u16>(in->dest);
+        m_reg.ip += 4;
+        pop<u16>(in->src);
+        FUSED(FUSE_POP2, 2);
+        STEP();
+    HANDLER(ADD_JMP_W):
+        reg<u16>(in->dest) += in->imm2;
+        m_reg.ip += 4;
+        jmp(in->imm);
+        FUSED(FUSE_ADD_JMP, 2);
+        BRANCH();
+    HANDLER(ADD_JMP_H):
+        reg<u8>(in->dest) += in->imm2;
+        m_reg.ip += 4;
+        jmp(in->imm);
+        FUSED(FUSE_ADD_JMP, 2);
+        BRANCH();
+
+    DISPATCH_END
+}
+
+#undef HANDLER
+#undef DISPATCH
+#undef DISPATCH_BEGIN
+#undef DISPATCH_END
+#undef NEXT
+#undef BRANCH
+#undef STEP
+#undef HANDLERS_W_H
+#undef HANDLERS_WW_HH
+#undef FUSED
+#undef JEQ_AFTER
+#undef HANDLERS_W_H_JEQ
+#undef HANDLERS_WW_HH_JEQ
+
+/* Maximum amount of instructions run by native code before devices are
+   polled again, if interrupts are enabled. */
+#define NATIVE_POLL_INTERVAL 1024
+
+void cpu::nativeloop()
+{
+    const void *block;
+    size_t executed;
+    size_t budget;
 
     while (1) {
-        /* Start the instruction cycle. */
+        /* Device polling, interrupts & pacing are only handled at block
+           boundaries. */
 
-        clock_gettime(CLOCK_MONOTONIC, &instr_time_start);
+        if (m_cycles >= m_next_pace)
+            pace();
 
-        /* Before we load & run another instruction, poll all devices for any
-           incoming data. We also have to wait with polling the devices after
-           we exit any currently-being-processed interrupts. */
+        if (interrupt_pending())
+            poll_devices();
+
+        /* Native code accesses memory directly, which is only valid as long
+           as the guest did not remap any pages. A busy-wait probe has to
+           see every instruction. */
+        if (!m_mem.flat() || m_spin_probing) {
+            mainloop();
+            continue;
+        }
+
+        if (m_jit)
+            block = m_jit->profile(m_reg.ip);
+        else
+            block = m_aot->lookup(m_reg.ip);
+
+        if (!block) {
+            mainloop();
+            continue;
+        }
 
+        budget = m_next_pace - m_cycles;
         if (m_interrupts && !m_in_interrupt)
-            poll_devices();
+            budget = std::min(budget, (size_t) NATIVE_POLL_INTERVAL);
 
-        instr = m_mem.read8(m_reg.ip);
+        /* Native code only runs with every instruction taking a cycle. */
+        if (m_jit)
+            executed = m_jit->run(block, m_reg, budget);
+        else
+            executed = m_aot->run(block, m_reg, m_mem, budget);
 
-        /* Run instruction. */
-        switch (instr) {
-        case I_CPUCALL:
-            cpucall();
-            break;
-        case I_RTI:
-            rti();
-            goto dont_step;
-        case I_STI:
-            m_interrupts = true;
-            break;
-        case I_DSI:
-            m_interrupts = false;
-            break;
-        case I_PUSH:
-            push(m_mem.read8(m_reg.ip + 1));
-            break;
-        case I_PUSH8:
-            push8(m_mem.read8(m_reg.ip + 1));
-            break;
-        case I_PUSH16:
-            push16(m_mem.read16(m_reg.ip + 1));
-            break;
-        case I_POP:
-            pop(m_mem.read8(m_reg.ip + 1));
-            break;
-        case I_MOV:
-            mov(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_MOV8:
-            mov8(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_MOV16:
-            mov16(m_mem.read8(m_reg.ip + 1), m_mem.read16(m_reg.ip + 2));
-            break;
-        case I_LOAD:
-            load(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_STORE:
-            store(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_LOAD16:
-            load16(m_mem.read8(m_reg.ip + 1), m_mem.read16(m_reg.ip + 2));
-            break;
-        case I_STORE16:
-            store16(m_mem.read8(m_reg.ip + 1), m_mem.read16(m_reg.ip + 2));
-            break;
-        case I_NULL:
-            null(m_mem.read8(m_reg.ip + 1));
-            break;
-        case I_CMP:
-            cmp(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_CMP8:
-            cmp8(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_CMP16:
-            cmp16(m_mem.read8(m_reg.ip + 1), m_mem.read16(m_reg.ip + 2));
-            break;
-        case I_CMG:
-            cmg(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_CMG8:
-            cmg8(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_CMG16:
-            cmg16(m_mem.read8(m_reg.ip + 1), m_mem.read16(m_reg.ip + 2));
-            break;
-        case I_CML:
-            cml(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_CML8:
-            cml8(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_CML16:
-            cml16(m_mem.read8(m_reg.ip + 1), m_mem.read16(m_reg.ip + 2));
-            break;
-        case I_CFS:
-            cfs();
-            break;
-        case I_JMP:
-            jmp(m_mem.read16(m_reg.ip + 1));
-            goto dont_step;
-        case I_JNZ:
-            jnz(m_mem.read8(m_reg.ip + 1), m_mem.read16(m_reg.ip + 2));
-            goto dont_step;
-        case I_JEQ:
-            jeq(m_mem.read16(m_reg.ip + 1));
-            goto dont_step;
-        case I_CALL:
-            call(m_mem.read16(m_reg.ip + 1));
-            goto dont_step;
-        case I_CALLR:
-            callr(m_mem.read8(m_reg.ip + 1));
-            goto dont_step;
-        case I_RET:
-            ret();
-            goto dont_step;
-        case I_ADD:
-            add(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_ADD8:
-            add8(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_ADD16:
-            add16(m_mem.read8(m_reg.ip + 1), m_mem.read16(m_reg.ip + 2));
-            break;
-        case I_SUB:
-            sub(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_SUB8:
-            sub8(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_SUB16:
-            sub16(m_mem.read8(m_reg.ip + 1), m_mem.read16(m_reg.ip + 2));
-            break;
-        case I_AND:
-            and_(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_AND8:
-            and8(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_AND16:
-            and16(m_mem.read8(m_reg.ip + 1), m_mem.read16(m_reg.ip + 2));
-            break;
-        case I_OR:
-            or_(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_OR8:
-            or8(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_OR16:
-            or16(m_mem.read8(m_reg.ip + 1), m_mem.read16(m_reg.ip + 2));
-            break;
-        case I_NOT:
-            not_(m_mem.read8(m_reg.ip + 1));
-            break;
-        case I_SHR:
-            shr(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_SHR8:
-            shr8(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_SHL:
-            shl(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_SHL8:
-            shl8(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
-            break;
-        case I_MUL:
-            mul(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
+        /* A block may leave before its first instruction, the interpreter
+           always gets past it. */
+        if (!executed) {
+            mainloop();
+            continue;
+        }
+
+        m_cycles += executed;
+    }
+}
+
+insn *cpu::fetch()
+{
+    return &m_icache.at(m_reg.ip);
+}
+
+/* Resolve a register ID into its offset in the register file. Returns the
+   width variant of the handler, 0 for a full and 1 for a half register. */
+static u16 resolve(u8 id, u8& offset)
+{
+    if (id <= R_R7) {
+        offset = id * sizeof(u16);
+        return 0;
+    }
+
+    if (id >= R_H0 && id <= R_H3) {
+        offset = (id - R_H0) * sizeof(u16);
+        return 1;
+    }
+
+    if (id >= R_L0 && id <= R_L3) {
+        offset = (id - R_L0) * sizeof(u16) + 1;
+        return 1;
+    }
+
+    switch (id) {
+    case R_IP:
+        offset = offsetof(irid_reg, ip);
+        return 0;
+    case R_SP:
+        offset = offsetof(irid_reg, sp);
+        return 0;
+    case R_BP:
+        offset = offsetof(irid_reg, bp);
+        return 0;
+    }
+
+    throw cpu_fault(CPUFAULT_REG);
+}
+
+/* Pick the handler variant for a destination register. */
+static u16 dest_variant(u16 base, u8 id, insn& ins)
+{
+    return base + resolve(id, ins.dest);
+}
+
+/* Pick the handler variant for a destination & source register. */
+static u16 dest_src_variant(u16 base, u8 dest, u8 src, insn& ins)
+{
+    u16 variant = resolve(dest, ins.dest) * 2;
+    return base + variant + resolve(src, ins.src);
+}
+
+/* Resolve a register holding an address, which has to be a full one. */
+static void address_register(u8 id, u8& offset)
+{
+    if (resolve(id, offset))
+        throw cpu_fault(CPUFAULT_REG);
+}
+
+void cpu::decode(u16 addr, insn& ins)
+{
+    insn next;
+
+    /* Any write to this slot will now invalidate the decoded instruction. */
+    m_mem.watch_code(addr);
+
+    /* Register operands are resolved up front, so an invalid register faults
+       here instead of running the instruction. The slot is only filled once
+       the whole instruction is decoded, so a fault leaves it empty. */
+
+    decode_one(addr, next);
+    if (m_fusion)
+        fuse(addr, next);
+    if (m_histogram)
+        m_slot_ops[addr] = slot_ops(addr, next.handler);
+
+    ins = next;
+}
+
+/* Decode the single instruction at `addr`. */
+void cpu::decode_one(u16 addr, insn& next)
+{
+    uint32_t word;
+    u16 imm16at1;
+    u16 imm16at2;
+    u8 op;
+    u8 a;
+    u8 b;
+
+    word = m_mem.fetch32(addr);
+    op = word;
+    a = word >> 8;
+    b = word >> 16;
+    imm16at1 = word >> 8;
+    imm16at2 = word >> 16;
+
+    next = {H_NOP, a, b, 0, 0, (u16) (m_cycle_costs.of[op] - 1)};
+    if (m_counting)
+        next.stall |= STALL_COUNT;
+
+    switch (op) {
+    case I_CPUCALL:
+        next.handler = H_CPUCALL;
+        break;
+    case I_RTI:
+        next.handler = H_RTI;
+        break;
+    case I_STI:
+        next.handler = H_STI;
+        break;
+    case I_DSI:
+        next.handler = H_DSI;
+        break;
+    case I_WFI:
+        next.handler = H_WFI;
+        break;
+    case I_PUSH:
+        next.handler = dest_variant(H_PUSH_W, a, next);
+        break;
+    case I_PUSH8:
+        next.handler = H_PUSH8;
+        break;
+    case I_PUSH16:
+        next.handler = H_PUSH16;
+        next.imm = imm16at1;
+        break;
+    case I_POP:
+        next.handler = dest_variant(H_POP_W, a, next);
+        break;
+    case I_MOV:
+        next.handler = dest_src_variant(H_MOV_WW, a, b, next);
+        break;
+    case I_MOV8:
+        next.handler = dest_variant(H_MOV8_W, a, next);
+        break;
+    case I_MOV16:
+        next.handler = dest_variant(H_MOV16_W, a, next);
+        next.imm = imm16at2;
+        break;
+    case I_LOAD:
+        address_register(b, next.src);
+        next.handler = dest_variant(H_LOAD_W, a, next);
+        break;
+    case I_STORE:
+        address_register(b, next.src);
+        next.handler = dest_variant(H_STORE_W, a, next);
+        break;
+    case I_LOAD16:
+        next.handler = dest_variant(H_LOAD16_W, a, next);
+        next.imm = imm16at2;
+        break;
+    case I_STORE16:
+        next.handler = dest_variant(H_STORE16_W, a, next);
+        next.imm = imm16at2;
+        break;
+    case I_NULL:
+        next.handler = dest_variant(H_NULL_W, a, next);
+        break;
+    case I_CMP:
+        next.handler = dest_src_variant(H_CMP_WW, a, b, next);
+        break;
+    case I_CMP8:
+        next.handler = dest_variant(H_CMP8_W, a, next);
+        break;
+    case I_CMP16:
+        next.handler = dest_variant(H_CMP16_W, a, next);
+        next.imm = imm16at2;
+        break;
+    case I_CMG:
+        next.handler = dest_src_variant(H_CMG_WW, a, b, next);
+        break;
+    case I_CMG8:
+        /* Only the low byte is compared, whatever the register width. */
+        resolve(a, next.dest);
+        next.handler = H_CMG8;
+        break;
+    case I_CMG16:
+        next.handler = dest_variant(H_CMG16_W, a, next);
+        next.imm = imm16at2;
+        break;
+    case I_CML:
+        next.handler = dest_src_variant(H_CML_WW, a, b, next);
+        break;
+    case I_CML8:
+        resolve(a, next.dest);
+        next.handler = H_CML8;
+        break;
+    case I_CML16:
+        next.handler = dest_variant(H_CML16_W, a, next);
+        next.imm = imm16at2;
+        break;
+    case I_CFS:
+        next.handler = H_CFS;
+        break;
+    case I_JMP:
+        next.handler = H_JMP;
+        next.imm = imm16at1;
+        break;
+    case I_JNZ:
+        next.handler = dest_variant(H_JNZ_W, a, next);
+        next.imm = imm16at2;
+        break;
+    case I_JEQ:
+        next.handler = H_JEQ;
+        next.imm = imm16at1;
+        break;
+    case I_CALL:
+        next.handler = H_CALL;
+        next.imm = imm16at1;
+        break;
+    case I_CALLR:
+        /* The target is always read as a full word. */
+        resolve(a, next.dest);
+        next.handler = H_CALLR;
+        break;
+    case I_RET:
+        next.handler = H_RET;
+        break;
+    case I_ADD:
+        next.handler = dest_src_variant(H_ADD_WW, a, b, next);
+        break;
+    case I_ADD8:
+        next.handler = dest_variant(H_ADD8_W, a, next);
+        break;
+    case I_ADD16:
+        next.handler = dest_variant(H_ADD16_W, a, next);
+        next.imm = imm16at2;
+        break;
+    case I_SUB:
+        next.handler = dest_src_variant(H_SUB_WW, a, b, next);
+        break;
+    case I_SUB8:
+        next.handler = dest_variant(H_SUB8_W, a, next);
+        break;
+    case I_SUB16:
+        next.handler = dest_variant(H_SUB16_W, a, next);
+        next.imm = imm16at2;
+        break;
+    case I_AND:
+        next.handler = dest_src_variant(H_AND_WW, a, b, next);
+        break;
+    case I_AND8:
+        next.handler = dest_variant(H_AND8_W, a, next);
+        break;
+    case I_AND16:
+        next.handler = dest_variant(H_AND16_W, a, next);
+        next.imm = imm16at2;
+        break;
+    case I_OR:
+        next.handler = dest_src_variant(H_OR_WW, a, b, next);
+        break;
+    case I_OR8:
+        next.handler = dest_variant(H_OR8_W, a, next);
+        break;
+    case I_OR16:
+        next.handler = dest_variant(H_OR16_W, a, next);
+        next.imm = imm16at2;
+        break;
+    case I_NOT:
+        next.handler = dest_variant(H_NOT_W, a, next);
+        break;
+    case I_SHR:
+        /* The shift count is the low byte of the source register. */
+        resolve(b, next.src);
+        next.handler = dest_variant(H_SHR_W, a, next);
+        break;
+    case I_SHR8:
+        next.handler = dest_variant(H_SHR8_W, a, next);
+        break;
+    case I_SHL:
+        resolve(b, next.src);
+        next.handler = dest_variant(H_SHL_W, a, next);
+        break;
+    case I_SHL8:
+        next.handler = dest_variant(H_SHL8_W, a, next);
+        break;
+    case I_MUL:
+        next.handler = dest_src_variant(H_MUL_WW, a, b, next);
+        break;
+    case I_MUL8:
+        next.handler = dest_variant(H_MUL8_W, a, next);
+        break;
+    case I_MUL16:
+        next.handler = dest_variant(H_MUL16_W, a, next);
+        next.imm = imm16at2;
+        break;
+    default:
+        /* Unknown instructions are skipped over. */
+        next.handler = H_NOP;
+        break;
+    }
+}
+
+/* Decode the instruction at `addr` without faulting, returns false if it
+   cannot be decoded or does not fit in the address space. */
+bool cpu::peek(size_t addr, insn& ins)
+{
+    if (addr + 4 > icache::size)
+        return false;
+
+    try {
+        decode_one(addr, ins);
+    } catch (const cpu_fault&) {
+        return false;
+    }
+
+    return true;
+}
+
+/* A register written by a part of a superinstruction which is not the last
+   one may not be ip, as that would jump out of the sequence. */
+static bool is_ip(u8 offset)
+{
+    return offset == offsetof(irid_reg, ip);
+}
+
+/* Fuse the decoded instruction `ins` at `addr` with the ones following it,
+   if they form one of the common sequences emitted by irid-lc & found in the
+   system library. The superinstruction has the same architectural result as
+   running the sequence. Jumps into the middle of a sequence still work, as
+   they land in the slot of the part they target. */
+void cpu::fuse(u16 addr, insn& ins)
+{
+    insn second;
+    insn third;
+    int parts;
+
+    if (!peek((size_t) addr + 4, second))
+        return;
+
+    parts = 2;
+
+    switch (ins.handler) {
+    case H_CMP_WW:
+    case H_CMP_WH:
+    case H_CMP_HW:
+    case H_CMP_HH:
+        if (second.handler != H_JEQ)
+            return;
+        ins.handler = H_CMP_JEQ_WW + (ins.handler - H_CMP_WW);
+        ins.imm = second.imm;
+        break;
+    case H_CMP8_W:
+    case H_CMP8_H:
+        if (second.handler != H_JEQ)
+            return;
+        ins.handler = H_CMP8_JEQ_W + (ins.handler - H_CMP8_W);
+        ins.imm = second.imm;
+        break;
+    case H_CMP16_W:
+    case H_CMP16_H:
+        if (second.handler != H_JEQ)
+            return;
+        ins.handler = H_CMP16_JEQ_W + (ins.handler - H_CMP16_W);
+        ins.imm2 = second.imm;
+        break;
+    case H_CFS:
+        if (second.handler != H_JEQ)
+            return;
+        ins.handler = H_CFS_JEQ;
+        ins.imm = second.imm;
+        break;
+    case H_MOV_WW:
+        /* mov rX, bp; sub rX, N; and optionally a load or store using rX
+           as the address. */
+        if (ins.src != offsetof(irid_reg, bp) || is_ip(ins.dest))
+            return;
+        if (second.handler == H_SUB8_W && second.dest == ins.dest)
+            ins.imm = second.src;
+        else if (second.handler == H_SUB16_W && second.dest == ins.dest)
+            ins.imm = second.imm;
+        else
+            return;
+
+        ins.handler = H_BP_OFFSET;
+        if (!peek((size_t) addr + 8, third) || third.src != ins.dest)
             break;
-        case I_MUL8:
-            mul8(m_mem.read8(m_reg.ip + 1), m_mem.read8(m_reg.ip + 2));
+
+        if (third.handler == H_LOAD_W || third.handler == H_LOAD_H) {
+            ins.handler = H_BP_LOAD_W + (third.handler - H_LOAD_W);
+            ins.src = third.dest;
+            parts = 3;
+        } else if (third.handler == H_STORE_W || third.handler == H_STORE_H) {
+            ins.handler = H_BP_STORE_W + (third.handler - H_STORE_W);
+            ins.src = third.dest;
+            parts = 3;
+        }
+        break;
+    case H_PUSH_W:
+        if (second.handler != H_PUSH_W)
+            return;
+        ins.handler = H_PUSH2;
+        ins.src = second.dest;
+        break;
+    case H_POP_W:
+        if (second.handler != H_POP_W || is_ip(ins.dest))
+            return;
+        ins.handler = H_POP2;
+        ins.src = second.dest;
+        break;
+    case H_ADD8_W:
+    case H_ADD8_H:
+    case H_ADD16_W:
+    case H_ADD16_H:
+        if (second.handler != H_JMP || is_ip(ins.dest))
+            return;
+        if (ins.handler == H_ADD8_W || ins.handler == H_ADD8_H)
+            ins.imm2 = ins.src;
+        else
+            ins.imm2 = ins.imm;
+        ins.handler = (ins.handler == H_ADD8_W || ins.handler == H_ADD16_W)
+                        ? H_ADD_JMP_W
+                        : H_ADD_JMP_H;
+        ins.imm = second.imm;
+        break;
+    default:
+        return;
+    }
+
+    ins.stall += second.stall & ~STALL_COUNT;
+    if (parts == 3)
+        ins.stall += third.stall & ~STALL_COUNT;
+
+    /* Writes to any part have to invalidate the superinstruction. */
+    for (int i = 1; i < parts; i++)
+        m_mem.watch_code(addr + i * 4);
+}
+
+device *cpu::find_device(u16 id)
+{
+    int index;
+
+    index = m_registry.find(id);
+    return index == -1 ? nullptr : &m_devices[index];
+}
+
+void cpu::poll_devices()
+{
+    int i;
+
+    /* Only a single interrupt can run at a time, any other device stays
+       pending & is handled on rti. */
+    i = next_interrupt();
+    if (i != -1)
+        issue_interrupt(m_devices[i].interrupt_ptr);
+}
+
+/* Take the pending interrupt to deliver next: the one with the highest
+   priority, then the first device. Returns its device index, or -1 if there
+   is none. A device has a single pending bit, so a burst of events from it
+   only causes one interrupt. */
+int cpu::next_interrupt()
+{
+    uint64_t pending;
+    uint64_t latency;
+    int i;
+
+    pending = m_pending.load(std::memory_order_acquire) & m_irq_mask;
+    if (!pending)
+        return -1;
+
+    for (int level = IRID_IRQ_LEVELS - 1; level > 0; level--) {
+        if (pending & m_irq_levels[level]) {
+            pending &= m_irq_levels[level];
             break;
-        case I_MUL16:
-            mul16(m_mem.read8(m_reg.ip + 1), m_mem.read16(m_reg.ip + 2));
+        }
+    }
+
+    i = __builtin_ctzll(pending);
+
+    latency = now_ns() - m_pending.raised_at(i);
+    m_stats.irq_latency_ns += latency;
+    m_stats.irq_latency_max_ns = std::max(m_stats.irq_latency_max_ns, latency);
+
+    /* Input stays pending until it is read, anything else is raised once. */
+    if (m_devices[i].input)
+        m_devices[i].input->sync();
+    else
+        m_pending.clear(m_devices[i].bit);
+
+    m_irq_count++;
+    return i;
+}
+
+/* Send the packets in each descriptor handed over in the tx ring, until the
+   device cannot take any more. */
+size_t cpu::send_packets(device& dev)
+{
+    iovec spans[IRID_MAX_PAGES + 1];
+    packet_rings& rings = dev.rings;
+    size_t sent;
+    u16 desc;
+    int n;
+
+    if (!rings.tx)
+        return 0;
+
+    for (sent = 0; sent < rings.size; sent++) {
+        desc = rings.tx + rings.tx_next * sizeof(irid_desc);
+        if (!(m_mem.read16(desc + offsetof(irid_desc, d_flags))
+              & IRID_DESC_AVAIL))
             break;
-        default:
+
+        /* The packet is sent straight from guest memory. */
+        n = 0;
+        m_mem.read_spans(m_mem.read16(desc + offsetof(irid_desc, d_addr)),
+                         m_mem.read16(desc + offsetof(irid_desc, d_len)),
+                         [&spans, &n](const u8 *buf, size_t len) {
+            spans[n++] = {(void *) buf, len};
+        });
+
+        if (!dev.ops->send(dev, spans, n))
             break;
-        }
 
-        m_reg.ip += 4;
-dont_step:
-        m_reg.ip += 0;
+        for (int i = 0; i < n; i++)
+            dev.bytes_out += spans[i].iov_len;
 
-        /* Before we run the next instruction, check if we are not speeding
-           and slow down to the target instructions-per-second appropriately. */
+        m_mem.write16(desc + offsetof(irid_desc, d_flags), IRID_DESC_DONE);
+        rings.tx_next = (rings.tx_next + 1) % rings.size;
+    }
 
-        clock_gettime(CLOCK_MONOTONIC, &instr_time_end);
+    return sent;
+}
 
-        nsec = instr_time_end.tv_nsec - instr_time_start.tv_nsec;
-        if (instr_time_end.tv_sec != instr_time_start.tv_sec) {
-            nsec = instr_time_end.tv_nsec
-                 + (1000000000 - instr_time_start.tv_nsec);
-        }
+/* Fill each descriptor handed over in the rx ring with a received packet,
+   until there are none left. */
+size_t cpu::receive_packets(device& dev)
+{
+    packet_rings& rings = dev.rings;
+    const u8 *packet;
+    size_t received;
+    size_t len;
+    u16 desc;
+    u16 size;
+    u16 n;
 
-        if (nsec < m_cycle_ns) {
-            sleep_time.tv_sec = 0;
-            sleep_time.tv_nsec = m_cycle_ns - nsec;
-            if (nanosleep(&sleep_time, NULL) == -1)
-                die("something interrupted the clock cycle (%d)", errno);
-        }
+    if (!rings.rx)
+        return 0;
+
+    for (received = 0; received < rings.size; received++) {
+        desc = rings.rx + rings.rx_next * sizeof(irid_desc);
+        if (!(m_mem.read16(desc + offsetof(irid_desc, d_flags))
+              & IRID_DESC_AVAIL))
+            break;
 
-        m_total_instructions++;
+        packet = dev.ops->receive(dev, len);
+        if (!packet)
+            break;
+
+        size = m_mem.read16(desc + offsetof(irid_desc, d_len));
+        n = std::min<size_t>(len, size);
+        m_mem.write_spans(m_mem.read16(desc + offsetof(irid_desc, d_addr)), n,
+                          [&packet](u8 *buf, size_t chunk) {
+            memcpy(buf, packet, chunk);
+            packet += chunk;
+            return chunk;
+        });
+
+        dev.bytes_in += n;
+        m_mem.write16(desc + offsetof(irid_desc, d_len), n);
+        m_mem.write16(desc + offsetof(irid_desc, d_flags),
+                      len > size ? IRID_DESC_DONE | IRID_DESC_TRUNC
+                                 : IRID_DESC_DONE);
+        rings.rx_next = (rings.rx_next + 1) % rings.size;
     }
+
+    return received;
 }
 
-void cpu::poll_devices()
+void cpu::flush_devices()
 {
-    for (size_t i = 0; i < m_devices.size(); i++) {
-        if (!m_devices[i].interrupt_ptr || !m_devices[i].poll)
-            continue;
+    for (device& dev : m_devices) {
+        if (dev.output)
+            dev.output->flush();
+        if (dev.ops && dev.ops->sync)
+            dev.ops->sync(dev);
+    }
+}
 
-        if (m_devices[i].poll(m_devices[i]))
-            issue_interrupt(m_devices[i].interrupt_ptr);
+/* Sleep until a device has an interrupt for the program, or with a virtual
+   clock, move it forward to the next timer. With interrupts enabled, only an
+   interrupt which can be delivered wakes the CPU. Otherwise any device does,
+   as the program may poll it after waiting. */
+void cpu::wait_for_interrupt()
+{
+    uint64_t wake;
+
+    wake = m_interrupts && !m_in_interrupt ? m_irq_mask : ~m_irq_masked;
+    if (m_pending.load() & wake)
+        return;
+
+    idle(wake, 0);
+}
+
+/* Stand in for instructions which would only wait: sleep until any of the
+   `wake` bits is pending, for at most `timeout_ns` unless it is 0, or with a
+   virtual clock, skip straight to the next timer if one of them can wake the
+   CPU. Returns how many instructions the program would have run meanwhile,
+   or 0 if the speed is unlimited. */
+uint64_t cpu::idle(uint64_t wake, uint64_t timeout_ns)
+{
+    struct timespec start;
+    struct timespec end;
+    uint64_t skipped;
+    uint64_t cycles;
+    bool timers;
+    uint64_t now;
+    uint64_t ns;
+
+    m_idle_waits++;
+
+    timers = false;
+    for (const device& dev : m_devices)
+        timers |= dev.ops && dev.ops->tick && (dev.bit & wake);
+
+    if (m_virtual_time && timers && m_next_deadline != UINT64_MAX) {
+        cycles = ((unsigned __int128) m_next_deadline * m_clock_hz + 999999999)
+               / 1000000000;
+        now = m_cycles + m_idle_cycles;
+        skipped = cycles > now ? cycles - now : 0;
+        m_idle_cycles += skipped;
+
+        m_next_pace = m_pacer.pace(m_cycles);
+        run_timers();
+        schedule_events();
+        return skipped;
+    }
+
+    /* Anything the program printed before going idle should be seen. */
+    for (device& dev : m_devices) {
+        if (dev.output)
+            dev.output->flush();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    m_pending.wait(wake, timeout_ns);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ns = (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000
+       + (end.tv_nsec - start.tv_nsec);
+    m_idle_ns += ns;
+
+    /* The pacer would otherwise try to make up for the time spent asleep. */
+    m_next_pace = m_pacer.start(m_cycles);
+    schedule_events();
+    if (m_virtual_time) {
+        run_timers();
+        return 0;
     }
+
+    return (unsigned __int128) ns * m_pacer.target_ips() / 1000000000;
 }
 
 void cpu::issue_interrupt(u16 addr)
@@ -347,6 +1649,8 @@ void cpu::issue_interrupt(u16 addr)
 
     m_in_interrupt = true;
     m_reg_cache = m_reg;
+    if (m_callgraph)
+        trace_interrupt(addr, instructions(false));
     m_reg.ip = addr;
 }
 
@@ -363,34 +1667,33 @@ void cpu::dump_registers()
            m_reg.sf);
 }
 
-u16 cpu::r_load(u8 id)
-{
-    if (is_half_register(id))
-        return static_cast<u16>(*regptr<u8>(id));
-    else
-        return *regptr<u16>(id);
-}
-
-void cpu::r_store(u8 id, u16 value)
-{
-    if (is_half_register(id))
-        *regptr<u8>(id) = static_cast<u8>(value);
-    else
-        *regptr<u16>(id) = value;
-}
-
-bool cpu::is_half_register(u8 id)
-{
-    return id >= R_H0 && id <= R_L3;
-}
-
 void cpu::initialize()
 {
     std::memset(&m_reg, 0, sizeof(m_reg));
+    m_mem.reset_pages();
+
+    /* The interrupt controller starts over as well. Interrupts raised once
+       are dropped, input which is not read yet stays pending. */
+    m_interrupts = false;
+    m_in_interrupt = false;
+    m_irq_handlers = 0;
+    m_irq_masked = 0;
+    m_irq_mask = 0;
+    std::fill(m_irq_levels, m_irq_levels + IRID_IRQ_LEVELS, 0);
+
+    m_pending.clear(UINT64_MAX);
+    for (device& dev : m_devices) {
+        dev.interrupt_ptr = 0;
+        if (dev.input)
+            dev.input->sync();
+    }
 }
 
 void cpu::cpucall()
 {
+    if (m_reg.r0 < 0x100)
+        m_stats.cpucalls[m_reg.r0]++;
+
     switch (m_reg.r0) {
     case CPUCALL_POWEROFF:
         throw cpucall_request(cpucall_request::RQ_POWEROFF);
@@ -407,6 +1710,27 @@ void cpu::cpucall()
     case CPUCALL_DEVICEINTR:
         cpucall_deviceintr();
         break;
+    case CPUCALL_DEVICEMAP:
+        cpucall_devicemap();
+        break;
+    case CPUCALL_CLOCK:
+        cpucall_clock();
+        break;
+    case CPUCALL_IRQPRIORITY:
+        cpucall_irqpriority();
+        break;
+    case CPUCALL_IRQMASK:
+        cpucall_irqmask();
+        break;
+    case CPUCALL_PERFREAD:
+        cpucall_perfread();
+        break;
+    case CPUCALL_PERFSNAPSHOT:
+        cpucall_perfsnapshot();
+        break;
+    case CPUCALL_PERFRESET:
+        cpucall_perfreset();
+        break;
     case CPUCALL_DEVICEWRITE:
         cpucall_devicewrite();
         break;
@@ -416,6 +1740,42 @@ void cpu::cpucall()
     case CPUCALL_DEVICEPOLL:
         cpucall_devicepoll();
         break;
+    case CPUCALL_DEVICEWRITEN:
+        cpucall_devicewriten();
+        break;
+    case CPUCALL_DEVICEREADN:
+        cpucall_devicereadn();
+        break;
+    case CPUCALL_SECTORREAD:
+        cpucall_sectorread();
+        break;
+    case CPUCALL_SECTORWRITE:
+        cpucall_sectorwrite();
+        break;
+    case CPUCALL_SECTORCOUNT:
+        cpucall_sectorcount();
+        break;
+    case CPUCALL_DEVICERING:
+        cpucall_devicering();
+        break;
+    case CPUCALL_DEVICENOTIFY:
+        cpucall_devicenotify();
+        break;
+    case CPUCALL_TIMERSET:
+        cpucall_timerset();
+        break;
+    case CPUCALL_PAGEMAP:
+        cpucall_pagemap();
+        break;
+    case CPUCALL_PAGEINFO:
+        cpucall_pageinfo();
+        break;
+    case CPUCALL_BANKSWITCH:
+        cpucall_bankswitch();
+        break;
+    case CPUCALL_MEMINFO:
+        cpucall_meminfo();
+        break;
     default:
         throw cpu_fault(CPUFAULT_CPUCALL);
     }
@@ -423,8 +1783,26 @@ void cpu::cpucall()
 
 void cpu::rti()
 {
-    m_in_interrupt = false;
+    int i;
+
     m_reg = m_reg_cache;
+    if (m_callgraph)
+        trace_rti();
+
+    /* Chain straight into the next pending interrupt, instead of going back
+       for a single instruction. The interrupted registers stay cached. */
+    if (m_interrupts) {
+        i = next_interrupt();
+        if (i != -1) {
+            if (m_callgraph)
+                trace_interrupt(m_devices[i].interrupt_ptr, instructions(true));
+            m_reg.ip = m_devices[i].interrupt_ptr;
+            m_irq_chained++;
+            return;
+        }
+    }
+
+    m_in_interrupt = false;
 }
 
 void cpu::cpucall_devicelist()
@@ -450,78 +1828,390 @@ void cpu::cpucall_devicelist()
 void cpu::cpucall_deviceinfo()
 {
     struct irid_deviceinfo info;
+    device *dev;
 
-    for (size_t i = 0; i < m_devices.size(); i++) {
-        if (m_devices[i].id != m_reg.r1)
-            continue;
+    dev = find_device(m_reg.r1);
+    if (!dev)
+        return;
 
-        info.d_id = m_devices[i].id;
-        memset(info.d_name, 0, 14);
-        memcpy(info.d_name, m_devices[i].name.c_str(),
-               std::min((size_t) 13, m_devices[i].name.size()));
-        m_mem.write_range(m_reg.r2, &info, sizeof(info));
-        break;
-    }
+    info.d_id = dev->id;
+    memset(info.d_name, 0, 14);
+    memcpy(info.d_name, dev->name.c_str(),
+           std::min((size_t) 13, dev->name.size()));
+    m_mem.write_range(m_reg.r2, &info, sizeof(info));
 }
 
 void cpu::cpucall_deviceintr()
 {
-    for (size_t i = 0; i < m_devices.size(); i++) {
-        if (m_devices[i].id != m_reg.r1)
-            continue;
+    device *dev;
 
-        m_devices[i].interrupt_ptr = m_reg.r2;
-        break;
+    dev = find_device(m_reg.r1);
+    if (!dev)
+        return;
+
+    /* Only the first 64 devices can interrupt. */
+    if (m_reg.r2 && !dev->bit)
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    dev->interrupt_ptr = m_reg.r2;
+    if (m_reg.r2)
+        m_irq_handlers |= dev->bit;
+    else
+        m_irq_handlers &= ~dev->bit;
+
+    m_irq_mask = m_irq_handlers & ~m_irq_masked;
+}
+
+void cpu::cpucall_irqpriority()
+{
+    device *dev;
+
+    dev = find_device(m_reg.r1);
+    if (!dev || m_reg.r2 >= IRID_IRQ_LEVELS)
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    for (uint64_t& level : m_irq_levels)
+        level &= ~dev->bit;
+    m_irq_levels[m_reg.r2] |= dev->bit;
+}
+
+void cpu::cpucall_irqmask()
+{
+    uint64_t bits;
+    device *dev;
+
+    if (m_reg.r1 == IRID_ALL_DEVICES) {
+        bits = UINT64_MAX;
+    } else {
+        dev = find_device(m_reg.r1);
+        if (!dev)
+            throw cpu_fault(CPUFAULT_CPUCALL);
+        bits = dev->bit;
     }
+
+    /* A masked device keeps its pending interrupt until it is unmasked. */
+    if (m_reg.h2)
+        m_irq_masked |= bits;
+    else
+        m_irq_masked &= ~bits;
+
+    m_irq_mask = m_irq_handlers & ~m_irq_masked;
+}
+
+void cpu::cpucall_perfread()
+{
+    uint32_t value;
+
+    if (m_reg.r1 >= IRID_PERF_COUNT)
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    start_counting();
+    value = perf_counter(m_reg.r1) - m_perf_base[m_reg.r1];
+    m_reg.r2 = value & 0xffff;
+    m_reg.r3 = value >> 16;
+}
+
+void cpu::cpucall_perfsnapshot()
+{
+    uint32_t values[IRID_PERF_COUNT];
+
+    start_counting();
+    for (int i = 0; i < IRID_PERF_COUNT; i++)
+        values[i] = perf_counter(i) - m_perf_base[i];
+
+    m_mem.write_range(m_reg.r1, values, sizeof(values));
+}
+
+void cpu::cpucall_perfreset()
+{
+    start_counting();
+    for (int i = 0; i < IRID_PERF_COUNT; i++)
+        m_perf_base[i] = perf_counter(i);
+}
+
+void cpu::cpucall_devicemap()
+{
+    device *dev;
+
+    dev = find_device(m_reg.r1);
+    if (!dev || m_reg.r2 >= IRID_MAX_PAGES)
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    dev->mmio.ctx = dev;
+    m_mem.map_mmio(m_reg.r2, &dev->mmio);
+}
+
+void cpu::cpucall_clock()
+{
+    uint32_t us;
+
+    us = guest_time() / 1000;
+    m_reg.r2 = us & 0xffff;
+    m_reg.r3 = us >> 16;
 }
 
 void cpu::cpucall_devicewrite()
 {
-    for (size_t i = 0; i < m_devices.size(); i++) {
-        if (m_devices[i].id != m_reg.r1)
-            continue;
+    device *dev;
 
-        m_devices[i].write(m_devices[i], m_reg.h2);
-        break;
+    dev = find_device(m_reg.r1);
+    if (dev && dev->ops->write) {
+        dev->ops->write(*dev, m_reg.h2);
+        dev->bytes_out++;
     }
 }
 
 void cpu::cpucall_deviceread()
 {
-    for (size_t i = 0; i < m_devices.size(); i++) {
-        if (m_devices[i].id != m_reg.r1)
-            continue;
+    device *dev;
 
-        m_reg.h2 = m_devices[i].read(m_devices[i]);
-        break;
+    dev = find_device(m_reg.r1);
+    if (dev && dev->ops->read) {
+        m_reg.h2 = dev->ops->read(*dev);
+        dev->bytes_in++;
     }
 }
 
 void cpu::cpucall_devicepoll()
 {
-    for (size_t i = 0; i < m_devices.size(); i++) {
-        if (m_devices[i].id != m_reg.r1)
-            continue;
+    device *dev;
 
-        m_reg.h2 = (bool) m_devices[i].poll(m_devices[i]);
-        break;
+    dev = find_device(m_reg.r1);
+    if (dev && dev->ops->poll)
+        m_reg.h2 = (bool) dev->ops->poll(*dev);
+}
+
+void cpu::cpucall_devicewriten()
+{
+    device *dev;
+
+    dev = find_device(m_reg.r1);
+    if (!dev)
+        return;
+
+    m_mem.read_spans(m_reg.r2, m_reg.r3, [dev](const u8 *buf, size_t n) {
+        dev->bytes_out += n;
+        if (dev->ops->write_range) {
+            dev->ops->write_range(*dev, buf, n);
+            return;
+        }
+
+        for (size_t i = 0; dev->ops->write && i < n; i++)
+            dev->ops->write(*dev, buf[i]);
+    });
+}
+
+void cpu::cpucall_devicereadn()
+{
+    device *dev;
+
+    dev = find_device(m_reg.r1);
+    if (!dev) {
+        m_reg.r3 = 0;
+        return;
     }
+
+    /* Byte-wise devices cannot tell how much there is to read, so only read
+       what they report as available. */
+    m_reg.r3 = m_mem.write_spans(m_reg.r2, m_reg.r3, [dev](u8 *buf, size_t n) {
+        size_t i;
+
+        if (dev->ops->read_range)
+            return dev->ops->read_range(*dev, buf, n);
+
+        for (i = 0; i < n && dev->ops->read && dev->ops->poll
+                    && dev->ops->poll(*dev);
+             i++)
+            buf[i] = dev->ops->read(*dev);
+
+        return i;
+    });
+    dev->bytes_in += m_reg.r3;
+}
+
+/* Find the sectors a transfer between the block device in r1 & the buffer
+   in r2 touches. The buffer has to fit in memory & be shorter than 64K, as
+   spans are limited to 16 bits. */
+static u8 *find_sectors(device *dev, const irid_reg& reg, bool write)
+{
+    size_t n;
+    u8 *sectors;
+
+    n = (size_t) reg.r3 * IRID_SECTOR_SIZE;
+    if (!dev || !dev->ops->sectors || n > IRID_MAX_ADDR + 1u - reg.r2
+        || n > IRID_MAX_ADDR)
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    sectors = dev->ops->sectors(*dev, reg.r4, reg.r3, write);
+    if (!sectors)
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    return sectors;
+}
+
+void cpu::cpucall_sectorread()
+{
+    device *dev;
+    u8 *sectors;
+
+    dev = find_device(m_reg.r1);
+    sectors = find_sectors(dev, m_reg, false);
+
+    /* Copy straight from the disk into guest memory. */
+    m_mem.write_spans(m_reg.r2, m_reg.r3 * IRID_SECTOR_SIZE,
+                      [&sectors](u8 *buf, size_t n) {
+        memcpy(buf, sectors, n);
+        sectors += n;
+        return n;
+    });
+
+    dev->bytes_in += m_reg.r3 * IRID_SECTOR_SIZE;
+    if (dev->interrupt_ptr)
+        m_pending.raise(dev->bit);
+}
+
+void cpu::cpucall_sectorwrite()
+{
+    device *dev;
+    u8 *sectors;
+
+    dev = find_device(m_reg.r1);
+    sectors = find_sectors(dev, m_reg, true);
+
+    m_mem.read_spans(m_reg.r2, m_reg.r3 * IRID_SECTOR_SIZE,
+                     [&sectors](const u8 *buf, size_t n) {
+        memcpy(sectors, buf, n);
+        sectors += n;
+    });
+
+    dev->bytes_out += m_reg.r3 * IRID_SECTOR_SIZE;
+    if (dev->interrupt_ptr)
+        m_pending.raise(dev->bit);
+}
+
+void cpu::cpucall_sectorcount()
+{
+    device *dev;
+
+    dev = find_device(m_reg.r1);
+    if (!dev || !dev->ops->sector_count)
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    m_reg.r2 = dev->ops->sector_count(*dev);
+}
+
+void cpu::cpucall_devicering()
+{
+    device *dev;
+    size_t len;
+
+    dev = find_device(m_reg.r1);
+    if (!dev || !dev->ops->send)
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    /* Both rings have to fit in memory, a null one is not used. */
+    len = (size_t) m_reg.r4 * sizeof(irid_desc);
+    if ((m_reg.r2 && len > IRID_MAX_ADDR + 1u - m_reg.r2)
+        || (m_reg.r3 && len > IRID_MAX_ADDR + 1u - m_reg.r3))
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    dev->rings = {m_reg.r2, m_reg.r3, m_reg.r4, 0, 0};
+}
+
+void cpu::cpucall_devicenotify()
+{
+    device *dev;
+
+    dev = find_device(m_reg.r1);
+    if (!dev || !dev->ops->send)
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    m_reg.r2 = send_packets(*dev);
+    if (dev->output)
+        dev->output->flush();
+    m_reg.r3 = receive_packets(*dev);
+
+    /* A single interrupt covers all the packets. A handler calling this
+       already knows what is done, so it is not interrupted again. */
+    if ((m_reg.r2 || m_reg.r3) && dev->interrupt_ptr && !m_in_interrupt)
+        m_pending.raise(dev->bit);
+}
+
+void cpu::cpucall_timerset()
+{
+    uint64_t ns;
+    device *dev;
+
+    dev = find_device(m_reg.r1);
+    if (!dev || !dev->ops->arm || m_reg.r4 > IRID_TIMER_PERIODIC)
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    ns = (uint64_t) (m_reg.r2 | ((uint32_t) m_reg.r3 << 16)) * 1000;
+    if (m_reg.r4 == IRID_TIMER_STOP)
+        ns = 0;
+
+    dev->ops->arm(*dev, guest_time(), ns, m_reg.r4 == IRID_TIMER_PERIODIC);
+    if (m_virtual_time)
+        run_timers();
+}
+
+void cpu::cpucall_pagemap()
+{
+    if (m_reg.r1 >= IRID_MAX_PAGES || m_reg.r2 >= m_mem.frames())
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    m_mem.map_page(m_reg.r1, m_reg.r2, m_reg.h3);
+}
+
+void cpu::cpucall_pageinfo()
+{
+    u8 flags;
+
+    if (m_reg.r1 >= IRID_MAX_PAGES)
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    m_mem.page_info(m_reg.r1, m_reg.r2, flags);
+    m_reg.r3 = flags;
+}
+
+void cpu::cpucall_bankswitch()
+{
+    if (m_reg.r1 + m_reg.r2 > IRID_MAX_PAGES || m_reg.r3 >= m_mem.banks())
+        throw cpu_fault(CPUFAULT_CPUCALL);
+
+    m_mem.switch_bank(m_reg.r1, m_reg.r2, m_reg.r3);
+}
+
+void cpu::cpucall_meminfo()
+{
+    m_reg.r1 = m_mem.banks();
+}
+
+template <typename T> T cpu::read(u16 addr)
+{
+    if constexpr (sizeof(T) == 1)
+        return m_mem.read8(addr);
+    else
+        return m_mem.read16(addr);
+}
+
+template <typename T> void cpu::write(u16 addr, T value)
+{
+    if constexpr (sizeof(T) == 1)
+        m_mem.write8(addr, value);
+    else
+        m_mem.write16(addr, value);
 }
 
-void cpu::push(u8 src)
+template <typename S> void cpu::push(u8 src)
 {
     if (m_reg.sp == 0)
         throw cpu_fault(CPUFAULT_SEG);
 
-    if (is_half_register(src)) {
-        u8 val = *regptr<u8>(src);
-        m_reg.sp -= 1;
-        m_mem.write8(m_reg.sp, val);
-    } else {
-        u16 val = *regptr<u16>(src);
-        m_reg.sp -= 2;
-        m_mem.write16(m_reg.sp, val);
-    }
+    /* sp only changes once the write went through. */
+    u16 addr = m_reg.sp - sizeof(S);
+    write<S>(addr, reg<S>(src));
+    m_reg.sp = addr;
 }
 
 void cpu::push8(u8 imm8)
@@ -529,8 +2219,8 @@ void cpu::push8(u8 imm8)
     if (m_reg.sp == 0)
         throw cpu_fault(CPUFAULT_SEG);
 
+    m_mem.write8(m_reg.sp - 1, imm8);
     m_reg.sp -= 1;
-    m_mem.write8(m_reg.sp, imm8);
 }
 
 void cpu::push16(u16 imm16)
@@ -538,124 +2228,100 @@ void cpu::push16(u16 imm16)
     if (m_reg.sp == 0)
         throw cpu_fault(CPUFAULT_SEG);
 
+    m_mem.write16(m_reg.sp - 2, imm16);
     m_reg.sp -= 2;
-    m_mem.write16(m_reg.sp, imm16);
 }
 
-void cpu::pop(u8 dest)
+template <typename D> void cpu::pop(u8 dest)
 {
-    if (is_half_register(dest)) {
-        u8 val = m_mem.read8(m_reg.sp);
-        m_reg.sp += 1;
-        *regptr<u8>(dest) = val;
-    } else {
-        u16 val = m_mem.read16(m_reg.sp);
-        m_reg.sp += 2;
-        *regptr<u16>(dest) = val;
-    }
+    D val = read<D>(m_reg.sp);
+    m_reg.sp += sizeof(D);
+    reg<D>(dest) = val;
 }
 
-void cpu::mov(u8 dest, u8 src)
+template <typename D, typename S> void cpu::mov(u8 dest, u8 src)
 {
-    r_store(dest, r_load(src));
+    reg<D>(dest) = reg<S>(src);
 }
 
-void cpu::mov8(u8 dest, u8 imm8)
+template <typename D> void cpu::mov8(u8 dest, u8 imm8)
 {
-    r_store(dest, imm8);
+    reg<D>(dest) = imm8;
 }
 
-void cpu::mov16(u8 dest, u16 imm16)
+template <typename D> void cpu::mov16(u8 dest, u16 imm16)
 {
-    r_store(dest, imm16);
+    reg<D>(dest) = imm16;
 }
 
-void cpu::load(u8 dest, u8 srcptr)
+template <typename D> void cpu::load(u8 dest, u8 srcptr)
 {
-    if (is_half_register(srcptr))
-        throw cpu_fault(CPUFAULT_REG);
-
-    if (is_half_register(dest))
-        r_store(dest, m_mem.read8(r_load(srcptr)));
-    else
-        r_store(dest, m_mem.read16(r_load(srcptr)));
+    reg<D>(dest) = read<D>(reg<u16>(srcptr));
 }
 
-void cpu::store(u8 src, u8 destptr)
+template <typename S> void cpu::store(u8 src, u8 destptr)
 {
-    if (is_half_register(destptr))
-        throw cpu_fault(CPUFAULT_REG);
-
-    if (is_half_register(src))
-        m_mem.write8(r_load(destptr), r_load(src));
-    else
-        m_mem.write16(r_load(destptr), r_load(src));
+    write<S>(reg<u16>(destptr), reg<S>(src));
 }
 
-void cpu::load16(u8 dest, u16 imm16ptr)
+template <typename D> void cpu::load16(u8 dest, u16 imm16ptr)
 {
-    if (is_half_register(dest))
-        r_store(dest, m_mem.read8(imm16ptr));
-    else
-        r_store(dest, m_mem.read16(imm16ptr));
+    reg<D>(dest) = read<D>(imm16ptr);
 }
 
-void cpu::store16(u8 src, u16 imm16ptr)
+template <typename S> void cpu::store16(u8 src, u16 imm16ptr)
 {
-    if (is_half_register(src))
-        m_mem.write8(imm16ptr, r_load(src));
-    else
-        m_mem.write16(imm16ptr, r_load(src));
+    write<S>(imm16ptr, reg<S>(src));
 }
 
-void cpu::null(u8 dest)
+template <typename D> void cpu::null(u8 dest)
 {
-    r_store(dest, 0);
+    reg<D>(dest) = 0;
 }
 
-void cpu::cmp(u8 left, u8 right)
+template <typename L, typename R> void cpu::cmp(u8 left, u8 right)
 {
-    m_reg.cf = r_load(left) == r_load(right);
+    m_reg.cf = reg<L>(left) == reg<R>(right);
 }
 
-void cpu::cmp8(u8 left, u8 imm8)
+template <typename L> void cpu::cmp8(u8 left, u8 imm8)
 {
-    m_reg.cf = r_load(left) == imm8;
+    m_reg.cf = reg<L>(left) == imm8;
 }
 
-void cpu::cmp16(u8 left, u16 imm16)
+template <typename L> void cpu::cmp16(u8 left, u16 imm16)
 {
-    m_reg.cf = r_load(left) == imm16;
+    m_reg.cf = reg<L>(left) == imm16;
 }
 
-void cpu::cmg(u8 left, u8 right)
+template <typename L, typename R> void cpu::cmg(u8 left, u8 right)
 {
-    m_reg.cf = r_load(left) > r_load(right);
+    m_reg.cf = reg<L>(left) > reg<R>(right);
 }
 
 void cpu::cmg8(u8 left, u8 imm8)
 {
-    m_reg.cf = (u8) r_load(left) > imm8;
+    m_reg.cf = reg<u8>(left) > imm8;
 }
 
-void cpu::cmg16(u8 left, u16 imm16)
+template <typename L> void cpu::cmg16(u8 left, u16 imm16)
 {
-    m_reg.cf = r_load(left) > imm16;
+    m_reg.cf = reg<L>(left) > imm16;
 }
 
-void cpu::cml(u8 left, u8 right)
+template <typename L, typename R> void cpu::cml(u8 left, u8 right)
 {
-    m_reg.cf = r_load(left) < r_load(right);
+    m_reg.cf = reg<L>(left) < reg<R>(right);
 }
 
 void cpu::cml8(u8 left, u8 imm8)
 {
-    m_reg.cf = (u8) r_load(left) < imm8;
+    m_reg.cf = reg<u8>(left) < imm8;
 }
 
-void cpu::cml16(u8 left, u16 imm16)
+template <typename L> void cpu::cml16(u8 left, u16 imm16)
 {
-    m_reg.cf = r_load(left) < imm16;
+    m_reg.cf = reg<L>(left) < imm16;
 }
 
 void cpu::cfs()
@@ -668,9 +2334,9 @@ void cpu::jmp(u16 addr)
     m_reg.ip = addr;
 }
 
-void cpu::jnz(u8 cond, u16 addr)
+template <typename L> void cpu::jnz(u8 cond, u16 addr)
 {
-    if (r_load(cond))
+    if (reg<L>(cond))
         m_reg.ip = addr;
     else
         m_reg.ip += 4;
@@ -687,145 +2353,123 @@ void cpu::jeq(u16 addr)
 void cpu::call(u16 addr)
 {
     push16(m_reg.ip + 4);
+    if (m_callgraph)
+        trace_call(addr);
     m_reg.ip = addr;
 }
 
 void cpu::callr(u8 srcaddr)
 {
     push16(m_reg.ip + 4);
-    m_reg.ip = *regptr<u16>(srcaddr);
+    if (m_callgraph)
+        trace_call(reg<u16>(srcaddr));
+    m_reg.ip = reg<u16>(srcaddr);
 }
 
 void cpu::ret()
 {
     m_reg.ip = m_mem.read16(m_reg.sp);
+    if (m_callgraph)
+        trace_ret(m_reg.sp);
     m_reg.sp += 2;
 }
 
-void cpu::add(u8 dest, u8 src)
+template <typename D, typename S> void cpu::add(u8 dest, u8 src)
 {
-    r_store(dest, r_load(dest) + r_load(src));
+    reg<D>(dest) += reg<S>(src);
 }
 
-void cpu::add8(u8 dest, u8 imm8)
+template <typename D> void cpu::add8(u8 dest, u8 imm8)
 {
-    r_store(dest, r_load(dest) + imm8);
+    reg<D>(dest) += imm8;
 }
 
-void cpu::add16(u8 dest, u16 imm16)
+template <typename D> void cpu::add16(u8 dest, u16 imm16)
 {
-    r_store(dest, r_load(dest) + imm16);
+    reg<D>(dest) += imm16;
 }
 
-void cpu::sub(u8 dest, u8 src)
+template <typename D, typename S> void cpu::sub(u8 dest, u8 src)
 {
-    r_store(dest, r_load(dest) - r_load(src));
+    reg<D>(dest) -= reg<S>(src);
 }
 
-void cpu::sub8(u8 dest, u8 imm8)
+template <typename D> void cpu::sub8(u8 dest, u8 imm8)
 {
-    r_store(dest, r_load(dest) - imm8);
+    reg<D>(dest) -= imm8;
 }
 
-void cpu::sub16(u8 dest, u16 imm16)
+template <typename D> void cpu::sub16(u8 dest, u16 imm16)
 {
-    r_store(dest, r_load(dest) - imm16);
+    reg<D>(dest) -= imm16;
 }
 
-void cpu::and_(u8 dest, u8 src)
+template <typename D, typename S> void cpu::and_(u8 dest, u8 src)
 {
-    r_store(dest, r_load(dest) & r_load(src));
+    reg<D>(dest) &= reg<S>(src);
 }
 
-void cpu::and8(u8 dest, u8 imm8)
+template <typename D> void cpu::and8(u8 dest, u8 imm8)
 {
-    r_store(dest, r_load(dest) & imm8);
+    reg<D>(dest) &= imm8;
 }
 
-void cpu::and16(u8 dest, u16 imm16)
+template <typename D> void cpu::and16(u8 dest, u16 imm16)
 {
-    r_store(dest, r_load(dest) & imm16);
+    reg<D>(dest) &= imm16;
 }
 
-void cpu::or_(u8 dest, u8 src)
+template <typename D, typename S> void cpu::or_(u8 dest, u8 src)
 {
-    r_store(dest, r_load(dest) | r_load(src));
+    reg<D>(dest) |= reg<S>(src);
 }
 
-void cpu::or8(u8 dest, u8 imm8)
+template <typename D> void cpu::or8(u8 dest, u8 imm8)
 {
-    r_store(dest, r_load(dest) | imm8);
+    reg<D>(dest) |= imm8;
 }
 
-void cpu::or16(u8 dest, u16 imm16)
+template <typename D> void cpu::or16(u8 dest, u16 imm16)
 {
-    r_store(dest, r_load(dest) | imm16);
+    reg<D>(dest) |= imm16;
 }
 
-void cpu::not_(u8 dest)
+template <typename D> void cpu::not_(u8 dest)
 {
-    r_store(dest, ~r_load(dest));
+    reg<D>(dest) = ~reg<D>(dest);
 }
 
-void cpu::shr(u8 dest, u8 src)
+template <typename D> void cpu::shr(u8 dest, u8 src)
 {
-    if (is_half_register(dest))
-        *regptr<u8>(dest) >>= *regptr<u8>(src);
-    else
-        *regptr<u16>(dest) >>= *regptr<u8>(src);
+    reg<D>(dest) >>= reg<u8>(src);
 }
 
-void cpu::shr8(u8 dest, u8 imm8)
+template <typename D> void cpu::shr8(u8 dest, u8 imm8)
 {
-    if (is_half_register(dest))
-        *regptr<u8>(dest) >>= imm8;
-    else
-        *regptr<u16>(dest) >>= imm8;
+    reg<D>(dest) >>= imm8;
 }
 
-void cpu::shl(u8 dest, u8 src)
+template <typename D> void cpu::shl(u8 dest, u8 src)
 {
-    if (is_half_register(dest))
-        *regptr<u8>(dest) <<= *regptr<u8>(src);
-    else
-        *regptr<u16>(dest) <<= *regptr<u8>(src);
+    reg<D>(dest) <<= reg<u8>(src);
 }
 
-void cpu::shl8(u8 dest, u8 imm8)
+template <typename D> void cpu::shl8(u8 dest, u8 imm8)
 {
-    if (is_half_register(dest))
-        *regptr<u8>(dest) <<= imm8;
-    else
-        *regptr<u16>(dest) <<= imm8;
+    reg<D>(dest) <<= imm8;
 }
 
-void cpu::mul(u8 dest, u8 src)
+template <typename D, typename S> void cpu::mul(u8 dest, u8 src)
 {
-    if (is_half_register(dest)) {
-        if (is_half_register(src))
-            *regptr<u8>(dest) *= *regptr<u8>(src);
-        else
-            *regptr<u8>(dest) *= *regptr<u16>(src);
-    } else {
-        if (is_half_register(src))
-            *regptr<u16>(dest) *= *regptr<u8>(src);
-        else
-            *regptr<u16>(dest) *= *regptr<u16>(src);
-    }
+    reg<D>(dest) *= reg<S>(src);
 }
 
-void cpu::mul8(u8 dest, u8 imm8)
+template <typename D> void cpu::mul8(u8 dest, u8 imm8)
 {
-    if (is_half_register(dest))
-        *regptr<u8>(dest) *= imm8;
-    else
-        *regptr<u16>(dest) *= imm8;
+    reg<D>(dest) *= imm8;
 }
 
-void cpu::mul16(u8 dest, u16 imm16)
+template <typename D> void cpu::mul16(u8 dest, u16 imm16)
 {
-    if (is_half_register(dest))
-        *regptr<u8>(dest) *= imm16;
-    else
-        *regptr<u16>(dest) *= imm16;
+    reg<D>(dest) *= imm16;
 }
@@ -3,8 +3,132 @@
 
 #include "emul.h"
 
+#include <algorithm>
+
+/* Initial amount of slots in the registry, always a power of 2. */
+#define REGISTRY_MIN_SLOTS 16
+
+static u8 mmio_read(void *ctx, u16 offset);
+static void mmio_write(void *ctx, u16 offset, u8 value);
+
 device::device(u16 id, const std::string& name)
     : id(id)
     , interrupt_ptr(0)
     , name(name)
+    , bit(0)
+    , state(nullptr)
+    , input(nullptr)
+    , output(nullptr)
+    , ops(nullptr)
+    , mmio{mmio_read, mmio_write, nullptr}
+    , rings{}
+    , bytes_in(0)
+    , bytes_out(0)
 { }
+
+static u8 mmio_read(void *ctx, u16 offset)
+{
+    device& dev = *static_cast<device *>(ctx);
+
+    if (dev.ops->mmio_read)
+        return dev.ops->mmio_read(dev, offset);
+
+    switch (offset) {
+    case IRID_MMIO_DATA:
+        dev.bytes_in++;
+        return dev.ops->read ? dev.ops->read(dev) : 0;
+    case IRID_MMIO_STATUS:
+        return dev.ops->poll && dev.ops->poll(dev) ? IRID_MMIO_READY : 0;
+    default:
+        return 0;
+    }
+}
+
+static void mmio_write(void *ctx, u16 offset, u8 value)
+{
+    device& dev = *static_cast<device *>(ctx);
+
+    if (dev.ops->mmio_write)
+        dev.ops->mmio_write(dev, offset, value);
+    else if (offset == IRID_MMIO_DATA && dev.ops->write) {
+        dev.bytes_out++;
+        dev.ops->write(dev, value);
+    }
+}
+
+device_registry::device_registry()
+    : m_count(0)
+    , m_last_id(0)
+    , m_last_index(-1)
+{ }
+
+void device_registry::add(u16 id, int index)
+{
+    size_t mask;
+    size_t i;
+
+    /* Keep at most half of the slots used, so probe chains stay short. */
+    if ((m_count + 1) * 2 > m_slots.size())
+        grow();
+
+    mask = m_slots.size() - 1;
+    for (i = home(id); m_slots[i].index != -1; i = (i + 1) & mask) {
+        if (m_slots[i].id == id)
+            return;
+    }
+
+    m_slots[i] = {id, index};
+    m_count++;
+}
+
+void device_registry::clear()
+{
+    m_slots.clear();
+    m_count = 0;
+    m_last_index = -1;
+}
+
+int device_registry::find(u16 id)
+{
+    size_t mask;
+    size_t i;
+
+    if (m_last_index != -1 && id == m_last_id)
+        return m_last_index;
+
+    if (!m_count)
+        return -1;
+
+    mask = m_slots.size() - 1;
+    for (i = home(id); m_slots[i].index != -1; i = (i + 1) & mask) {
+        if (m_slots[i].id != id)
+            continue;
+
+        m_last_id = id;
+        m_last_index = m_slots[i].index;
+        return m_last_index;
+    }
+
+    return -1;
+}
+
+size_t device_registry::home(u16 id) const
+{
+    /* Fibonacci hashing, so runs of IDs spread over the table. */
+    return ((uint32_t) id * 2654435769u >> 16) & (m_slots.size() - 1);
+}
+
+void device_registry::grow()
+{
+    std::vector<slot> old;
+
+    old.swap(m_slots);
+    m_slots.assign(std::max(old.size() * 2, (size_t) REGISTRY_MIN_SLOTS),
+                   {0, -1});
+    m_count = 0;
+
+    for (const slot& entry : old) {
+        if (entry.index != -1)
+            add(entry.id, entry.index);
+    }
+}
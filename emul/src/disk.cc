@@ -0,0 +1,129 @@
+/* Block device backed by a memory-mapped file
+   Copyright (c) 2023-2024 bellrise */
+
+#include "emul.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Sectors are numbered with 16 bits, any part of the file past the last one
+   is left alone. */
+#define DISK_MAX_SECTORS 0xffff
+
+struct disk_state
+{
+    int fd;
+    u8 *map;
+    size_t size;
+    u16 sectors;
+
+    /* Sectors written since the last sync, as [dirty_first, dirty_end). */
+    size_t dirty_first;
+    size_t dirty_end;
+};
+
+static void disk_close(device&);
+static u16 disk_sector_count(device&);
+static u8 *disk_sectors(device&, u16, u16, bool);
+static void disk_sync(device&);
+
+/* A disk only moves whole sectors, so it cannot be used byte by byte. */
+static const device_ops disk_ops = {
+    disk_close,        nullptr,      nullptr,   nullptr, nullptr, nullptr,
+    nullptr,           nullptr,
+    disk_sector_count, disk_sectors, disk_sync, nullptr, nullptr, nullptr,
+    nullptr,
+};
+
+static inline disk_state *state(device& self)
+{
+    return static_cast<disk_state *>(self.state);
+}
+
+device disk_create(u16 id, const std::string& name, const std::string& file)
+{
+    device disk = {id, name};
+    struct stat info;
+    disk_state *state;
+
+    state = new disk_state;
+    disk.state = state;
+    disk.ops = &disk_ops;
+
+    state->fd = open(file.c_str(), O_RDWR);
+    if (state->fd == -1 || fstat(state->fd, &info))
+        die("failed to open disk %s @ %s", name.c_str(), file.c_str());
+
+    state->sectors = std::min<size_t>(info.st_size / IRID_SECTOR_SIZE,
+                                      DISK_MAX_SECTORS);
+    if (!state->sectors)
+        die("disk %s is smaller than a sector", file.c_str());
+
+    /* Map only the whole sectors, so transfers are plain copies & the kernel
+       writes them back by itself. */
+    state->size = (size_t) state->sectors * IRID_SECTOR_SIZE;
+    state->map = (u8 *) mmap(NULL, state->size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, state->fd, 0);
+    if (state->map == MAP_FAILED)
+        die("failed to map disk %s: %s", file.c_str(), strerror(errno));
+
+    state->dirty_first = state->sectors;
+    state->dirty_end = 0;
+
+    return disk;
+}
+
+static u16 disk_sector_count(device& self)
+{
+    return state(self)->sectors;
+}
+
+static u8 *disk_sectors(device& self, u16 first, u16 count, bool write)
+{
+    disk_state *disk = state(self);
+
+    if ((size_t) first + count > disk->sectors)
+        return nullptr;
+
+    if (write && count) {
+        disk->dirty_first = std::min<size_t>(disk->dirty_first, first);
+        disk->dirty_end = std::max<size_t>(disk->dirty_end, first + count);
+    }
+
+    return disk->map + (size_t) first * IRID_SECTOR_SIZE;
+}
+
+static void disk_sync(device& self)
+{
+    disk_state *disk = state(self);
+    size_t page_mask;
+    size_t start;
+    size_t end;
+
+    if (disk->dirty_first >= disk->dirty_end)
+        return;
+
+    /* msync wants a page aligned start. */
+    page_mask = sysconf(_SC_PAGESIZE) - 1;
+    start = disk->dirty_first * IRID_SECTOR_SIZE & ~page_mask;
+    end = disk->dirty_end * IRID_SECTOR_SIZE;
+
+    if (msync(disk->map + start, end - start, MS_SYNC))
+        warn("failed to sync disk %s: %s", self.name.c_str(), strerror(errno));
+
+    disk->dirty_first = disk->sectors;
+    disk->dirty_end = 0;
+}
+
+static void disk_close(device& self)
+{
+    disk_sync(self);
+    munmap(state(self)->map, state(self)->size);
+    close(state(self)->fd);
+    delete state(self);
+}
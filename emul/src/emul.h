@@ -3,11 +3,19 @@
 
 #pragma once
 
+#include <atomic>
+#include <deque>
 #include <functional>
 #include <irid/arch.h>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdexcept>
+#include <sys/uio.h>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 #define IRID_EMUL_VERSION "0.6"
@@ -25,6 +33,7 @@
 struct image_argument
 {
     char path[256];
+    int bank;
     int offset;
 };
 
@@ -34,12 +43,49 @@ struct serial_argument
     std::string file;
 };
 
+struct disk_argument
+{
+    std::string name;
+    std::string file;
+};
+
+struct net_argument
+{
+    std::string name;
+    std::string file;
+};
+
+/* Clock cycles taken by each opcode. Every instruction takes a single cycle
+   unless changed with --cycles. */
+struct cycle_costs
+{
+    cycle_costs();
+
+    u8 of[256];
+
+    bool uniform() const;
+};
+
 struct settings
 {
     std::vector<image_argument> images;
     std::vector<serial_argument> serials;
+    std::vector<disk_argument> disks;
+    std::vector<net_argument> nets;
     bool show_perf_results;
+    std::string perf_json;
+    bool histogram;
+    std::vector<std::string> symbol_maps;
+    std::string profile;
+    size_t sample_every;
+    std::string callgraph;
+    bool jit;
+    bool no_fusion;
+    bool virtual_time;
+    bool spin_detection;
+    cycle_costs cycles;
     int target_ips;
+    size_t memory_size;
 };
 
 /* Thrown on a CPU fault. */
@@ -68,32 +114,694 @@ struct cpucall_request
     rq request;
 };
 
-/* Provides a memory layout & access mechanisms. */
+/* Handler of a memory-mapped I/O page, called with the offset into the
+   page. */
+struct mmio_handler
+{
+    u8 (*read)(void *ctx, u16 offset);
+    void (*write)(void *ctx, u16 offset, u8 value);
+    void *ctx;
+};
+
+/* Provides a memory layout & access mechanisms.
+
+   Guest addresses are translated by a page table, which maps each of the
+   IRID_MAX_PAGES pages onto a frame of physical memory with its own access
+   bits (IRID_PAGE_*). On reset, each page is mapped onto the frame with the
+   same number & allows any access, which is called a flat layout.
+
+   Physical memory may be larger than the address space. It is split into
+   banks of IRID_MAX_ADDR + 1 bytes, bank 0 being the one seen by the flat
+   layout. Switching banks only remaps pages, the memory is never copied.
+
+   A software TLB keeps translation cheap. It is direct-mapped on the page
+   number & holds a host pointer to the page for each kind of access. The
+   pointer is null if the access has to take the slow path, because the entry
+   is not filled yet, the access is not allowed, or a write would land in a
+   page holding watched code. With only 64 pages, the TLB covers the whole
+   address space, so it never has to compare tags.
+
+   A page may also be mapped onto an MMIO handler instead of a frame. Its TLB
+   entries are never filled, so only the slow path has to look up handlers &
+   accesses to RAM cost nothing extra. Code cannot run from an MMIO page, and
+   it cannot be accessed through spans.
+
+   Accesses only fault on a page which does not allow them, a 16-bit access
+   at the last address, or an instruction fetch wrapping around the end of
+   memory. */
 struct memory
 {
-    memory(size_t total_size, size_t page_size);
+    /* Allocate `size` bytes of physical memory, which has to be a multiple
+       of the bank size. */
+    memory(size_t size = bank_size);
     ~memory();
 
-    /* Read/write bytes from/to memory. May throw page_fault. */
-    u8 read8(u16 addr);
-    void write8(u16 addr, u8 value);
-    u16 read16(u16 addr);
-    void write16(u16 addr, u16 value);
+    /* Read/write bytes from/to memory. May throw cpu_fault. */
+    u8 read8(u16 addr)
+    {
+        u8 *page = m_tlb[TLB_READ][addr >> IRID_PAGE_SIZE_BITS];
+        if (page)
+            return page[addr & offset_mask];
+        return read8_slow(addr);
+    }
+
+    void write8(u16 addr, u8 value)
+    {
+        u8 *page = m_tlb[TLB_WRITE][addr >> IRID_PAGE_SIZE_BITS];
+        if (page)
+            page[addr & offset_mask] = value;
+        else
+            write8_slow(addr, value);
+    }
+
+    u16 read16(u16 addr)
+    {
+        u8 *page = m_tlb[TLB_READ][addr >> IRID_PAGE_SIZE_BITS];
+        u16 off = addr & offset_mask;
+        if (page && off != offset_mask)
+            return page[off] | (page[off + 1] << 8);
+        return read16_slow(addr);
+    }
+
+    void write16(u16 addr, u16 value)
+    {
+        u8 *page = m_tlb[TLB_WRITE][addr >> IRID_PAGE_SIZE_BITS];
+        u16 off = addr & offset_mask;
+        if (page && off != offset_mask) {
+            page[off] = value & 0xff;
+            page[off + 1] = value >> 8;
+        } else {
+            write16_slow(addr, value);
+        }
+    }
+
+    /* Read without faulting or touching device registers, for looking at the
+       program from the outside. Returns false if `addr` cannot be read. */
+    bool peek16(u16 addr, u16& value);
+
+    /* Fetch all 4 bytes of the instruction at `addr` in a single access, the
+       first byte being the lowest one. Requires execute access. */
+    uint32_t fetch32(u16 addr)
+    {
+        u8 *page = m_tlb[TLB_EXEC][addr >> IRID_PAGE_SIZE_BITS];
+        u16 off = addr & offset_mask;
+        if (page && off <= IRID_PAGE_SIZE - 4) {
+            return page[off] | (page[off + 1] << 8) | (page[off + 2] << 16)
+                 | ((uint32_t) page[off + 3] << 24);
+        }
+        return fetch32_slow(addr);
+    }
 
     void read_range(u16 src, void *dest, u16 n);
+
+    /* Call `fn` with the host memory backing [addr, addr + n), a page at
+       a time, so devices can copy straight from/to guest memory. The whole
+       range is checked before `fn` is first called. write_spans stops at the
+       first page `fn` does not fill completely, returning the amount of bytes
+       written, which are then reported like any other write. */
+    void read_spans(u16 addr, u16 n,
+                    const std::function<void(const u8 *, size_t)>& fn);
+    size_t write_spans(u16 addr, u16 n,
+                       const std::function<size_t(u8 *, size_t)>& fn);
     void write_range(u16 dest, void *src, u16 n);
 
     void dump(u16 addr, u16 n);
 
+    /* Mark the 4 bytes of the instruction at `addr` as holding code. Any
+       write touching a watched byte is reported to on_code_write with the
+       written range, at each address the written frame is mapped at & at
+       its flat address. */
+    void watch_code(u16 addr);
+    std::function<void(u16, u16)> on_code_write;
+
+    /* Map `page` onto `frame` with the given IRID_PAGE_* bits, both of which
+       have to exist. The remapped range is reported to on_remap. */
+    void map_page(u16 page, u16 frame, u8 flags);
+    void page_info(u16 page, u16& frame, u8& flags);
+    void reset_pages();
+
+    /* Map `page` onto the handler, readable & writable. The handler has to
+       live until the page is remapped. */
+    void map_mmio(u16 page, const mmio_handler *handler);
+    size_t frames() const
+    {
+        return m_n_frames;
+    }
+
+    /* Map `n` pages starting at `page` onto the same part of `bank`, with
+       all access bits. Both have to exist. */
+    void switch_bank(u16 page, u16 n, u16 bank);
+    size_t banks() const
+    {
+        return m_n_frames / IRID_MAX_PAGES;
+    }
+
+    /* Copy `n` bytes into physical memory at `bank`:`offset`, bypassing the
+       page table. Throws cpu_fault if the range does not fit in the bank. */
+    void write_phys(u16 bank, u16 offset, const void *src, size_t n);
+
+    static constexpr size_t bank_size = IRID_MAX_ADDR + 1;
+
+    std::function<void(u16, u16)> on_remap;
+
+    /* True if the layout is flat, so guest addresses are offsets into
+       host_base() & code_map(). */
+    bool flat() const
+    {
+        return m_remapped == 0;
+    }
+
+    /* Raw access for native code, valid while the layout is flat. The code
+       map has one byte per address, non-zero if the byte is watched. */
+    u8 *host_base();
+    const u8 *code_map();
+
+  private:
+    static constexpr u16 offset_mask = IRID_PAGE_SIZE - 1;
+
+    enum tlb_kind
+    {
+        TLB_READ,
+        TLB_WRITE,
+        TLB_EXEC,
+        TLB_KINDS
+    };
+
+    struct page_entry
+    {
+        u16 frame;
+        u8 flags;
+    };
+
+    size_t m_n_frames;
+    u8 *m_phys;
+    u8 *m_code;
+    bool *m_code_frames;
+    page_entry m_pages[IRID_MAX_PAGES];
+    u8 *m_tlb[TLB_KINDS][IRID_MAX_PAGES];
+    const mmio_handler *m_mmio[IRID_MAX_PAGES];
+    int m_remapped;
+
+    u8 read8_slow(u16 addr);
+    void write8_slow(u16 addr, u8 value);
+    u16 read16_slow(u16 addr);
+    void write16_slow(u16 addr, u16 value);
+    uint32_t fetch32_slow(u16 addr);
+
+    size_t translate(u16 addr, tlb_kind kind);
+    void check_range(u16 addr, u16 n, tlb_kind kind);
+    void notify_write(size_t phys, u16 n);
+    void flush_tlb(u16 page);
+};
+
+/* Handlers for pre-decoded instructions. H_DECODE marks an empty slot in the
+   instruction cache, the handlers up to MUL16 map to a single CPU
+   instruction.
+
+   Instructions with register operands get a handler for each combination of
+   operand widths, W for a full & H for a half register, destination first.
+   The variants of a handler always follow each other in this order.
+
+   The handlers after MUL16 are superinstructions, which run a common sequence
+   of 2 or 3 instructions in a single dispatch, see cpu::fuse(). */
+#define _irid_w_h(X, NAME)   X(NAME##_W) X(NAME##_H)
+#define _irid_ww_hh(X, NAME) X(NAME##_WW) X(NAME##_WH) X(NAME##_HW) X(NAME##_HH)
+
+#define IRID_HANDLERS(X)                                                       \
+    X(DECODE)                                                                  \
+    X(NOP)                                                                     \
+    X(CPUCALL)                                                                 \
+    X(RTI)                                                                     \
+    X(STI)                                                                     \
+    X(DSI)                                                                     \
+    X(WFI)                                                                     \
+    _irid_w_h(X, PUSH)                                                         \
+    X(PUSH8)                                                                   \
+    X(PUSH16)                                                                  \
+    _irid_w_h(X, POP)                                                          \
+    _irid_ww_hh(X, MOV)                                                        \
+    _irid_w_h(X, MOV8)                                                         \
+    _irid_w_h(X, MOV16)                                                        \
+    _irid_w_h(X, LOAD)                                                         \
+    _irid_w_h(X, STORE)                                                        \
+    _irid_w_h(X, LOAD16)                                                       \
+    _irid_w_h(X, STORE16)                                                      \
+    _irid_w_h(X, NULL)                                                         \
+    _irid_ww_hh(X, CMP)                                                        \
+    _irid_w_h(X, CMP8)                                                         \
+    _irid_w_h(X, CMP16)                                                        \
+    _irid_ww_hh(X, CMG)                                                        \
+    X(CMG8)                                                                    \
+    _irid_w_h(X, CMG16)                                                        \
+    _irid_ww_hh(X, CML)                                                        \
+    X(CML8)                                                                    \
+    _irid_w_h(X, CML16)                                                        \
+    X(CFS)                                                                     \
+    X(JMP)                                                                     \
+    _irid_w_h(X, JNZ)                                                          \
+    X(JEQ)                                                                     \
+    X(CALL)                                                                    \
+    X(CALLR)                                                                   \
+    X(RET)                                                                     \
+    _irid_ww_hh(X, ADD)                                                        \
+    _irid_w_h(X, ADD8)                                                         \
+    _irid_w_h(X, ADD16)                                                        \
+    _irid_ww_hh(X, SUB)                                                        \
+    _irid_w_h(X, SUB8)                                                         \
+    _irid_w_h(X, SUB16)                                                        \
+    _irid_ww_hh(X, AND)                                                        \
+    _irid_w_h(X, AND8)                                                         \
+    _irid_w_h(X, AND16)                                                        \
+    _irid_ww_hh(X, OR)                                                         \
+    _irid_w_h(X, OR8)                                                          \
+    _irid_w_h(X, OR16)                                                         \
+    _irid_w_h(X, NOT)                                                          \
+    _irid_w_h(X, SHR)                                                          \
+    _irid_w_h(X, SHR8)                                                         \
+    _irid_w_h(X, SHL)                                                          \
+    _irid_w_h(X, SHL8)                                                         \
+    _irid_ww_hh(X, MUL)                                                        \
+    _irid_w_h(X, MUL8)                                                         \
+    _irid_w_h(X, MUL16)                                                        \
+    _irid_ww_hh(X, CMP_JEQ)                                                    \
+    _irid_w_h(X, CMP8_JEQ)                                                     \
+    _irid_w_h(X, CMP16_JEQ)                                                    \
+    X(CFS_JEQ)                                                                 \
+    X(BP_OFFSET)                                                               \
+    _irid_w_h(X, BP_LOAD)                                                      \
+    _irid_w_h(X, BP_STORE)                                                     \
+    X(PUSH2)                                                                   \
+    X(POP2)                                                                    \
+    _irid_w_h(X, ADD_JMP)
+
+#define _irid_handler_enum(NAME) H_##NAME,
+
+enum insn_handler : u16
+{
+    IRID_HANDLERS(_irid_handler_enum) H_COUNT
+};
+
+#undef _irid_handler_enum
+
+/* Computed goto is used for threaded dispatch if the compiler supports it,
+   otherwise the main loop falls back to a regular switch. */
+#if defined(__GNUC__) && !defined(IRID_NO_COMPUTED_GOTO)
+# define IRID_COMPUTED_GOTO 1
+#endif
+
+/* A pre-decoded instruction. The operands are already extracted from the
+   instruction, so running it does not require touching memory. Register
+   operands are resolved into byte offsets into the register file. */
+struct insn
+{
+    u16 handler; /* One of H_* */
+    u8 dest;     /* First register operand, or an imm8 */
+    u8 src;      /* Second register operand, or an imm8 */
+    u16 imm;     /* 16-bit immediate or address */
+    u16 imm2;    /* Second immediate of a superinstruction */
+    u16 stall;   /* Clock cycles on top of one for each instruction */
+};
+
+/* Set in insn::stall while the CPU counts events, so every instruction goes
+   through cpu::account(). */
+#define STALL_COUNT 0x8000
+
+/* Instruction sequences fused into superinstructions. */
+enum fusion
+{
+    FUSE_CMP_JEQ,   /* cmp rX, ?; jeq @addr */
+    FUSE_CFS_JEQ,   /* cfs; jeq @addr */
+    FUSE_BP_OFFSET, /* mov rX, bp; sub rX, N */
+    FUSE_BP_LOAD,   /* mov rX, bp; sub rX, N; load rY, rX */
+    FUSE_BP_STORE,  /* mov rX, bp; sub rX, N; store rY, rX */
+    FUSE_PUSH2,     /* push rX; push rY */
+    FUSE_POP2,      /* pop rX; pop rY */
+    FUSE_ADD_JMP,   /* add rX, N; jmp @addr */
+    FUSE_COUNT
+};
+
+/* Instruction cache, holds one slot for each address. Code is usually only
+   2-byte aligned, as the assembler packs data right next to it. */
+struct icache
+{
+    static constexpr size_t size = IRID_MAX_ADDR + 1;
+
+    /* Most bytes covered by a single slot, as a superinstruction runs up to
+       3 instructions. */
+    static constexpr size_t span = 12;
+
+    icache();
+
+    insn& at(u16 addr)
+    {
+        return m_slots[addr];
+    }
+
+    /* Drop all decoded instructions overlapping [addr, addr + n). */
+    void invalidate(u16 addr, u16 n);
+    void flush();
+
+  private:
+    std::unique_ptr<insn[]> m_slots;
+};
+
+/* Host time in nanoseconds, from a monotonic clock. */
+long long now_ns();
+
+/* Keeps the CPU at the target instructions-per-second. Instead of timing each
+   instruction, the wall clock is only checked once every quantum of
+   instructions, sleeping off any lead in bulk. */
+struct pacer
+{
+    pacer();
+
+    /* 0 means unlimited, where the clock is never checked. */
+    void set_target_ips(int target_ips);
+    int target_ips() const;
+
+    /* Both return the instruction count at which pace() has to be called
+       next, taking the current instruction count. */
+    size_t start(size_t instructions);
+    size_t pace(size_t instructions);
+
+  private:
+    int m_target_ips;
+    size_t m_quantum;
+    long long m_epoch_ns;
+    size_t m_epoch_instructions;
+
+    size_t next(size_t instructions);
+};
+
+/* Single-producer, single-consumer byte queue, shared by the I/O thread &
+   the CPU thread without any locks. */
+struct byte_ring
+{
+    static constexpr size_t capacity = 4096;
+
+    byte_ring();
+
+    /* Producer side. Returns false if the ring is full. */
+    bool push(u8 byte);
+    size_t space() const;
+
+    /* Consumer side. Returns false if the ring is empty. */
+    bool pop(u8& byte);
+    bool empty() const;
+
+  private:
+    u8 m_buf[capacity];
+    std::atomic<size_t> m_head;
+    std::atomic<size_t> m_tail;
+};
+
+/* Bits of the devices with a pending interrupt, raised from any thread. The
+   CPU thread can sleep until one of them is set, in which case raising a bit
+   also wakes it up with a futex. */
+struct pending_mask
+{
+    pending_mask();
+
+    uint64_t load(std::memory_order order = std::memory_order_seq_cst) const
+    {
+        return m_bits.load(order);
+    }
+
+    void raise(uint64_t bits);
+    void clear(uint64_t bits);
+
+    /* Host time at which the bit with this index was last raised while it
+       was clear, see now_ns(). */
+    long long raised_at(int index) const
+    {
+        return m_raised[index].load(std::memory_order_relaxed);
+    }
+
+    /* Block until any of `bits` is set, or for at most `timeout_ns` unless it
+       is 0. Returns false if it timed out. */
+    bool wait(uint64_t bits, uint64_t timeout_ns = 0);
+
+  private:
+    std::atomic<uint64_t> m_bits;
+    std::atomic<uint32_t> m_wakeups;
+    std::atomic<bool> m_waiting;
+    std::atomic<long long> m_raised[64];
+};
+
+/* Input of a device. Bytes read from `fd` by the I/O thread are queued in
+   the ring, & the device's bit in the pending mask is kept set for as long as
+   there is anything to read, so the CPU only has to test a single word to see
+   if any device wants an interrupt. Only read() & unread() may be called from
+   the CPU thread. An input without an fd is not watched, & the device pushes
+   into the ring from the CPU thread itself. */
+struct device_input
+{
+    device_input(int fd);
+
+    int fd;
+    byte_ring ring;
+
+    /* The fd is a datagram socket. Each datagram is pushed whole, after its
+       length as a little-endian u16, & larger ones than the ring are lost. */
+    bool packets;
+
+    /* Set by cpu::add_device. */
+    pending_mask *pending;
+    uint64_t bit;
+
+    bool ready() const;
+    bool read(u8& byte);
+    size_t read(u8 *buf, size_t n);
+
+    /* Queue bytes produced on the CPU thread, read before the ring. */
+    void unread(u8 byte);
+
+    /* Called by the producer after pushing into the ring. */
+    void notify();
+
+    /* Set the pending bit again if there is anything left to read. */
+    void sync();
+
+  private:
+    std::deque<u8> m_local;
+};
+
+/* Write all `n` bytes, retrying on partial writes. */
+void write_all(int fd, const void *buf, size_t n);
+
+/* Buffered output of a device, so the guest does not cost a syscall for
+   every byte. It is flushed on a newline, when full, before the device's
+   input is read or polled, when the CPU stops or restarts, and periodically
+   by the I/O thread. The sink writes out the whole buffer at once. */
+struct device_output
+{
+    static constexpr size_t capacity = 4096;
+
+    device_output(int fd, void (*sink)(int, const void *, size_t) = write_all);
+
+    int fd;
+
+    void put(u8 byte);
+    void put(const u8 *buf, size_t n);
+    void flush();
+
+  private:
+    std::mutex m_lock;
+    size_t m_len;
+    u8 m_buf[capacity];
+    void (*m_sink)(int fd, const void *buf, size_t n);
+
+    void flush_locked();
+};
+
+/* Host I/O thread, waiting on the input of all devices with epoll. */
+struct io_thread
+{
+    io_thread();
+    ~io_thread();
+
+    /* Start reading into the input, or flushing the output. Either has to
+       live until stop(). */
+    void watch(device_input *input);
+    void watch(device_output *output);
+    void stop();
+
+  private:
+    int m_epoll;
+    int m_wake;
+    std::atomic<bool> m_stopping;
+    std::thread m_thread;
+    std::mutex m_lock;
+    std::vector<device_input *> m_files;
+    std::vector<device_input *> m_full;
+    std::vector<device_output *> m_outputs;
+
+    void run();
+    void retry();
+    void wake();
+};
+
+struct jit_impl;
+
+/* Optional JIT tier, translating hot basic blocks into host code. Only x86-64
+   hosts are supported, see jit::supported(). */
+struct jit
+{
+    jit(memory& mem);
+    ~jit();
+
+    static bool supported();
+
+    /* Called each time the CPU is about to run the block at `addr`. Returns
+       the translated block, or nullptr if it should be interpreted. Blocks
+       are translated once they get hot enough. */
+    const void *profile(u16 addr);
+
+    /* Run translated code until the budget of instructions runs out or an
+       instruction has to be interpreted. Returns the amount of executed
+       instructions, leaving reg.ip at the next instruction to run. */
+    size_t run(const void *block, irid_reg& reg, size_t budget);
+
+    /* Drop all translated code overlapping [addr, addr + n). */
+    void invalidate(u16 addr, u16 n);
+    void flush();
+
   private:
-    size_t m_totalsize;
-    uint8_t *m_mem;
+    jit_impl *m_impl;
+};
+
+/* A segment of the guest image embedded in an AOT program. */
+struct aot_segment
+{
+    u16 offset;
+    size_t size;
+    const u8 *data;
+};
 
-    inline void checkaddr(u16 addr);
+/* A translated basic block, covering [start, end). */
+struct aot_block
+{
+    u16 start;
+    unsigned end;
+};
+
+/* A program translated ahead of time by irid-aot. The generated code sets
+   aot_builtin before main() runs, in which case the emulator loads the
+   embedded image instead of taking image arguments. */
+struct aot_program
+{
+    const aot_segment *segments;
+    size_t n_segments;
+    const aot_block *blocks;
+    size_t n_blocks;
+
+    /* Same as jit::profile() & jit::run(), but all code is translated up
+       front, so lookup() returns nullptr only for code which has to be
+       interpreted. */
+    const void *(*lookup)(u16 addr);
+    size_t (*run)(const void *block, irid_reg& reg, memory& mem,
+                  size_t budget);
+
+    /* Drop all translated code overlapping [addr, addr + n). */
+    void (*invalidate)(u16 addr, u16 n);
 };
 
+extern const aot_program *aot_builtin;
+
 struct device;
 
+/* Maps device IDs onto their index in the device list, using an open
+   addressing hash table. The last found device is cached, as programs tend
+   to talk to a single device for a while. */
+struct device_registry
+{
+    device_registry();
+
+    /* An ID which is already registered keeps its first device. */
+    void add(u16 id, int index);
+    void clear();
+
+    /* Returns -1 if there is no device with the ID. */
+    int find(u16 id);
+
+  private:
+    struct slot
+    {
+        u16 id;
+        int index;
+    };
+
+    std::vector<slot> m_slots;
+    size_t m_count;
+    u16 m_last_id;
+    int m_last_index;
+
+    size_t home(u16 id) const;
+    void grow();
+};
+
+/* Execution statistics reported by -p & --perf-json, see stats.cc. Opcodes
+   & branch outcomes are only counted with --histogram. */
+struct exec_stats
+{
+    size_t opcodes[256];
+    size_t jeq_taken;
+    size_t jeq_not_taken;
+    size_t jnz_taken;
+    size_t jnz_not_taken;
+    size_t cpucalls[256];
+
+    /* From a device raising its pending bit to its handler being issued. */
+    uint64_t irq_latency_ns;
+    uint64_t irq_latency_max_ns;
+};
+
+/* Symbols of the program, from maps written by irid-ld --map. */
+struct symbol_table
+{
+    struct symbol
+    {
+        u16 addr;
+        std::string name;
+    };
+
+    void load(const std::string& path);
+
+    /* The symbol `addr` belongs to, the last one at or before it, or null
+       if there is none. */
+    const symbol *find(u16 addr) const;
+
+    /* Address a function is known by: its symbol, or `addr` itself. */
+    u16 function(u16 addr) const;
+
+    /* Name of the symbol at `addr`, or the address in hex. */
+    std::string name(u16 addr) const;
+
+  private:
+    std::vector<symbol> m_symbols;
+};
+
+/* A function on the shadow call stack, see callgraph.cc. */
+struct call_frame
+{
+    u16 fn;
+    /* Address of the call, or of the instruction an interrupt came before. */
+    u16 site;
+    /* Where the return address is on the guest stack. An interrupt or the
+       first function have none, & are never left by a ret. */
+    uint32_t ret_sp;
+    bool interrupt;
+    /* Instructions run before it was entered, & by the calls it made. */
+    uint64_t start;
+    uint64_t children;
+};
+
+struct call_cost
+{
+    size_t calls;
+    uint64_t inclusive;
+};
+
 struct cpu
 {
     cpu(memory& memory);
@@ -101,110 +809,325 @@ struct cpu
 
     void start();
     void set_target_ips(int target_ips);
+    void enable_jit();
+    void enable_aot(const aot_program& program);
+    void set_fusion(bool enabled);
+    void set_virtual_time(bool enabled);
+    void set_spin_detection(bool enabled);
+    void set_cycle_costs(const cycle_costs& costs);
+    void enable_histogram();
     void print_perf();
+    void write_perf_json(const std::string& path);
+    void load_symbols(const std::string& path);
+    void enable_profile(size_t interval);
+    void write_profile(const std::string& path);
+    void enable_callgraph();
+    void write_callgraph(const std::string& path);
 
     void add_device(const device& dev);
     void remove_devices();
 
   private:
     memory& m_mem;
+    icache m_icache;
+    std::unique_ptr<jit> m_jit;
+    const aot_program *m_aot;
+    bool m_native;
     irid_reg m_reg;
     irid_reg m_reg_cache;
     bool m_interrupts;
     bool m_in_interrupt;
-    int m_cycle_ns;
-    int m_target_ips;
-    size_t m_total_instructions;
+    pacer m_pacer;
+    size_t m_next_pace;
+    /* Clock cycles run so far. Every instruction takes one, & the ones
+       which take longer also count the rest in m_extra_cycles. */
+    size_t m_cycles;
+    size_t m_extra_cycles;
+    cycle_costs m_cycle_costs;
+
+    /* Events counted once the program asks for them, & the values of all
+       performance counters on the last reset. */
+    bool m_counting;
+    size_t m_loads;
+    size_t m_stores;
+    size_t m_branches;
+    uint64_t m_perf_base[IRID_PERF_COUNT];
+
+    /* With --histogram, the opcodes run by each slot are recorded when it is
+       decoded, as the first one in the lowest byte & their number in the
+       highest, so count() does not depend on what is in memory by then. */
+    bool m_histogram;
+    std::vector<uint32_t> m_slot_ops;
+    exec_stats m_stats;
+    bool m_virtual_time;
+    int m_clock_hz;
+    bool m_fusion;
+    size_t m_fused[FUSE_COUNT];
     std::vector<device> m_devices;
+    device_registry m_registry;
+    pending_mask m_pending;
+
+    /* Interrupt controller. Devices with a handler & not masked make up the
+       mask, & each priority above 0 has a set of devices. */
+    uint64_t m_irq_mask;
+    uint64_t m_irq_handlers;
+    uint64_t m_irq_masked;
+    uint64_t m_irq_levels[IRID_IRQ_LEVELS];
+    size_t m_irq_count;
+    size_t m_irq_chained;
+
+    /* Time spent in wfi: slept on the host, or skipped on the virtual clock
+       in cycles, which it counts on top of the instructions. */
+    size_t m_idle_waits;
+    uint64_t m_idle_ns;
+    uint64_t m_idle_cycles;
+    uint64_t m_next_deadline;
+
+    /* Busy-wait detection, see cpu::probe_spin(). While a probe runs, the
+       CPU is paced after every instruction & m_spin_resume is the count at
+       which it would have been paced otherwise. */
+    bool m_spin_detect;
+    bool m_spin_probing;
+    size_t m_spin_next;
+    size_t m_spin_interval;
+    size_t m_spin_resume;
+    size_t m_spin_irqs;
+    int m_spin_steps;
+    irid_reg m_spin_start;
+    size_t m_spin_parks;
+    uint64_t m_spin_skipped;
+
+    /* Sampling profiler, see profile.cc. Every m_sample_interval cycles, the
+       stack of functions the program is in is counted, each function by the
+       address of its symbol, outermost first. */
+    bool m_profile;
+    size_t m_sample_interval;
+    size_t m_sample_next;
+    symbol_table m_symbols;
+    std::map<std::vector<u16>, size_t> m_samples;
+
+    /* Call graph, see callgraph.cc. The instructions each function ran
+       itself, & each call by its caller, site & callee. */
+    bool m_callgraph;
+    std::vector<call_frame> m_call_stack;
+    std::map<u16, uint64_t> m_self_cost;
+    std::map<std::tuple<u16, u16, u16>, call_cost> m_call_costs;
+    io_thread m_io;
     struct timespec m_start_time;
+    uint64_t m_elapsed_ns;
 
     void initialize();
+    void pace();
+    void schedule_events();
+
+    /* Count the cycles an instruction takes past its first one. */
+    void stall(u16 cycles)
+    {
+        m_cycles += cycles;
+        m_extra_cycles += cycles;
+    }
+
+    void account(const insn *in);
+    void count(const insn *in);
+    void start_counting();
+    uint64_t perf_counter(int counter) const;
+    uint32_t slot_ops(u16 addr, u16 handler);
+
+    void sample();
+    void walk_stack(std::vector<u16>& stack, u16 ip, u16 bp, size_t limit);
+
+    /* Instructions run so far, including the one running if `running`. */
+    uint64_t instructions(bool running) const
+    {
+        return m_cycles - m_extra_cycles + running;
+    }
+
+    void reset_call_stack();
+    void enter_function(const call_frame& frame);
+    void leave_function(uint64_t now);
+    void trace_call(u16 addr);
+    void trace_ret(u16 sp);
+    void trace_interrupt(u16 addr, uint64_t now);
+    void trace_rti();
+
+    void start_spin_probe();
+    void probe_spin();
+    void stop_spin_probe();
+    bool spin_safe();
+    void run_timers();
+    uint64_t guest_time() const;
     void mainloop();
+    void nativeloop();
+    insn *fetch();
+    void decode(u16 addr, insn& ins);
+    void decode_one(u16 addr, insn& ins);
+    bool peek(size_t addr, insn& ins);
+    void fuse(u16 addr, insn& ins);
+    device *find_device(u16 id);
     void poll_devices();
+    int next_interrupt();
+    void flush_devices();
+    size_t send_packets(device& dev);
+    size_t receive_packets(device& dev);
     void issue_interrupt(u16 addr);
-    void dump_registers();
+    void wait_for_interrupt();
+    uint64_t idle(uint64_t wake, uint64_t timeout_ns);
 
-    /* Register manipulation */
-    u16 r_load(u8 id);
-    void r_store(u8 id, u16 value);
+    /* Tested before every instruction, so it only looks at a single word of
+       pending device input. */
+    bool interrupt_pending() const
+    {
+        return m_interrupts && !m_in_interrupt
+            && (m_pending.load(std::memory_order_relaxed) & m_irq_mask);
+    }
+    void dump_registers();
 
-    /* CPU instructions. */
+    /* CPU instructions. Register operands are offsets into the register
+       file, D/S/L/R are the types of the destination, source, left & right
+       register: u16 for a full register or u8 for a half register. */
     void cpucall();
     void rti();
-    void push(u8 src);
+    template <typename S> void push(u8 src);
     void push8(u8 imm8);
     void push16(u16 imm16);
-    void pop(u8 dest);
-    void mov(u8 dest, u8 src);
-    void mov8(u8 dest, u8 imm8);
-    void mov16(u8 dest, u16 imm16);
-    void load(u8 dest, u8 srcptr);
-    void store(u8 src, u8 destptr);
-    void load16(u8 dest, u16 imm16ptr);
-    void store16(u8 src, u16 imm16ptr);
-    void null(u8 dest);
-    void cmp(u8 left, u8 right);
-    void cmp8(u8 left, u8 imm8);
-    void cmp16(u8 left, u16 imm16);
-    void cmg(u8 left, u8 right);
+    template <typename D> void pop(u8 dest);
+    template <typename D, typename S> void mov(u8 dest, u8 src);
+    template <typename D> void mov8(u8 dest, u8 imm8);
+    template <typename D> void mov16(u8 dest, u16 imm16);
+    template <typename D> void load(u8 dest, u8 srcptr);
+    template <typename S> void store(u8 src, u8 destptr);
+    template <typename D> void load16(u8 dest, u16 imm16ptr);
+    template <typename S> void store16(u8 src, u16 imm16ptr);
+    template <typename D> void null(u8 dest);
+    template <typename L, typename R> void cmp(u8 left, u8 right);
+    template <typename L> void cmp8(u8 left, u8 imm8);
+    template <typename L> void cmp16(u8 left, u16 imm16);
+    template <typename L, typename R> void cmg(u8 left, u8 right);
     void cmg8(u8 left, u8 imm8);
-    void cmg16(u8 left, u16 imm16);
-    void cml(u8 left, u8 right);
+    template <typename L> void cmg16(u8 left, u16 imm16);
+    template <typename L, typename R> void cml(u8 left, u8 right);
     void cml8(u8 left, u8 imm8);
-    void cml16(u8 left, u16 imm16);
+    template <typename L> void cml16(u8 left, u16 imm16);
     void cfs();
     void jmp(u16 addr);
-    void jnz(u8 cond, u16 addr);
+    template <typename L> void jnz(u8 cond, u16 addr);
     void jeq(u16 addr);
     void call(u16 addr);
     void callr(u8 srcaddr);
     void ret();
-    void add(u8 dest, u8 src);
-    void add8(u8 dest, u8 imm8);
-    void add16(u8 dest, u16 imm16);
-    void sub(u8 dest, u8 src);
-    void sub8(u8 dest, u8 imm8);
-    void sub16(u8 dest, u16 imm16);
-    void and_(u8 dest, u8 src);
-    void and8(u8 dest, u8 imm8);
-    void and16(u8 dest, u16 imm16);
-    void or_(u8 dest, u8 src);
-    void or8(u8 dest, u8 imm8);
-    void or16(u8 dest, u16 imm16);
-    void not_(u8 dest);
-    void shr(u8 dest, u8 src);
-    void shr8(u8 dest, u8 imm8);
-    void shl(u8 dest, u8 src);
-    void shl8(u8 dest, u8 imm8);
-    void mul(u8 dest, u8 src);
-    void mul8(u8 dest, u8 imm8);
-    void mul16(u8 dest, u16 imm16);
+    template <typename D, typename S> void add(u8 dest, u8 src);
+    template <typename D> void add8(u8 dest, u8 imm8);
+    template <typename D> void add16(u8 dest, u16 imm16);
+    template <typename D, typename S> void sub(u8 dest, u8 src);
+    template <typename D> void sub8(u8 dest, u8 imm8);
+    template <typename D> void sub16(u8 dest, u16 imm16);
+    template <typename D, typename S> void and_(u8 dest, u8 src);
+    template <typename D> void and8(u8 dest, u8 imm8);
+    template <typename D> void and16(u8 dest, u16 imm16);
+    template <typename D, typename S> void or_(u8 dest, u8 src);
+    template <typename D> void or8(u8 dest, u8 imm8);
+    template <typename D> void or16(u8 dest, u16 imm16);
+    template <typename D> void not_(u8 dest);
+    template <typename D> void shr(u8 dest, u8 src);
+    template <typename D> void shr8(u8 dest, u8 imm8);
+    template <typename D> void shl(u8 dest, u8 src);
+    template <typename D> void shl8(u8 dest, u8 imm8);
+    template <typename D, typename S> void mul(u8 dest, u8 src);
+    template <typename D> void mul8(u8 dest, u8 imm8);
+    template <typename D> void mul16(u8 dest, u16 imm16);
 
     void cpucall_devicelist();
     void cpucall_deviceinfo();
     void cpucall_deviceintr();
+    void cpucall_devicemap();
+    void cpucall_clock();
+    void cpucall_irqpriority();
+    void cpucall_irqmask();
+    void cpucall_perfread();
+    void cpucall_perfsnapshot();
+    void cpucall_perfreset();
     void cpucall_devicewrite();
     void cpucall_deviceread();
     void cpucall_devicepoll();
+    void cpucall_devicewriten();
+    void cpucall_devicereadn();
+    void cpucall_sectorread();
+    void cpucall_sectorwrite();
+    void cpucall_sectorcount();
+    void cpucall_devicering();
+    void cpucall_devicenotify();
+    void cpucall_timerset();
+    void cpucall_pagemap();
+    void cpucall_pageinfo();
+    void cpucall_bankswitch();
+    void cpucall_meminfo();
 
+    /* Access a register by its offset in the register file. */
     template <typename T>
-    T *regptr(u8 id)
-    {
-        if (id == R_IP)
-            return reinterpret_cast<T *>(&m_reg.ip);
-        if (id == R_SP)
-            return reinterpret_cast<T *>(&m_reg.sp);
-        if (id == R_BP)
-            return reinterpret_cast<T *>(&m_reg.bp);
-
-        if (id < 0x10)
-            return reinterpret_cast<T *>(&((u16 *) &m_reg)[id]);
-        if (id < 0x20)
-            return reinterpret_cast<T *>(regptr<u8>(id - 0x10));
-        return reinterpret_cast<T *>(regptr<u8>(id - 0x20) + 1);
+    T& reg(u8 offset)
+    {
+        return *reinterpret_cast<T *>(reinterpret_cast<u8 *>(&m_reg) + offset);
     }
 
-    bool is_half_register(u8 id);
+    /* Memory access with the width of T. */
+    template <typename T> T read(u16 addr);
+    template <typename T> void write(u16 addr, T value);
+};
+
+/* Operations of a kind of device, any of which may be null. Plain function
+   pointers keep the device read/write/poll path free of std::function. */
+struct device_ops
+{
+    void (*close)(device&);
+    void (*write)(device&, u8);
+    u8 (*read)(device&);
+    bool (*poll)(device&);
+
+    /* Bulk transfers, falling back to write & read byte by byte. Reading
+       does not block, returning the amount of bytes read. */
+    void (*write_range)(device&, const u8 *, size_t);
+    size_t (*read_range)(device&, u8 *, size_t);
+
+    /* Registers of the device mapped into memory, taking the offset into the
+       page. By default, the IRID_MMIO_* registers go through read, write &
+       poll. */
+    u8 (*mmio_read)(device&, u16);
+    void (*mmio_write)(device&, u16, u8);
+
+    /* Block devices: the amount of IRID_SECTOR_SIZE sectors, & the host
+       memory holding `count` sectors starting at `first`, or null if they do
+       not all exist. Asking for memory to write marks the sectors dirty. */
+    u16 (*sector_count)(device&);
+    u8 *(*sectors)(device&, u16 first, u16 count, bool write);
+
+    /* Write back anything the device keeps, on a fault, restart or
+       poweroff. Buffered output is flushed separately. */
+    void (*sync)(device&);
+
+    /* Packet devices: send a packet gathered from the spans, returning false
+       if it cannot be sent right now, & take the next whole packet that was
+       received, or null if there is none. The packet stays valid until the
+       next call. */
+    bool (*send)(device&, const iovec *, int);
+    const u8 *(*receive)(device&, size_t& len);
+
+    /* Timers, taking the guest time in nanoseconds: arm the timer to expire
+       after `ns`, once or periodically, or stop it if `ns` is 0. In virtual
+       time, tick is called once the guest time reaches the deadline it last
+       returned, & returns the next one, or UINT64_MAX if there is none. */
+    void (*arm)(device&, uint64_t now, uint64_t ns, bool periodic);
+    uint64_t (*tick)(device&, uint64_t now);
+};
+
+/* Descriptor rings of a packet device, set by CPUCALL_DEVICERING. The device
+   goes through each ring in order, starting at the next descriptor. */
+struct packet_rings
+{
+    u16 rx;
+    u16 tx;
+    u16 size;
+    u16 rx_next;
+    u16 tx_next;
 };
 
 struct device
@@ -213,15 +1136,29 @@ struct device
     u16 interrupt_ptr;
     std::string name;
 
+    /* Bit in the pending interrupt mask, 0 if the device has none. */
+    uint64_t bit;
+
     /* For device state. */
     void *state;
 
-    device(u16 id, const std::string& name);
+    /* Input filled by the I/O thread & buffered output, may be null. */
+    device_input *input;
+    device_output *output;
+
+    const device_ops *ops;
+
+    /* Handler of the page the device is mapped into. Its context is set
+       when it is mapped, as devices move while they are being added. */
+    mmio_handler mmio;
+
+    packet_rings rings;
+
+    /* Bytes the program read from & wrote to the device. */
+    size_t bytes_in;
+    size_t bytes_out;
 
-    std::function<void(device&)> close;
-    std::function<void(device&, u8)> write;
-    std::function<u8(device&)> read;
-    std::function<bool(device&)> poll;
+    device(u16 id, const std::string& name);
 };
 
 /* Dump `amount` bytes starting from `addr` to stdout. */
@@ -244,3 +1181,19 @@ device console_create(int in, int out);
 /* serial */
 
 device serial_create(u16 id, const std::string& name, const std::string& file);
+
+/* timer */
+
+/* In virtual time, the timer is run by the CPU instead of the host clock. */
+device timer_create(u16 id, bool virtual_time);
+
+/* disk */
+
+device disk_create(u16 id, const std::string& name, const std::string& file);
+
+/* net */
+
+/* Connect to the Unix socket at `file`. Datagram sockets carry a packet in
+   each datagram, while packets on stream sockets are preceded by their length
+   as a little-endian u16. */
+device net_create(u16 id, const std::string& name, const std::string& file);
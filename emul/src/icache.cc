@@ -0,0 +1,35 @@
+/* Instruction cache
+   Copyright (c) 2023-2024 bellrise */
+
+#include "emul.h"
+
+#include <cstring>
+
+icache::icache()
+    : m_slots(new insn[size])
+{
+    flush();
+}
+
+void icache::invalidate(u16 addr, u16 n)
+{
+    size_t first;
+    size_t last;
+
+    if (!n)
+        return;
+
+    /* A write at `addr` may also land in the middle of a slot which starts
+       before it, up to the span of a superinstruction. */
+
+    first = addr >= span - 1 ? addr - (span - 1) : 0;
+    last = (size_t) addr + n - 1;
+
+    for (size_t i = first; i <= last && i < size; i++)
+        m_slots[i].handler = H_DECODE;
+}
+
+void icache::flush()
+{
+    std::memset(m_slots.get(), 0, sizeof(insn) * size);
+}
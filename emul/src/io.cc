@@ -0,0 +1,506 @@
+/* Device I/O thread
+   Copyright (c) 2023-2024 bellrise */
+
+#include "emul.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* How often inputs which cannot be waited on are retried, in milliseconds.
+   These are regular files & inputs with a full ring. */
+#define IO_RETRY_MS 1
+
+/* How often buffered device output is flushed, in milliseconds. */
+#define IO_FLUSH_MS 10
+
+#define IO_MAX_EVENTS 16
+
+enum fill_status
+{
+    FILL_OK,
+    FILL_FULL,
+    FILL_CLOSED
+};
+
+byte_ring::byte_ring()
+    : m_head(0)
+    , m_tail(0)
+{ }
+
+bool byte_ring::push(u8 byte)
+{
+    size_t head = m_head.load(std::memory_order_relaxed);
+
+    if (head - m_tail.load(std::memory_order_acquire) == capacity)
+        return false;
+
+    m_buf[head % capacity] = byte;
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+size_t byte_ring::space() const
+{
+    return capacity
+         - (m_head.load(std::memory_order_relaxed)
+            - m_tail.load(std::memory_order_acquire));
+}
+
+bool byte_ring::pop(u8& byte)
+{
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+
+    if (tail == m_head.load(std::memory_order_acquire))
+        return false;
+
+    byte = m_buf[tail % capacity];
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+bool byte_ring::empty() const
+{
+    return m_tail.load(std::memory_order_relaxed)
+        == m_head.load(std::memory_order_acquire);
+}
+
+pending_mask::pending_mask()
+    : m_bits(0)
+    , m_wakeups(0)
+    , m_waiting(false)
+{
+    for (std::atomic<long long>& raised : m_raised)
+        raised.store(0);
+}
+
+void pending_mask::raise(uint64_t bits)
+{
+    uint64_t fresh;
+    long long now;
+
+    /* Stamp the bits which were clear for the interrupt latency, before they
+       are set so the CPU does not see one with an old stamp. Two threads
+       racing to raise a bit may both stamp it, which hardly matters. */
+    fresh = bits & ~m_bits.load(std::memory_order_relaxed);
+    if (fresh) {
+        now = now_ns();
+        for (; fresh; fresh &= fresh - 1) {
+            m_raised[__builtin_ctzll(fresh)].store(now,
+                                                   std::memory_order_relaxed);
+        }
+    }
+
+    m_bits.fetch_or(bits);
+
+    /* Only pay for the syscall when the CPU is actually asleep. Both this &
+       wait() are sequentially consistent, so either the CPU sees the new bits
+       before it sleeps, or we see it waiting. */
+    if (m_waiting.load()) {
+        m_wakeups.fetch_add(1);
+        syscall(SYS_futex, &m_wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+void pending_mask::clear(uint64_t bits)
+{
+    m_bits.fetch_and(~bits);
+}
+
+bool pending_mask::wait(uint64_t bits, uint64_t timeout_ns)
+{
+    struct timespec timeout;
+    uint32_t wakeups;
+    bool raised;
+
+    timeout.tv_sec = timeout_ns / 1000000000;
+    timeout.tv_nsec = timeout_ns % 1000000000;
+
+    m_waiting.store(true);
+    while (1) {
+        wakeups = m_wakeups.load();
+        raised = m_bits.load() & bits;
+        if (raised)
+            break;
+
+        /* Sleeps only if nobody raised anything since we took the count. The
+           timeout restarts after a wakeup for other bits, which is fine for
+           the CPU only ever using it as an upper bound. */
+        if (syscall(SYS_futex, &m_wakeups, FUTEX_WAIT_PRIVATE, wakeups,
+                    timeout_ns ? &timeout : NULL, NULL, 0)
+                == -1
+            && errno == ETIMEDOUT)
+            break;
+    }
+    m_waiting.store(false);
+
+    return raised;
+}
+
+device_input::device_input(int fd)
+    : fd(fd)
+    , packets(false)
+    , pending(nullptr)
+    , bit(0)
+{ }
+
+bool device_input::ready() const
+{
+    return !m_local.empty() || !ring.empty();
+}
+
+bool device_input::read(u8& byte)
+{
+    bool ok;
+
+    if (!m_local.empty()) {
+        byte = m_local.front();
+        m_local.pop_front();
+        ok = true;
+    } else {
+        ok = ring.pop(byte);
+    }
+
+    sync();
+    return ok;
+}
+
+size_t device_input::read(u8 *buf, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n && !m_local.empty(); i++) {
+        buf[i] = m_local.front();
+        m_local.pop_front();
+    }
+
+    while (i < n && ring.pop(buf[i]))
+        i++;
+
+    sync();
+    return i;
+}
+
+void device_input::unread(u8 byte)
+{
+    m_local.push_back(byte);
+    sync();
+}
+
+void device_input::notify()
+{
+    if (pending)
+        pending->raise(bit);
+}
+
+void device_input::sync()
+{
+    if (!pending)
+        return;
+
+    /* Clear the bit before checking the ring, so a byte pushed in between
+       sets it again instead of getting lost. */
+    pending->clear(bit);
+    if (ready())
+        pending->raise(bit);
+}
+
+void write_all(int fd, const void *buf, size_t n)
+{
+    ssize_t written;
+
+    while (n) {
+        written = write(fd, buf, n);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return;
+
+        buf = (const u8 *) buf + written;
+        n -= written;
+    }
+}
+
+device_output::device_output(int fd, void (*sink)(int, const void *, size_t))
+    : fd(fd)
+    , m_len(0)
+    , m_sink(sink)
+{ }
+
+void device_output::put(u8 byte)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    m_buf[m_len++] = byte;
+    if (byte == '\n' || m_len == capacity)
+        flush_locked();
+}
+
+void device_output::put(const u8 *buf, size_t n)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    bool newline;
+    size_t chunk;
+
+    newline = memchr(buf, '\n', n);
+
+    while (n) {
+        chunk = std::min(n, capacity - m_len);
+        memcpy(&m_buf[m_len], buf, chunk);
+        m_len += chunk;
+        if (m_len == capacity)
+            flush_locked();
+
+        buf += chunk;
+        n -= chunk;
+    }
+
+    if (newline && m_len)
+        flush_locked();
+}
+
+void device_output::flush()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    if (m_len)
+        flush_locked();
+}
+
+void device_output::flush_locked()
+{
+    m_sink(fd, m_buf, m_len);
+    m_len = 0;
+}
+
+/* Read all waiting datagrams into the ring, each after its length. */
+static fill_status fill_packets(device_input *input)
+{
+    u8 buf[byte_ring::capacity];
+    fill_status status;
+    size_t pushed;
+    ssize_t len;
+
+    status = FILL_OK;
+    pushed = 0;
+    while (1) {
+        len = recv(input->fd, buf, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+        if (len == -1) {
+            if (errno != EAGAIN && errno != EINTR)
+                status = FILL_CLOSED;
+            break;
+        }
+
+        /* Wait for room, unless the datagram can never fit. */
+        if ((size_t) len + 2 > input->ring.space()
+            && (size_t) len + 2 <= byte_ring::capacity) {
+            status = FILL_FULL;
+            break;
+        }
+
+        len = recv(input->fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC);
+        if (len == -1 || (size_t) len + 2 > byte_ring::capacity)
+            continue;
+
+        input->ring.push(len & 0xff);
+        input->ring.push(len >> 8);
+        for (ssize_t i = 0; i < len; i++)
+            input->ring.push(buf[i]);
+        pushed++;
+    }
+
+    if (pushed)
+        input->notify();
+    return status;
+}
+
+/* Read whatever is available into the ring. */
+static fill_status fill(device_input *input)
+{
+    u8 buf[512];
+    ssize_t n;
+    size_t space;
+
+    if (input->packets)
+        return fill_packets(input);
+
+    space = input->ring.space();
+    if (!space)
+        return FILL_FULL;
+
+    n = read(input->fd, buf, std::min(space, sizeof(buf)));
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return FILL_OK;
+
+    /* A timerfd only reads whole expiration counts. */
+    if (n == -1 && errno == EINVAL)
+        return FILL_FULL;
+    if (n <= 0)
+        return FILL_CLOSED;
+
+    for (ssize_t i = 0; i < n; i++)
+        input->ring.push(buf[i]);
+    input->notify();
+
+    return (size_t) n == space ? FILL_FULL : FILL_OK;
+}
+
+io_thread::io_thread()
+    : m_stopping(false)
+{
+    struct epoll_event ev = {};
+
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    m_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_epoll == -1 || m_wake == -1)
+        die("failed to create the I/O thread: %s", strerror(errno));
+
+    /* The eventfd has a null pointer, it only interrupts epoll_wait. */
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &ev);
+
+    m_thread = std::thread(&io_thread::run, this);
+}
+
+io_thread::~io_thread()
+{
+    stop();
+    close(m_epoll);
+    close(m_wake);
+}
+
+void io_thread::watch(device_input *input)
+{
+    struct epoll_event ev = {};
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = input;
+    if (!epoll_ctl(m_epoll, EPOLL_CTL_ADD, input->fd, &ev))
+        return;
+
+    /* Regular files cannot be waited on, but are always readable. */
+    if (errno != EPERM)
+        die("cannot watch fd %d: %s", input->fd, strerror(errno));
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_files.push_back(input);
+    wake();
+}
+
+void io_thread::watch(device_output *output)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    m_outputs.push_back(output);
+    wake();
+}
+
+void io_thread::stop()
+{
+    if (!m_thread.joinable())
+        return;
+
+    m_stopping = true;
+    wake();
+    m_thread.join();
+}
+
+void io_thread::wake()
+{
+    uint64_t one = 1;
+
+    if (write(m_wake, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        warn("failed to wake the I/O thread: %s", strerror(errno));
+}
+
+void io_thread::run()
+{
+    struct epoll_event events[IO_MAX_EVENTS];
+    device_input *input;
+    uint64_t count;
+    int timeout;
+    int n;
+
+    while (!m_stopping) {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if (!m_files.empty() || !m_full.empty())
+                timeout = IO_RETRY_MS;
+            else if (!m_outputs.empty())
+                timeout = IO_FLUSH_MS;
+            else
+                timeout = -1;
+        }
+
+        n = epoll_wait(m_epoll, events, IO_MAX_EVENTS, timeout);
+        if (n == -1 && errno != EINTR)
+            die("epoll_wait failed: %s", strerror(errno));
+
+        for (int i = 0; i < n; i++) {
+            input = static_cast<device_input *>(events[i].data.ptr);
+            if (!input) {
+                read(m_wake, &count, sizeof(count));
+                continue;
+            }
+
+            switch (fill(input)) {
+            case FILL_OK:
+                break;
+            case FILL_FULL: {
+                /* Stop waiting on the input until the CPU makes some room,
+                   otherwise epoll would keep waking us up. */
+                events[i].events = 0;
+                epoll_ctl(m_epoll, EPOLL_CTL_MOD, input->fd, &events[i]);
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_full.push_back(input);
+                break;
+            }
+            case FILL_CLOSED:
+                epoll_ctl(m_epoll, EPOLL_CTL_DEL, input->fd, nullptr);
+                break;
+            }
+        }
+
+        retry();
+    }
+}
+
+/* Read from the inputs epoll cannot wait on & flush any output which did
+   not end with a newline. */
+void io_thread::retry()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    struct epoll_event ev = {};
+
+    for (device_output *output : m_outputs)
+        output->flush();
+
+    for (size_t i = 0; i < m_files.size(); i++) {
+        if (fill(m_files[i]) == FILL_CLOSED)
+            m_files.erase(m_files.begin() + i--);
+    }
+
+    for (size_t i = 0; i < m_full.size(); i++) {
+        switch (fill(m_full[i])) {
+        case FILL_FULL:
+            continue;
+        case FILL_OK:
+            ev.events = EPOLLIN;
+            ev.data.ptr = m_full[i];
+            epoll_ctl(m_epoll, EPOLL_CTL_MOD, m_full[i]->fd, &ev);
+            break;
+        case FILL_CLOSED:
+            epoll_ctl(m_epoll, EPOLL_CTL_DEL, m_full[i]->fd, nullptr);
+            break;
+        }
+
+        m_full.erase(m_full.begin() + i--);
+    }
+}
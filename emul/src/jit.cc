@@ -0,0 +1,1294 @@
+/* Basic-block JIT compiler for x86-64 hosts
+   Copyright (c) 2023-2024 bellrise */
+
+#include "emul.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+
+/*
+ * Hot basic blocks are translated into host code. A block ends after the
+ * first control transfer (jmp, jnz, jeq, call, ret), or before any
+ * instruction the translator cannot handle, which is then left for the
+ * interpreter.
+ *
+ * While running translated code, guest registers are pinned in host
+ * registers:
+ *
+ *   r0-r7  -> r8-r15     sp -> si     bp -> di
+ *   rbx    -> jit_state  rbp -> guest memory base
+ *   rax, rcx, rdx are scratch
+ *
+ * Blocks with a static successor are chained together by patching their exit
+ * jump, and ret looks up its target in the block table. Every block entry
+ * checks the instruction budget, so the CPU gets control back at a block
+ * boundary to poll devices, deliver interrupts and pace itself.
+ *
+ * Stores check the code map before writing, and if they would write into
+ * translated or pre-decoded code, leave the block before the store, so the
+ * interpreter can run it & invalidate what is needed.
+ */
+
+#define JIT_CACHE_SIZE   (16 * 1024 * 1024)
+#define JIT_MAX_BLOCK    64
+#define JIT_HOT_THRESHOLD 16
+
+/* Blocks are indexed by the regions of memory they cover, so a write only
+   looks at the blocks near it. */
+#define JIT_REGION_BITS  8
+#define JIT_REGIONS      ((IRID_MAX_ADDR + 1) >> JIT_REGION_BITS)
+
+/* Hotness of an address whose block left before running anything, like one
+   starting with a store into code. It is left to the interpreter until the
+   code there changes. */
+#define JIT_NEVER 0xff
+
+/* Most code a single instruction is translated to, with the exit stubs it
+   adds. The longest are push16 at 133 bytes & call at 148. */
+#define JIT_MAX_INSN     160
+
+/* Stubs emitted after the body: 18 bytes for a side exit, which refunds the
+   budget with an imm8, & 10 for a static exit. */
+#define JIT_SIDE_STUB    18
+#define JIT_STATIC_STUB  10
+
+/* Code around the body of a block: the budget check, the stub for when it is
+   exhausted & the jump out of a block which was cut short. */
+#define JIT_BLOCK_TAIL   64
+
+#define JIT_MAX_CODE     (JIT_MAX_BLOCK * JIT_MAX_INSN + JIT_BLOCK_TAIL)
+
+static_assert(JIT_MAX_BLOCK < 128, "budget refunds must fit in an imm8");
+
+/* State shared between the C++ side & translated code. */
+struct jit_state
+{
+    u16 r[8];
+    u16 sp;
+    u16 bp;
+    u16 ip;
+    u8 cf;
+    u8 pad;
+    long long budget;
+    const void **table;
+    const u8 *code;
+    u8 *mem;
+};
+
+#define S_R(N)   ((int) offsetof(jit_state, r) + (N) * 2)
+#define S_SP     ((int) offsetof(jit_state, sp))
+#define S_BP     ((int) offsetof(jit_state, bp))
+#define S_IP     ((int) offsetof(jit_state, ip))
+#define S_CF     ((int) offsetof(jit_state, cf))
+#define S_BUDGET ((int) offsetof(jit_state, budget))
+#define S_TABLE  ((int) offsetof(jit_state, table))
+#define S_CODE   ((int) offsetof(jit_state, code))
+#define S_MEM    ((int) offsetof(jit_state, mem))
+
+/* Host registers. */
+enum
+{
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+};
+
+/* Two-byte opcodes are written as 0x0fxx. */
+enum
+{
+    OP_ADD = 0x01,
+    OP_OR = 0x09,
+    OP_AND = 0x21,
+    OP_SUB = 0x29,
+    OP_CMP = 0x39,
+    OP_MOV = 0x89,
+    OP_MOVZX8 = 0x0fb6,
+    OP_MOVZX16 = 0x0fb7,
+};
+
+/* Minimal x86-64 instruction emitter. */
+struct x86
+{
+    u8 *p;
+
+    void b(u8 v)
+    {
+        *p++ = v;
+    }
+
+    void d(uint32_t v)
+    {
+        std::memcpy(p, &v, 4);
+        p += 4;
+    }
+
+    void opcode(int op)
+    {
+        if (op > 0xff)
+            b(op >> 8);
+        b(op & 0xff);
+    }
+
+    /* REX prefix, only emitted if needed. Byte access to si/di requires
+       a REX prefix, so it can be forced. */
+    void rex(bool w, int reg, int index, int rm, bool force = false)
+    {
+        u8 r = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2)
+             | ((rm & 8) >> 3);
+        if (r != 0x40 || force)
+            b(r);
+    }
+
+    void modrm(int mod, int reg, int rm)
+    {
+        b((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    /* op rm, reg for the given operand width. For 8-bit operations, the
+       caller passes the 8-bit form of the opcode. */
+    void rr(int width, int op, int reg, int rm)
+    {
+        if (width == 16)
+            b(0x66);
+        rex(width == 64, reg, 0, rm, width == 8);
+        opcode(op);
+        modrm(3, reg, rm);
+    }
+
+    /* Memory operand [base + disp]. */
+    void mem(int reg, int base, int disp)
+    {
+        if (disp == 0 && (base & 7) != RBP) {
+            modrm(0, reg, base);
+        } else if (disp >= -128 && disp < 128) {
+            modrm(1, reg, base);
+            b(disp);
+        } else {
+            modrm(2, reg, base);
+            d(disp);
+        }
+    }
+
+    /* Memory operand [base + index * (1 << scale)]. */
+    void mem_index(int reg, int base, int index, int scale)
+    {
+        if ((base & 7) == RBP) {
+            modrm(1, reg, 4);
+            b((scale << 6) | ((index & 7) << 3) | (base & 7));
+            b(0);
+        } else {
+            modrm(0, reg, 4);
+            b((scale << 6) | ((index & 7) << 3) | (base & 7));
+        }
+    }
+
+    /* op reg, [base + disp] or op [base + disp], reg */
+    void rm(int width, int op, int reg, int base, int disp)
+    {
+        if (width == 16)
+            b(0x66);
+        rex(width == 64, reg, 0, base);
+        opcode(op);
+        mem(reg, base, disp);
+    }
+
+    /* op reg, [base + index * scale] */
+    void rmi(int width, int op, int reg, int base, int index, int scale)
+    {
+        if (width == 16)
+            b(0x66);
+        rex(width == 64, reg, index, base);
+        opcode(op);
+        mem_index(reg, base, index, scale);
+    }
+
+    /* movzx r32, r8 */
+    void movzx8(int dst, int src)
+    {
+        rex(false, dst, 0, src, true);
+        opcode(OP_MOVZX8);
+        modrm(3, dst, src);
+    }
+
+    /* movzx r32, r16 */
+    void movzx16(int dst, int src)
+    {
+        rex(false, dst, 0, src);
+        opcode(OP_MOVZX16);
+        modrm(3, dst, src);
+    }
+
+    /* mov r32, imm32 */
+    void mov_imm(int dst, uint32_t imm)
+    {
+        rex(false, 0, 0, dst);
+        b(0xb8 + (dst & 7));
+        d(imm);
+    }
+
+    /* Group 2 shift/rotate by imm8, ext is the modrm reg field. */
+    void shift_imm(int width, int ext, int dst, u8 imm)
+    {
+        if (width == 16)
+            b(0x66);
+        rex(width == 64, 0, 0, dst, width == 8);
+        b(width == 8 ? 0xc0 : 0xc1);
+        modrm(3, ext, dst);
+        b(imm);
+    }
+
+    /* Group 2 shift by cl. */
+    void shift_cl(int width, int ext, int dst)
+    {
+        if (width == 16)
+            b(0x66);
+        rex(width == 64, 0, 0, dst, width == 8);
+        b(width == 8 ? 0xd2 : 0xd3);
+        modrm(3, ext, dst);
+    }
+
+    /* Group 3 unary op (not = 2). */
+    void unary(int width, int ext, int dst)
+    {
+        if (width == 16)
+            b(0x66);
+        rex(width == 64, 0, 0, dst, width == 8);
+        b(width == 8 ? 0xf6 : 0xf7);
+        modrm(3, ext, dst);
+    }
+
+    /* Group 1 op qword [rbx + disp], imm32 (add = 0, sub = 5, cmp = 7). */
+    void state_qword_imm(int ext, int disp, uint32_t imm)
+    {
+        rex(true, 0, 0, RBX);
+        if (imm < 128) {
+            b(0x83);
+            mem(ext, RBX, disp);
+            b(imm);
+        } else {
+            b(0x81);
+            mem(ext, RBX, disp);
+            d(imm);
+        }
+    }
+
+    /* jmp rel32 / jcc rel32, returns the address of the rel32 field. */
+    u8 *jmp()
+    {
+        b(0xe9);
+        d(0);
+        return p - 4;
+    }
+
+    u8 *jcc(u8 cc)
+    {
+        b(0x0f);
+        b(0x80 | cc);
+        d(0);
+        return p - 4;
+    }
+
+    static void patch(u8 *rel, const void *target)
+    {
+        int32_t off = (const u8 *) target - (rel + 4);
+        std::memcpy(rel, &off, 4);
+    }
+};
+
+/* Condition codes. */
+#define CC_B  0x2
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_A  0x7
+#define CC_LE 0xe
+
+/* A guest register or constant operand. */
+struct jit_operand
+{
+    enum kind
+    {
+        NONE,
+        W16,
+        LO8,
+        HI8,
+        CONST
+    };
+
+    kind kind;
+    int host;
+    u16 value;
+
+    int width() const
+    {
+        return kind == LO8 || kind == HI8 ? 8 : 16;
+    }
+};
+
+static jit_operand reg_operand(u8 id, u16 ip)
+{
+    if (id <= R_R7)
+        return {jit_operand::W16, R8 + id, 0};
+    if (id >= R_H0 && id <= R_H3)
+        return {jit_operand::LO8, R8 + id - R_H0, 0};
+    if (id >= R_L0 && id <= R_L3)
+        return {jit_operand::HI8, R8 + id - R_L0, 0};
+    if (id == R_SP)
+        return {jit_operand::W16, RSI, 0};
+    if (id == R_BP)
+        return {jit_operand::W16, RDI, 0};
+    if (id == R_IP)
+        return {jit_operand::CONST, 0, ip};
+    return {jit_operand::NONE, 0, 0};
+}
+
+static jit_operand imm_operand(u16 value)
+{
+    return {jit_operand::CONST, 0, value};
+}
+
+struct jit_block
+{
+    u16 start;
+    uint32_t end; /* Past the last instruction, up to IRID_MAX_ADDR + 1 */
+    u8 *code;
+    bool dead;
+};
+
+/* A chainable exit: the rel32 field jumps to the exit stub, until the target
+   block is translated. */
+struct jit_link
+{
+    u8 *rel;
+    u8 *stub;
+    jit_block *from;
+};
+
+struct jit_impl
+{
+    memory& mem;
+    jit_state state;
+    u8 *cache;
+    u8 *cache_start;
+    u8 *cache_pos;
+    u8 *epilogue;
+    void (*enter)(jit_state *, const void *);
+    const void *table[IRID_MAX_ADDR + 1];
+    u8 hotness[IRID_MAX_ADDR + 1];
+    std::vector<jit_block *> blocks;
+    std::vector<jit_block *> regions[JIT_REGIONS];
+    std::vector<jit_link> links[IRID_MAX_ADDR + 1];
+
+    jit_impl(memory& mem);
+    ~jit_impl();
+
+    void reset();
+    void emit_trampolines();
+    jit_block *translate(u16 addr);
+    void link_block(jit_block *block);
+    void kill_block(jit_block *block);
+    void kill_range(size_t start, size_t end);
+    void refuse(u16 addr);
+};
+
+/* Per-block translation state. */
+struct jit_translator
+{
+    jit_impl& j;
+    x86 e;
+    u16 start;
+    u16 ip;
+    int count;
+    int index;
+
+    struct side_exit
+    {
+        u8 *rel;
+        u16 ip;
+        int remaining;
+    };
+
+    struct static_exit
+    {
+        u8 *rel;
+        u16 target;
+    };
+
+    std::vector<side_exit> side_exits;
+    std::vector<static_exit> static_exits;
+    std::vector<u8 *> epilogue_jumps;
+
+    jit_translator(jit_impl& j, u8 *at, u16 start)
+        : j(j)
+        , e{at}
+        , start(start)
+        , ip(start)
+        , count(0)
+        , index(0)
+    { }
+
+    /* Load the zero-extended value of an operand into dst. */
+    void load(int dst, const jit_operand& op)
+    {
+        switch (op.kind) {
+        case jit_operand::W16:
+            e.movzx16(dst, op.host);
+            break;
+        case jit_operand::LO8:
+            e.movzx8(dst, op.host);
+            break;
+        case jit_operand::HI8:
+            e.movzx16(dst, op.host);
+            e.shift_imm(32, 5, dst, 8);
+            break;
+        case jit_operand::CONST:
+            e.mov_imm(dst, op.value);
+            break;
+        default:
+            break;
+        }
+    }
+
+    /* Load the low byte of a register into dst, used for shift counts. */
+    void load_low8(int dst, const jit_operand& op)
+    {
+        if (op.kind == jit_operand::W16)
+            e.movzx8(dst, op.host);
+        else if (op.kind == jit_operand::CONST)
+            e.mov_imm(dst, op.value & 0xff);
+        else
+            load(dst, op);
+    }
+
+    /* Swap the bytes of a host register, so the high byte can be accessed as
+       the low one. */
+    void swap_high(const jit_operand& op)
+    {
+        if (op.kind == jit_operand::HI8)
+            e.shift_imm(16, 1, op.host, 8);
+    }
+
+    /* dest = dest OP ecx, or dest = ecx for OP_MOV. */
+    void alu(int op, const jit_operand& dest)
+    {
+        swap_high(dest);
+        if (dest.width() == 8)
+            e.rr(8, op - 1, RCX, dest.host);
+        else
+            e.rr(16, op, RCX, dest.host);
+        swap_high(dest);
+    }
+
+    void shift(int ext, const jit_operand& dest)
+    {
+        swap_high(dest);
+        e.shift_cl(dest.width(), ext, dest.host);
+        swap_high(dest);
+    }
+
+    void shift_imm(int ext, const jit_operand& dest, u8 imm)
+    {
+        swap_high(dest);
+        e.shift_imm(dest.width(), ext, dest.host, imm);
+        swap_high(dest);
+    }
+
+    void not_(const jit_operand& dest)
+    {
+        swap_high(dest);
+        e.unary(dest.width(), 2, dest.host);
+        swap_high(dest);
+    }
+
+    void mul(const jit_operand& dest)
+    {
+        load(RAX, dest);
+        e.rr(32, 0x0faf, RAX, RCX);
+        e.rr(32, OP_MOV, RAX, RCX);
+        alu(OP_MOV, dest);
+    }
+
+    /* cf = eax CC ecx */
+    void compare(u8 cc)
+    {
+        e.rr(32, OP_CMP, RCX, RAX);
+        e.b(0x0f);
+        e.b(0x90 | cc);
+        e.mem(0, RBX, S_CF);
+    }
+
+    /* End of the code emitted so far, with the stubs still to come. */
+    u8 *reserved() const
+    {
+        return e.p + side_exits.size() * JIT_SIDE_STUB
+             + static_exits.size() * JIT_STATIC_STUB;
+    }
+
+    /* Leave the block before the current instruction, letting the
+       interpreter run it instead. */
+    void exit_before(u8 *rel)
+    {
+        side_exits.push_back({rel, ip, count - index});
+    }
+
+    /* Check if writing `n` bytes at the address in eax would touch code, and
+       leave the block if so. */
+    void check_code(int n)
+    {
+        e.rr(32, OP_MOV, RAX, RCX);
+        e.rm(64, 0x8b, RDX, RBX, S_CODE);
+        e.b(0x80);
+        e.mem_index(7, RDX, RCX, 0);
+        e.b(0);
+        exit_before(e.jcc(CC_NE));
+
+        if (n == 2) {
+            /* lea ecx, [rax + 1] */
+            e.b(0x8d);
+            e.mem(RCX, RAX, 1);
+            e.movzx16(RCX, RCX);
+            e.b(0x80);
+            e.mem_index(7, RDX, RCX, 0);
+            e.b(0);
+            exit_before(e.jcc(CC_NE));
+        }
+    }
+
+    /* Leave the block if a 16-bit access at the address in `reg` would wrap
+       around the end of memory, so the interpreter raises the fault. */
+    void check_wrap(int reg)
+    {
+        /* cmp reg16, 0xffff */
+        e.b(0x66);
+        e.rex(false, 0, 0, reg);
+        e.b(0x83);
+        e.modrm(3, 7, reg);
+        e.b(0xff);
+        exit_before(e.jcc(CC_E));
+    }
+
+    /* Leave the block, jumping to a known address. */
+    void exit_static(u8 *rel, u16 target)
+    {
+        static_exits.push_back({rel, target});
+    }
+
+    /* Leave the block, jumping to the address in eax. */
+    void exit_dynamic()
+    {
+        e.rm(64, 0x8b, RDX, RBX, S_TABLE);
+        e.rmi(64, 0x8b, RDX, RDX, RAX, 3);
+        e.rr(64, 0x85, RDX, RDX);
+        epilogue_jumps.push_back(e.jcc(CC_E));
+
+        /* jmp rdx */
+        e.b(0xff);
+        e.modrm(3, 4, RDX);
+    }
+
+    /* Check for sp == 0, which faults on push. */
+    void check_stack()
+    {
+        e.rr(16, 0x85, RSI, RSI);
+        exit_before(e.jcc(CC_E));
+    }
+
+    /* Push a register or a constant of the given width. */
+    void push(const jit_operand& src, int width)
+    {
+        check_stack();
+
+        /* eax = sp - width */
+        e.movzx16(RAX, RSI);
+        e.b(0x83);
+        e.modrm(3, 5, RAX);
+        e.b(width / 8);
+        e.movzx16(RAX, RAX);
+        if (width == 16)
+            check_wrap(RAX);
+        check_code(width / 8);
+
+        load(RCX, src);
+        e.rr(16, OP_MOV, RAX, RSI);
+        if (width == 8)
+            e.rmi(8, 0x88, RCX, RBP, RAX, 0);
+        else
+            e.rmi(16, 0x89, RCX, RBP, RAX, 0);
+    }
+
+    bool instruction(u8 op, u8 a, u8 b, u16 imm16at1, u16 imm16at2,
+                     bool& ends_block);
+    void finish(u16 fallthrough, bool ends_block);
+};
+
+/* Translate a single instruction. Returns false if it cannot be translated,
+   in which case the block ends before it. */
+bool jit_translator::instruction(u8 op, u8 a, u8 b, u16 imm16at1,
+                                 u16 imm16at2, bool& ends_block)
+{
+    jit_operand x = reg_operand(a, ip);
+    jit_operand y = reg_operand(b, ip);
+    bool dest_ok = x.kind != jit_operand::NONE && x.kind != jit_operand::CONST;
+    bool src_ok = y.kind != jit_operand::NONE;
+
+    ends_block = false;
+
+    switch (op) {
+    case I_NOP:
+        return true;
+
+    case I_PUSH:
+        if (x.kind == jit_operand::NONE)
+            return false;
+        push(x, x.width());
+        return true;
+    case I_PUSH8:
+        push(imm_operand(a), 8);
+        return true;
+    case I_PUSH16:
+        push(imm_operand(imm16at1), 16);
+        return true;
+    case I_POP:
+        if (!dest_ok)
+            return false;
+        if (x.width() == 16)
+            check_wrap(RSI);
+        e.rmi(32, x.width() == 8 ? OP_MOVZX8 : OP_MOVZX16, RCX, RBP, RSI, 0);
+        e.b(0x66);
+        e.b(0x83);
+        e.modrm(3, 0, RSI);
+        e.b(x.width() / 8);
+        alu(OP_MOV, x);
+        return true;
+
+    case I_MOV:
+        if (!dest_ok || !src_ok)
+            return false;
+        load(RCX, y);
+        alu(OP_MOV, x);
+        return true;
+    case I_MOV8:
+    case I_MOV16:
+        if (!dest_ok)
+            return false;
+        e.mov_imm(RCX, op == I_MOV8 ? b : imm16at2);
+        alu(OP_MOV, x);
+        return true;
+    case I_NULL:
+        if (!dest_ok)
+            return false;
+        e.mov_imm(RCX, 0);
+        alu(OP_MOV, x);
+        return true;
+
+    case I_LOAD:
+    case I_LOAD16:
+        if (!dest_ok)
+            return false;
+        if (op == I_LOAD) {
+            if (!src_ok || y.kind == jit_operand::LO8
+                || y.kind == jit_operand::HI8)
+                return false;
+            load(RAX, y);
+            if (x.width() == 16)
+                check_wrap(RAX);
+        } else {
+            if (x.width() == 16 && imm16at2 == IRID_MAX_ADDR)
+                return false;
+            e.mov_imm(RAX, imm16at2);
+        }
+        e.rmi(32, x.width() == 8 ? OP_MOVZX8 : OP_MOVZX16, RCX, RBP, RAX, 0);
+        alu(OP_MOV, x);
+        return true;
+
+    case I_STORE:
+    case I_STORE16:
+        if (x.kind == jit_operand::NONE)
+            return false;
+        if (op == I_STORE) {
+            if (!src_ok || y.kind == jit_operand::LO8
+                || y.kind == jit_operand::HI8)
+                return false;
+            load(RAX, y);
+            if (x.width() == 16)
+                check_wrap(RAX);
+        } else {
+            if (x.width() == 16 && imm16at2 == IRID_MAX_ADDR)
+                return false;
+            e.mov_imm(RAX, imm16at2);
+        }
+        check_code(x.width() / 8);
+        load(RCX, x);
+        if (x.width() == 8)
+            e.rmi(8, 0x88, RCX, RBP, RAX, 0);
+        else
+            e.rmi(16, 0x89, RCX, RBP, RAX, 0);
+        return true;
+
+    case I_CMP:
+    case I_CMG:
+    case I_CML:
+        if (x.kind == jit_operand::NONE || !src_ok)
+            return false;
+        load(RAX, x);
+        load(RCX, y);
+        compare(op == I_CMP ? CC_E : op == I_CMG ? CC_A : CC_B);
+        return true;
+    case I_CMP8:
+    case I_CMG8:
+    case I_CML8:
+        if (x.kind == jit_operand::NONE)
+            return false;
+        load(RAX, x);
+        if (op != I_CMP8)
+            e.movzx8(RAX, RAX);
+        e.mov_imm(RCX, b);
+        compare(op == I_CMP8 ? CC_E : op == I_CMG8 ? CC_A : CC_B);
+        return true;
+    case I_CMP16:
+    case I_CMG16:
+    case I_CML16:
+        if (x.kind == jit_operand::NONE)
+            return false;
+        load(RAX, x);
+        e.mov_imm(RCX, imm16at2);
+        compare(op == I_CMP16 ? CC_E : op == I_CMG16 ? CC_A : CC_B);
+        return true;
+    case I_CFS:
+        /* xor byte [rbx + cf], 1 */
+        e.b(0x80);
+        e.mem(6, RBX, S_CF);
+        e.b(1);
+        return true;
+
+    case I_ADD:
+    case I_SUB:
+    case I_AND:
+    case I_OR:
+        if (!dest_ok || !src_ok)
+            return false;
+        load(RCX, y);
+        alu(op == I_ADD   ? OP_ADD
+            : op == I_SUB ? OP_SUB
+            : op == I_AND ? OP_AND
+                          : OP_OR,
+            x);
+        return true;
+    case I_ADD8:
+    case I_SUB8:
+    case I_AND8:
+    case I_OR8:
+        if (!dest_ok)
+            return false;
+        e.mov_imm(RCX, b);
+        alu(op == I_ADD8   ? OP_ADD
+            : op == I_SUB8 ? OP_SUB
+            : op == I_AND8 ? OP_AND
+                           : OP_OR,
+            x);
+        return true;
+    case I_ADD16:
+    case I_SUB16:
+    case I_AND16:
+    case I_OR16:
+        if (!dest_ok)
+            return false;
+        e.mov_imm(RCX, imm16at2);
+        alu(op == I_ADD16   ? OP_ADD
+            : op == I_SUB16 ? OP_SUB
+            : op == I_AND16 ? OP_AND
+                            : OP_OR,
+            x);
+        return true;
+    case I_NOT:
+        if (!dest_ok)
+            return false;
+        not_(x);
+        return true;
+
+    case I_SHR:
+    case I_SHL:
+        if (!dest_ok || !src_ok)
+            return false;
+        load_low8(RCX, y);
+        shift(op == I_SHR ? 5 : 4, x);
+        return true;
+    case I_SHR8:
+    case I_SHL8:
+        if (!dest_ok)
+            return false;
+        shift_imm(op == I_SHR8 ? 5 : 4, x, b);
+        return true;
+
+    case I_MUL:
+        if (!dest_ok || !src_ok)
+            return false;
+        load(RCX, y);
+        mul(x);
+        return true;
+    case I_MUL8:
+    case I_MUL16:
+        if (!dest_ok)
+            return false;
+        e.mov_imm(RCX, op == I_MUL8 ? b : imm16at2);
+        mul(x);
+        return true;
+
+    case I_JMP:
+        exit_static(e.jmp(), imm16at1);
+        ends_block = true;
+        return true;
+    case I_JEQ:
+        e.b(0x80);
+        e.mem(7, RBX, S_CF);
+        e.b(0);
+        exit_static(e.jcc(CC_NE), imm16at1);
+        exit_static(e.jmp(), ip + 4);
+        ends_block = true;
+        return true;
+    case I_JNZ:
+        if (x.kind == jit_operand::NONE)
+            return false;
+        load(RCX, x);
+        e.rr(32, 0x85, RCX, RCX);
+        exit_static(e.jcc(CC_NE), imm16at2);
+        exit_static(e.jmp(), ip + 4);
+        ends_block = true;
+        return true;
+    case I_CALL:
+        push(imm_operand(ip + 4), 16);
+        exit_static(e.jmp(), imm16at1);
+        ends_block = true;
+        return true;
+    case I_RET:
+        check_wrap(RSI);
+        e.rmi(32, OP_MOVZX16, RAX, RBP, RSI, 0);
+        e.b(0x66);
+        e.b(0x83);
+        e.modrm(3, 0, RSI);
+        e.b(2);
+        exit_dynamic();
+        ends_block = true;
+        return true;
+
+    default:
+        /* cpucall, rti, sti, dsi, callr & unknown instructions are left for
+           the interpreter. */
+        return false;
+    }
+}
+
+/* Emit the exit stubs after the block body. */
+void jit_translator::finish(u16 fallthrough, bool ends_block)
+{
+    if (!ends_block)
+        exit_static(e.jmp(), fallthrough);
+
+    for (const side_exit& ex : side_exits) {
+        x86::patch(ex.rel, e.p);
+        e.state_qword_imm(0, S_BUDGET, ex.remaining);
+        e.mov_imm(RAX, ex.ip);
+        x86::patch(e.jmp(), j.epilogue);
+    }
+
+    for (u8 *rel : epilogue_jumps)
+        x86::patch(rel, j.epilogue);
+}
+
+jit_impl::jit_impl(memory& mem)
+    : mem(mem)
+{
+    cache = (u8 *) mmap(NULL, JIT_CACHE_SIZE,
+                        PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (cache == MAP_FAILED)
+        die("failed to map the JIT code cache");
+
+    std::memset(&state, 0, sizeof(state));
+    state.table = table;
+    state.code = mem.code_map();
+    state.mem = mem.host_base();
+
+    emit_trampolines();
+    reset();
+}
+
+jit_impl::~jit_impl()
+{
+    for (jit_block *block : blocks)
+        delete block;
+    munmap(cache, JIT_CACHE_SIZE);
+}
+
+void jit_impl::emit_trampolines()
+{
+    x86 e{cache};
+    static const int pinned[] = {R8,      R8 + 1,  R8 + 2, R8 + 3,
+                                 R8 + 4,  R8 + 5,  R8 + 6, R8 + 7};
+
+    /* enter(jit_state *state, const void *code) */
+    enter = (void (*)(jit_state *, const void *)) e.p;
+
+    e.b(0x53); /* push rbx */
+    e.b(0x55); /* push rbp */
+    e.b(0x41); /* push r12-r15 */
+    e.b(0x54);
+    e.b(0x41);
+    e.b(0x55);
+    e.b(0x41);
+    e.b(0x56);
+    e.b(0x41);
+    e.b(0x57);
+
+    e.rr(64, OP_MOV, RDI, RBX);
+    e.rr(64, OP_MOV, RSI, RAX);
+    e.rm(64, 0x8b, RBP, RBX, S_MEM);
+
+    for (int i = 0; i < 8; i++)
+        e.rm(32, OP_MOVZX16, pinned[i], RBX, S_R(i));
+    e.rm(32, OP_MOVZX16, RSI, RBX, S_SP);
+    e.rm(32, OP_MOVZX16, RDI, RBX, S_BP);
+
+    /* jmp rax */
+    e.b(0xff);
+    e.modrm(3, 4, RAX);
+
+    /* Epilogue, the next guest ip is in eax. */
+    epilogue = e.p;
+
+    e.rm(16, OP_MOV, RAX, RBX, S_IP);
+    for (int i = 0; i < 8; i++)
+        e.rm(16, OP_MOV, pinned[i], RBX, S_R(i));
+    e.rm(16, OP_MOV, RSI, RBX, S_SP);
+    e.rm(16, OP_MOV, RDI, RBX, S_BP);
+
+    e.b(0x41); /* pop r15-r12 */
+    e.b(0x5f);
+    e.b(0x41);
+    e.b(0x5e);
+    e.b(0x41);
+    e.b(0x5d);
+    e.b(0x41);
+    e.b(0x5c);
+    e.b(0x5d); /* pop rbp */
+    e.b(0x5b); /* pop rbx */
+    e.b(0xc3); /* ret */
+
+    cache_start = e.p;
+}
+
+void jit_impl::reset()
+{
+    for (jit_block *block : blocks)
+        delete block;
+    blocks.clear();
+
+    for (auto& region : regions)
+        region.clear();
+    for (auto& l : links)
+        l.clear();
+
+    std::memset(table, 0, sizeof(table));
+    std::memset(hotness, 0, sizeof(hotness));
+
+    /* Keep the trampolines at the start of the cache. */
+    cache_pos = cache_start;
+}
+
+jit_block *jit_impl::translate(u16 addr)
+{
+    jit_translator t(*this, nullptr, addr);
+    jit_block *block;
+    bool ends_block;
+    u16 ip;
+
+    if (cache + JIT_CACHE_SIZE - cache_pos < JIT_MAX_CODE)
+        reset();
+
+    block = new jit_block{addr, addr, cache_pos, false};
+    t.e.p = cache_pos;
+
+    /* Count the instructions first, so the budget can be charged for the
+       whole block at the entry. */
+
+    ip = addr;
+    for (t.count = 0; t.count < JIT_MAX_BLOCK; t.count++) {
+        /* An instruction wrapping around the end of memory faults, leave it
+           to the interpreter. */
+        if (ip > IRID_MAX_ADDR - 3)
+            break;
+
+        u8 op = mem.read8(ip);
+
+        if (op == I_JMP || op == I_JNZ || op == I_JEQ || op == I_CALL
+            || op == I_RET) {
+            t.count++;
+            break;
+        }
+
+        if (ip > IRID_MAX_ADDR - 4)
+            break;
+        ip += 4;
+    }
+
+    /* Budget check. */
+    t.e.state_qword_imm(7, S_BUDGET, 0);
+    u8 *exhausted = t.e.jcc(CC_LE);
+    t.e.state_qword_imm(5, S_BUDGET, t.count);
+
+    ends_block = false;
+    for (t.index = 0; t.index < t.count; t.index++) {
+        /* Cut the block short if the next instruction might not fit in the
+           cache, which is never the case for the first one. */
+        if (cache + JIT_CACHE_SIZE - t.reserved()
+            < JIT_MAX_INSN + JIT_BLOCK_TAIL)
+            break;
+
+        uint32_t word = mem.fetch32(t.ip);
+        u8 op = word;
+        u8 a = word >> 8;
+        u8 b = word >> 16;
+        u16 imm16at1 = word >> 8;
+        u16 imm16at2 = word >> 16;
+
+        if (!t.instruction(op, a, b, imm16at1, imm16at2, ends_block))
+            break;
+
+        mem.watch_code(t.ip);
+        t.ip += 4;
+
+        if (ends_block)
+            break;
+    }
+
+    /* Nothing was translated, leave this block to the interpreter. */
+    if (t.index == 0 && !ends_block) {
+        delete block;
+        hotness[addr] = 0;
+        return nullptr;
+    }
+
+    /* If the block was cut short, refund the instructions which are not
+       going to run. */
+    if (!ends_block && t.index < t.count) {
+        u8 *rel = t.e.jmp();
+        t.side_exits.push_back({rel, t.ip, t.count - t.index});
+        t.finish(t.ip, true);
+    } else {
+        t.finish(t.ip, ends_block);
+    }
+
+    block->end = t.ip ? t.ip : IRID_MAX_ADDR + 1;
+
+    /* Budget exhausted, leave before running anything. */
+    x86::patch(exhausted, t.e.p);
+    t.e.mov_imm(RAX, addr);
+    x86::patch(t.e.jmp(), epilogue);
+
+    /* Static exits get their own stubs, so they can be chained later. */
+    for (const auto& ex : t.static_exits) {
+        u8 *stub = t.e.p;
+        x86::patch(ex.rel, stub);
+        t.e.mov_imm(RAX, ex.target);
+        x86::patch(t.e.jmp(), epilogue);
+
+        links[ex.target].push_back({ex.rel, stub, block});
+        if (table[ex.target])
+            x86::patch(ex.rel, table[ex.target]);
+    }
+
+    cache_pos = t.e.p;
+    blocks.push_back(block);
+    for (size_t i = addr >> JIT_REGION_BITS;
+         i <= (block->end - 1) >> JIT_REGION_BITS; i++)
+        regions[i].push_back(block);
+    table[addr] = block->code;
+    link_block(block);
+
+    return block;
+}
+
+/* Chain all exits waiting for this block directly into it. */
+void jit_impl::link_block(jit_block *block)
+{
+    for (jit_link& link : links[block->start]) {
+        if (!link.from->dead)
+            x86::patch(link.rel, block->code);
+    }
+}
+
+void jit_impl::kill_block(jit_block *block)
+{
+    block->dead = true;
+    table[block->start] = nullptr;
+    hotness[block->start] = 0;
+
+    /* Unchain all blocks jumping into this one. */
+    for (jit_link& link : links[block->start]) {
+        if (!link.from->dead)
+            x86::patch(link.rel, link.stub);
+    }
+}
+
+/* Kill every block overlapping the range, dropping dead blocks from the
+   regions on the way. */
+void jit_impl::kill_range(size_t start, size_t end)
+{
+    for (size_t i = start >> JIT_REGION_BITS;
+         i <= (end - 1) >> JIT_REGION_BITS; i++) {
+        auto& region = regions[i];
+
+        for (jit_block *block : region) {
+            if (!block->dead && block->start < end && start < block->end)
+                kill_block(block);
+        }
+
+        region.erase(std::remove_if(region.begin(), region.end(),
+                                    [](jit_block *b) { return b->dead; }),
+                     region.end());
+    }
+}
+
+void jit_impl::refuse(u16 addr)
+{
+    kill_range(addr, (size_t) addr + 1);
+    hotness[addr] = JIT_NEVER;
+}
+
+jit::jit(memory& mem)
+    : m_impl(new jit_impl(mem))
+{ }
+
+jit::~jit()
+{
+    delete m_impl;
+}
+
+bool jit::supported()
+{
+    return true;
+}
+
+const void *jit::profile(u16 addr)
+{
+    if (m_impl->table[addr])
+        return m_impl->table[addr];
+
+    if (m_impl->hotness[addr] == JIT_NEVER
+        || ++m_impl->hotness[addr] < JIT_HOT_THRESHOLD)
+        return nullptr;
+
+    jit_block *block = m_impl->translate(addr);
+    return block ? block->code : nullptr;
+}
+
+size_t jit::run(const void *code, irid_reg& reg, size_t budget)
+{
+    jit_state& s = m_impl->state;
+    long long start;
+
+    s.r[0] = reg.r0;
+    s.r[1] = reg.r1;
+    s.r[2] = reg.r2;
+    s.r[3] = reg.r3;
+    s.r[4] = reg.r4;
+    s.r[5] = reg.r5;
+    s.r[6] = reg.r6;
+    s.r[7] = reg.r7;
+    s.sp = reg.sp;
+    s.bp = reg.bp;
+    s.cf = reg.cf;
+
+    start = budget > LLONG_MAX ? LLONG_MAX : (long long) budget;
+    s.budget = start;
+
+    m_impl->enter(&s, code);
+
+    /* The block was left before its first instruction, & would be entered
+       again each time the CPU gets there. */
+    if (start > 0 && s.budget == start)
+        m_impl->refuse(s.ip);
+
+    reg.r0 = s.r[0];
+    reg.r1 = s.r[1];
+    reg.r2 = s.r[2];
+    reg.r3 = s.r[3];
+    reg.r4 = s.r[4];
+    reg.r5 = s.r[5];
+    reg.r6 = s.r[6];
+    reg.r7 = s.r[7];
+    reg.sp = s.sp;
+    reg.bp = s.bp;
+    reg.ip = s.ip;
+    reg.cf = s.cf;
+
+    return start - s.budget;
+}
+
+void jit::invalidate(u16 addr, u16 n)
+{
+    size_t end = (size_t) addr + n;
+
+    if (!n)
+        return;
+
+    m_impl->kill_range(addr, end);
+
+    for (size_t i = addr; i < end; i++) {
+        if (m_impl->hotness[i] == JIT_NEVER)
+            m_impl->hotness[i] = 0;
+    }
+}
+
+void jit::flush()
+{
+    m_impl->reset();
+}
+
+#else
+
+/* No JIT support for this host, the interpreter is used instead. */
+
+struct jit_impl
+{ };
+
+jit::jit(memory __attribute__((unused)) & mem)
+    : m_impl(nullptr)
+{ }
+
+jit::~jit() { }
+
+bool jit::supported()
+{
+    return false;
+}
+
+const void *jit::profile(u16 __attribute__((unused)) addr)
+{
+    return nullptr;
+}
+
+size_t jit::run(const void __attribute__((unused)) * code,
+                irid_reg __attribute__((unused)) & reg,
+                size_t __attribute__((unused)) budget)
+{
+    return 0;
+}
+
+void jit::invalidate(u16 __attribute__((unused)) addr,
+                     u16 __attribute__((unused)) n)
+{ }
+
+void jit::flush() { }
+
+#endif
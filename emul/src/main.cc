@@ -3,6 +3,7 @@
 
 #include "emul.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <ctype.h>
@@ -16,34 +17,91 @@
 void parse_args(struct settings& settings, int argc, char **argv);
 static void load_images(const std::vector<image_argument>& images,
                         memory& memory);
+static void load_aot_image(const aot_program& program, memory& memory);
 
 int main(int argc, char **argv)
 {
     struct settings settings = {};
     u16 serial_addr;
+    u16 disk_addr;
+    u16 net_addr;
+    bool native;
 
     settings.target_ips = 10000;
     settings.show_perf_results = false;
+    settings.sample_every = 10000;
+    settings.memory_size = memory::bank_size;
 
     parse_args(settings, argc, argv);
 
-    memory ram(IRID_MAX_ADDR + 1, IRID_PAGE_SIZE);
+    memory ram(settings.memory_size);
     cpu cpu(ram);
 
+    /* Virtual time needs a clock rate to count in. */
+    if (settings.virtual_time && !settings.target_ips)
+        die("virtual time needs a target speed");
+
     cpu.set_target_ips(settings.target_ips);
+    cpu.set_virtual_time(settings.virtual_time);
+    cpu.set_spin_detection(settings.spin_detection);
+    cpu.set_fusion(!settings.no_fusion);
+    cpu.set_cycle_costs(settings.cycles);
+
+    /* Native code counts a cycle for every instruction, & nothing else. */
+    native = settings.cycles.uniform() && !settings.histogram
+          && settings.callgraph.empty();
+    if (!native && (aot_builtin || settings.jit)) {
+        warn("native code cannot count %s, using the interpreter",
+             settings.histogram           ? "opcodes"
+             : !settings.callgraph.empty() ? "calls"
+                                           : "cycle costs");
+    }
+    if (settings.histogram)
+        cpu.enable_histogram();
+    if (!settings.callgraph.empty())
+        cpu.enable_callgraph();
+
+    for (const std::string& path : settings.symbol_maps)
+        cpu.load_symbols(path);
+    if (!settings.profile.empty())
+        cpu.enable_profile(settings.sample_every);
+
+    /* A program built by irid-aot carries its own image & native code. */
+    if (aot_builtin) {
+        load_aot_image(*aot_builtin, ram);
+        if (native)
+            cpu.enable_aot(*aot_builtin);
+    } else if (settings.jit && native) {
+        cpu.enable_jit();
+    }
 
     load_images(settings.images, ram);
     cpu.add_device(console_create(STDIN_FILENO, STDOUT_FILENO));
+    cpu.add_device(timer_create(0x1001, settings.virtual_time));
 
     serial_addr = 0x100;
     for (const serial_argument& arg : settings.serials)
         cpu.add_device(serial_create(serial_addr++, arg.name, arg.file));
 
+    disk_addr = 0x200;
+    for (const disk_argument& arg : settings.disks)
+        cpu.add_device(disk_create(disk_addr++, arg.name, arg.file));
+
+    net_addr = 0x300;
+    for (const net_argument& arg : settings.nets)
+        cpu.add_device(net_create(net_addr++, arg.name, arg.file));
+
     /* Run the CPU. */
     cpu.start();
 
     if (settings.show_perf_results)
         cpu.print_perf();
+    if (!settings.perf_json.empty())
+        cpu.write_perf_json(settings.perf_json);
+    if (!settings.profile.empty())
+        cpu.write_profile(settings.profile);
+    if (!settings.callgraph.empty())
+        cpu.write_callgraph(settings.callgraph);
 
     cpu.remove_devices();
 }
@@ -65,8 +123,29 @@ static void load_images(const std::vector<image_argument>& images,
         buf = (char *) malloc(fileinfo.st_size);
         read(fd, buf, fileinfo.st_size);
 
-        /* Copy the buffer into the CPU memory. */
-        memory.write_range(image.offset, buf, fileinfo.st_size);
+        if ((size_t) image.bank >= memory.banks())
+            die("no bank %x for %s", image.bank, image.path);
+        if (image.offset + (size_t) fileinfo.st_size > memory::bank_size)
+            die("%s does not fit in its bank", image.path);
+
+        /* Copy the buffer into physical memory, so images can be loaded
+           into banks which are not mapped yet. */
+        memory.write_phys(image.bank, image.offset, buf, fileinfo.st_size);
         free(buf);
     }
 }
+
+static void load_aot_image(const aot_program& program, memory& memory)
+{
+    for (size_t i = 0; i < program.n_segments; i++) {
+        const aot_segment& seg = program.segments[i];
+
+        /* A segment may span the whole address space, which does not fit in
+           a single 16-bit write. */
+        for (size_t off = 0; off < seg.size; off += IRID_PAGE_SIZE) {
+            memory.write_range(seg.offset + off, (void *) (seg.data + off),
+                               std::min(seg.size - off,
+                                        (size_t) IRID_PAGE_SIZE));
+        }
+    }
+}
@@ -3,67 +3,451 @@
 
 #include "emul.h"
 
+#include <algorithm>
 #include <cstring>
 #include <stdexcept>
 #include <sys/mman.h>
+#include <vector>
 
-memory::memory(size_t total_size, size_t __attribute__((unused)) page_size)
-    : m_totalsize(total_size)
+#define PAGE_ALL                                                               \
+    (IRID_PAGE_PRESENT | IRID_PAGE_READ | IRID_PAGE_WRITE | IRID_PAGE_EXEC)
+
+memory::memory(size_t size)
+    : m_n_frames(size / IRID_PAGE_SIZE)
+    , m_remapped(0)
 {
-    m_mem = (uint8_t *) mmap(NULL, m_totalsize, PROT_READ | PROT_WRITE,
-                             MAP_PRIVATE | MAP_ANON, -1, 0);
-    if (m_mem == MAP_FAILED)
+    if (!size || size % bank_size || m_n_frames > (size_t) UINT16_MAX + 1)
+        throw std::runtime_error("invalid physical memory size");
+
+    /* Anonymous mappings are zeroed lazily, so only touched banks take up
+       host memory. The code map is allocated the same way. */
+
+    m_phys = (u8 *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (m_phys == MAP_FAILED)
+        throw std::runtime_error("failed host mmap()");
+
+    m_code = (u8 *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (m_code == MAP_FAILED)
         throw std::runtime_error("failed host mmap()");
-    std::memset(m_mem, 0, m_totalsize);
+
+    m_code_frames = new bool[m_n_frames]();
+    std::memset(m_mmio, 0, sizeof(m_mmio));
+
+    for (u16 page = 0; page < IRID_MAX_PAGES; page++) {
+        m_pages[page] = {page, PAGE_ALL};
+        flush_tlb(page);
+    }
 }
 
 memory::~memory()
 {
-    munmap(m_mem, m_totalsize);
+    munmap(m_phys, m_n_frames * IRID_PAGE_SIZE);
+    munmap(m_code, m_n_frames * IRID_PAGE_SIZE);
+    delete[] m_code_frames;
 }
 
-u8 memory::read8(u16 addr)
+void memory::read_range(u16 src, void *dest, u16 n)
 {
-    checkaddr(addr);
-    return m_mem[addr];
+    size_t chunk;
+    size_t phys;
+
+    if ((size_t) src + n > IRID_MAX_ADDR + 1)
+        throw cpu_fault(CPUFAULT_SEG);
+
+    /* Each page may be mapped somewhere else. */
+
+    while (n) {
+        chunk = std::min<size_t>(n, IRID_PAGE_SIZE - (src & offset_mask));
+
+        if (m_mmio[src >> IRID_PAGE_SIZE_BITS]) {
+            for (size_t i = 0; i < chunk; i++)
+                ((u8 *) dest)[i] = read8_slow(src + i);
+        } else {
+            phys = translate(src, TLB_READ);
+            std::memcpy(dest, &m_phys[phys], chunk);
+        }
+
+        dest = (u8 *) dest + chunk;
+        src += chunk;
+        n -= chunk;
+    }
 }
 
-void memory::write8(u16 addr, u8 value)
+void memory::write_range(u16 dest, void *src, u16 n)
 {
-    checkaddr(addr);
-    m_mem[addr] = value;
+    size_t chunk;
+    size_t phys;
+
+    if ((size_t) dest + n > IRID_MAX_ADDR + 1)
+        throw cpu_fault(CPUFAULT_SEG);
+
+    while (n) {
+        chunk = std::min<size_t>(n, IRID_PAGE_SIZE - (dest & offset_mask));
+
+        if (m_mmio[dest >> IRID_PAGE_SIZE_BITS]) {
+            for (size_t i = 0; i < chunk; i++)
+                write8_slow(dest + i, ((u8 *) src)[i]);
+        } else {
+            phys = translate(dest, TLB_WRITE);
+            std::memcpy(&m_phys[phys], src, chunk);
+
+            for (size_t i = 0; i < chunk; i++) {
+                if (m_code[phys + i]) {
+                    notify_write(phys, chunk);
+                    break;
+                }
+            }
+        }
+
+        src = (u8 *) src + chunk;
+        dest += chunk;
+        n -= chunk;
+    }
 }
 
-u16 memory::read16(u16 addr)
+void memory::read_spans(u16 addr, u16 n,
+                        const std::function<void(const u8 *, size_t)>& fn)
 {
-    checkaddr(addr);
-    return m_mem[addr] | (m_mem[addr + 1] << 8);
+    size_t chunk;
+    size_t phys;
+
+    check_range(addr, n, TLB_READ);
+
+    while (n) {
+        chunk = std::min<size_t>(n, IRID_PAGE_SIZE - (addr & offset_mask));
+        phys = translate(addr, TLB_READ);
+        fn(&m_phys[phys], chunk);
+
+        addr += chunk;
+        n -= chunk;
+    }
 }
 
-void memory::write16(u16 addr, u16 value)
+size_t memory::write_spans(u16 addr, u16 n,
+                           const std::function<size_t(u8 *, size_t)>& fn)
 {
-    checkaddr(addr);
-    m_mem[addr] = value & 0xff;
-    m_mem[addr + 1] = (value & 0xff00) >> 8;
+    size_t written;
+    size_t total;
+    size_t chunk;
+    size_t phys;
+
+    check_range(addr, n, TLB_WRITE);
+
+    total = 0;
+    while (n) {
+        chunk = std::min<size_t>(n, IRID_PAGE_SIZE - (addr & offset_mask));
+        phys = translate(addr, TLB_WRITE);
+        written = fn(&m_phys[phys], chunk);
+
+        for (size_t i = 0; i < written; i++) {
+            if (m_code[phys + i]) {
+                notify_write(phys, written);
+                break;
+            }
+        }
+
+        total += written;
+        if (written < chunk)
+            break;
+
+        addr += chunk;
+        n -= chunk;
+    }
+
+    return total;
 }
 
-void memory::read_range(u16 src, void *dest, u16 n)
+void memory::dump(u16 addr, u16 n)
 {
-    std::memcpy(dest, &m_mem[src], n);
+    std::vector<u8> buf(n);
+
+    read_range(addr, buf.data(), n);
+    dbytes(buf.data(), n);
 }
 
-void memory::write_range(u16 dest, void *src, u16 n)
+void memory::watch_code(u16 addr)
 {
-    std::memcpy(&m_mem[dest], src, n);
+    const page_entry *entry;
+    size_t phys;
+
+    for (size_t i = addr; i < (size_t) addr + 4 && i <= IRID_MAX_ADDR; i++) {
+        entry = &m_pages[i >> IRID_PAGE_SIZE_BITS];
+        if (!(entry->flags & IRID_PAGE_PRESENT))
+            continue;
+
+        phys = (size_t) entry->frame * IRID_PAGE_SIZE + (i & offset_mask);
+        m_code[phys] = 1;
+
+        if (m_code_frames[entry->frame])
+            continue;
+
+        /* From now on, writes into this frame have to check the code map,
+           wherever it is mapped. */
+
+        m_code_frames[entry->frame] = true;
+        for (u16 page = 0; page < IRID_MAX_PAGES; page++) {
+            if (m_pages[page].frame == entry->frame)
+                m_tlb[TLB_WRITE][page] = nullptr;
+        }
+    }
 }
 
-void memory::dump(u16 addr, u16 n)
+void memory::map_page(u16 page, u16 frame, u8 flags)
+{
+    page_entry& entry = m_pages[page];
+
+    m_mmio[page] = nullptr;
+
+    if (entry.frame != page || entry.flags != PAGE_ALL)
+        m_remapped--;
+    if (frame != page || flags != PAGE_ALL)
+        m_remapped++;
+
+    entry = {frame, flags};
+    flush_tlb(page);
+
+    if (on_remap)
+        on_remap(page << IRID_PAGE_SIZE_BITS, IRID_PAGE_SIZE);
+}
+
+void memory::map_mmio(u16 page, const mmio_handler *handler)
+{
+    map_page(page, page, IRID_PAGE_PRESENT | IRID_PAGE_READ | IRID_PAGE_WRITE);
+    m_mmio[page] = handler;
+}
+
+void memory::page_info(u16 page, u16& frame, u8& flags)
+{
+    frame = m_pages[page].frame;
+    flags = m_pages[page].flags;
+}
+
+void memory::switch_bank(u16 page, u16 n, u16 bank)
+{
+    size_t base = (size_t) bank * IRID_MAX_PAGES;
+
+    for (u16 i = page; i < page + n; i++)
+        map_page(i, base + i, PAGE_ALL);
+}
+
+void memory::write_phys(u16 bank, u16 offset, const void *src, size_t n)
+{
+    size_t phys = (size_t) bank * bank_size + offset;
+    size_t chunk;
+
+    if (bank >= banks() || offset + n > bank_size)
+        throw cpu_fault(CPUFAULT_SEG);
+
+    std::memcpy(&m_phys[phys], src, n);
+
+    /* Aliases of each frame are found separately. */
+
+    for (size_t i = 0; i < n; i += chunk) {
+        chunk = std::min<size_t>(n - i,
+                                 IRID_PAGE_SIZE - ((phys + i) & offset_mask));
+        for (size_t j = i; j < i + chunk; j++) {
+            if (m_code[phys + j]) {
+                notify_write(phys + i, chunk);
+                break;
+            }
+        }
+    }
+}
+
+void memory::reset_pages()
+{
+    for (u16 page = 0; page < IRID_MAX_PAGES; page++) {
+        if (m_pages[page].frame != page || m_pages[page].flags != PAGE_ALL)
+            map_page(page, page, PAGE_ALL);
+    }
+}
+
+u8 *memory::host_base()
+{
+    return m_phys;
+}
+
+const u8 *memory::code_map()
+{
+    return m_code;
+}
+
+u8 memory::read8_slow(u16 addr)
+{
+    const mmio_handler *mmio = m_mmio[addr >> IRID_PAGE_SIZE_BITS];
+
+    if (mmio)
+        return mmio->read(mmio->ctx, addr & offset_mask);
+
+    return m_phys[translate(addr, TLB_READ)];
+}
+
+void memory::write8_slow(u16 addr, u8 value)
+{
+    const mmio_handler *mmio = m_mmio[addr >> IRID_PAGE_SIZE_BITS];
+    size_t phys;
+
+    if (mmio) {
+        mmio->write(mmio->ctx, addr & offset_mask, value);
+        return;
+    }
+
+    phys = translate(addr, TLB_WRITE);
+    m_phys[phys] = value;
+    if (m_code[phys])
+        notify_write(phys, 1);
+}
+
+u16 memory::read16_slow(u16 addr)
+{
+    if (addr == IRID_MAX_ADDR)
+        throw cpu_fault(CPUFAULT_SEG);
+
+    /* Registers are accessed a byte at a time, low byte first. */
+    if (m_mmio[addr >> IRID_PAGE_SIZE_BITS]
+        || m_mmio[(addr + 1) >> IRID_PAGE_SIZE_BITS])
+        return read8_slow(addr) | (read8_slow(addr + 1) << 8);
+
+    return m_phys[translate(addr, TLB_READ)]
+         | (m_phys[translate(addr + 1, TLB_READ)] << 8);
+}
+
+bool memory::peek16(u16 addr, u16& value)
+{
+    if (addr == IRID_MAX_ADDR || m_mmio[addr >> IRID_PAGE_SIZE_BITS]
+        || m_mmio[(addr + 1) >> IRID_PAGE_SIZE_BITS])
+        return false;
+
+    try {
+        value = m_phys[translate(addr, TLB_READ)]
+              | (m_phys[translate(addr + 1, TLB_READ)] << 8);
+    } catch (const cpu_fault&) {
+        return false;
+    }
+
+    return true;
+}
+
+void memory::write16_slow(u16 addr, u16 value)
+{
+    size_t lo;
+    size_t hi;
+
+    if (addr == IRID_MAX_ADDR)
+        throw cpu_fault(CPUFAULT_SEG);
+
+    if (m_mmio[addr >> IRID_PAGE_SIZE_BITS]
+        || m_mmio[(addr + 1) >> IRID_PAGE_SIZE_BITS]) {
+        write8_slow(addr, value & 0xff);
+        write8_slow(addr + 1, value >> 8);
+        return;
+    }
+
+    /* Both bytes are translated first, so a fault on the second page does
+       not leave a half-done write behind. */
+
+    lo = translate(addr, TLB_WRITE);
+    hi = translate(addr + 1, TLB_WRITE);
+    m_phys[lo] = value & 0xff;
+    m_phys[hi] = value >> 8;
+
+    if (hi == lo + 1) {
+        if (m_code[lo] || m_code[hi])
+            notify_write(lo, 2);
+        return;
+    }
+
+    if (m_code[lo])
+        notify_write(lo, 1);
+    if (m_code[hi])
+        notify_write(hi, 1);
+}
+
+uint32_t memory::fetch32_slow(u16 addr)
+{
+    uint32_t word;
+
+    if (addr > IRID_MAX_ADDR - 3)
+        throw cpu_fault(CPUFAULT_SEG);
+
+    word = 0;
+    for (int i = 0; i < 4; i++)
+        word |= (uint32_t) m_phys[translate(addr + i, TLB_EXEC)] << (i * 8);
+
+    return word;
+}
+
+/* Walk the page table, returning the physical address of `addr`. Throws a
+   page fault if the page does not allow the access, otherwise fills the TLB
+   entry. */
+size_t memory::translate(u16 addr, tlb_kind kind)
 {
-    dbytes(&m_mem[addr], n);
+    static const u8 required[TLB_KINDS] = {IRID_PAGE_READ, IRID_PAGE_WRITE,
+                                           IRID_PAGE_EXEC};
+    u16 page = addr >> IRID_PAGE_SIZE_BITS;
+    const page_entry& entry = m_pages[page];
+    size_t base;
+
+    if (!(entry.flags & IRID_PAGE_PRESENT) || !(entry.flags & required[kind]))
+        throw cpu_fault(CPUFAULT_PAGE);
+
+    /* MMIO has no memory behind it. */
+    if (m_mmio[page])
+        throw cpu_fault(CPUFAULT_IO);
+
+    base = (size_t) entry.frame * IRID_PAGE_SIZE;
+
+    /* Writes into a frame holding code always take the slow path, which
+       checks them against the code map. */
+    if (kind != TLB_WRITE || !m_code_frames[entry.frame])
+        m_tlb[kind][page] = &m_phys[base];
+
+    return base + (addr & offset_mask);
 }
 
-inline void memory::checkaddr(u16 addr)
+/* Fault if any part of the range does not allow the access, so it is not
+   left half-done. */
+void memory::check_range(u16 addr, u16 n, tlb_kind kind)
 {
-    if (addr >= m_totalsize)
+    if ((size_t) addr + n > IRID_MAX_ADDR + 1)
         throw cpu_fault(CPUFAULT_SEG);
+    if (!n)
+        return;
+
+    for (size_t page = addr >> IRID_PAGE_SIZE_BITS;
+         page <= (size_t) (addr + n - 1) >> IRID_PAGE_SIZE_BITS; page++)
+        translate(page << IRID_PAGE_SIZE_BITS, kind);
+}
+
+/* Report a write into watched code at each address its frame is mapped at,
+   and at its flat address in bank 0, where native code was translated. */
+void memory::notify_write(size_t phys, u16 n)
+{
+    size_t frame = phys / IRID_PAGE_SIZE;
+    u16 off = phys & offset_mask;
+    bool flat_reported = frame >= IRID_MAX_PAGES;
+
+    if (!on_code_write)
+        return;
+
+    for (u16 page = 0; page < IRID_MAX_PAGES; page++) {
+        if (m_pages[page].frame != frame
+            || !(m_pages[page].flags & IRID_PAGE_PRESENT))
+            continue;
+
+        on_code_write((page << IRID_PAGE_SIZE_BITS) | off, n);
+        if (page == frame)
+            flat_reported = true;
+    }
+
+    if (!flat_reported)
+        on_code_write(phys, n);
+}
+
+void memory::flush_tlb(u16 page)
+{
+    for (int kind = 0; kind < TLB_KINDS; kind++)
+        m_tlb[kind][page] = nullptr;
 }
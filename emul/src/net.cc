@@ -0,0 +1,165 @@
+/* Packet device over a Unix socket
+   Copyright (c) 2023-2024 bellrise */
+
+#include "emul.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Packets are at most this long, as their length is a u16. */
+#define NET_MAX_PACKET 0xffff
+
+struct net_state
+{
+    int fd;
+    bool stream;
+
+    /* The packet being taken out of the input after its length, which may
+       come in pieces on a stream socket, & how much of it is there. */
+    u8 packet[2 + NET_MAX_PACKET];
+    size_t have;
+};
+
+static bool net_poll(device&);
+static void net_close(device&);
+static bool net_send(device&, const iovec *, int);
+static const u8 *net_receive(device&, size_t&);
+
+/* Packets only go through the descriptor rings, never byte by byte. */
+static const device_ops net_ops = {
+    net_close, nullptr, nullptr, net_poll, nullptr,  nullptr,     nullptr,
+    nullptr,   nullptr, nullptr, nullptr,  net_send, net_receive, nullptr,
+    nullptr,
+};
+
+static inline net_state *state(device& self)
+{
+    return static_cast<net_state *>(self.state);
+}
+
+/* Connect to the socket, preferring a datagram one. It is bound to an
+   address picked by the kernel, so the other side can send packets back. */
+static int net_connect(const sockaddr_un& peer, bool& stream)
+{
+    struct sockaddr_un local = {};
+    int fd;
+
+    local.sun_family = AF_UNIX;
+    stream = false;
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    bind(fd, (struct sockaddr *) &local, sizeof(sa_family_t));
+    if (!connect(fd, (struct sockaddr *) &peer, sizeof(peer)))
+        return fd;
+
+    close(fd);
+    if (errno != EPROTOTYPE)
+        return -1;
+
+    stream = true;
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!connect(fd, (struct sockaddr *) &peer, sizeof(peer)))
+        return fd;
+
+    close(fd);
+    return -1;
+}
+
+device net_create(u16 id, const std::string& name, const std::string& file)
+{
+    struct sockaddr_un peer = {};
+    device net = {id, name};
+    net_state *state;
+
+    if (file.size() >= sizeof(peer.sun_path))
+        die("socket path is too long: %s", file.c_str());
+
+    peer.sun_family = AF_UNIX;
+    strcpy(peer.sun_path, file.c_str());
+
+    state = new net_state;
+    state->have = 0;
+    net.state = state;
+    net.ops = &net_ops;
+
+    state->fd = net_connect(peer, state->stream);
+    if (state->fd == -1) {
+        die("failed to connect net device %s @ %s: %s", name.c_str(),
+            file.c_str(), strerror(errno));
+    }
+
+    net.input = new device_input(state->fd);
+    net.input->packets = !state->stream;
+    if (state->stream)
+        net.output = new device_output(state->fd);
+
+    return net;
+}
+
+static bool net_poll(device& self)
+{
+    return state(self)->have || self.input->ready();
+}
+
+static bool net_send(device& self, const iovec *spans, int n)
+{
+    net_state *net = state(self);
+    struct msghdr msg = {};
+    size_t len;
+    u8 header[2];
+
+    len = 0;
+    for (int i = 0; i < n; i++)
+        len += spans[i].iov_len;
+
+    if (net->stream) {
+        header[0] = len & 0xff;
+        header[1] = len >> 8;
+        self.output->put(header, 2);
+        for (int i = 0; i < n; i++)
+            self.output->put((const u8 *) spans[i].iov_base, spans[i].iov_len);
+        return true;
+    }
+
+    msg.msg_iov = (iovec *) spans;
+    msg.msg_iovlen = n;
+    if (sendmsg(net->fd, &msg, MSG_DONTWAIT) != -1)
+        return true;
+
+    /* Keep the packet until the other side catches up. Any other error
+       means nobody is listening, so the packet is lost like on a wire. */
+    return errno != EAGAIN && errno != ENOBUFS;
+}
+
+static const u8 *net_receive(device& self, size_t& len)
+{
+    net_state *net = state(self);
+    size_t want;
+
+    if (net->have < 2)
+        net->have += self.input->read(net->packet + net->have, 2 - net->have);
+    if (net->have < 2)
+        return nullptr;
+
+    want = 2 + (net->packet[0] | (net->packet[1] << 8));
+    net->have += self.input->read(net->packet + net->have, want - net->have);
+    if (net->have < want)
+        return nullptr;
+
+    net->have = 0;
+    len = want - 2;
+    return net->packet + 2;
+}
+
+static void net_close(device& self)
+{
+    if (self.output)
+        self.output->flush();
+    close(state(self)->fd);
+    delete state(self);
+    delete self.input;
+    delete self.output;
+}
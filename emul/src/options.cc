@@ -8,21 +8,53 @@
 
 static void short_usage()
 {
-    puts("usage: irid-emul [-h] <image[:addr]> ...");
+    puts("usage: irid-emul [-h] <image[:[bank:]addr]> ...");
 }
 
 static void usage()
 {
     short_usage();
     puts("Emulate the Irid architecture. Loads the given images into memory\n"
-         "and starts execution from 0x0000.\n"
+         "and starts execution from 0x0000. An image may be loaded into\n"
+         "another bank of physical memory, which is not mapped on start.\n"
          "\n"
+         "  -c, --cycles NAME=N[,NAME=N...]\n"
+         "                      make each instruction called NAME take N clock\n"
+         "                      cycles instead of 1 (e.g. load=3,store=3)\n"
+         "  -d, --disk file=IMAGE[,name=NAME]\n"
+         "                      create a block device backed by the image\n"
+         "  -e, --sample-every N\n"
+         "                      profile every N clock cycles (10k by default)\n"
+         "  -g, --callgraph FILE\n"
+         "                      count the instructions run by each function &\n"
+         "                      call, written for callgrind tools, using the\n"
+         "                      interpreter\n"
          "  -h, --help          show the help page\n"
-         "  -i, --ips SPEED     target instructions per second (e.g. 1k)\n"
+         "  -H, --histogram     count each opcode & branch outcome for the\n"
+         "                      performance results, using the interpreter\n"
+         "  -i, --ips SPEED     target clock cycles per second (e.g. 1k), or\n"
+         "                      `max` to run as fast as possible\n"
+         "  -j, --jit           translate hot code into native code (x86-64)\n"
+         "  -F, --no-fusion     do not fuse common instruction sequences\n"
+         "  -m, --memory SIZE   physical memory size (e.g. 4M), split into\n"
+         "                      64K banks, 64K by default\n"
+         "  -n, --net socket=FILE[,name=NAME]\n"
+         "                      create a packet device on a Unix socket\n"
          "  -p, --perf          show performace results on exit (e.g. ips)\n"
+         "  -P, --perf-json FILE\n"
+         "                      write the performance results as JSON\n"
+         "  -r, --profile FILE  sample the stack of the program & write it as\n"
+         "                      folded stacks, as taken by flame graph tools\n"
          "  -s, --serial name=NAME,socket=FILE\n"
          "                      create a serial device\n"
-         "  -v, --version       show the emulator version\n");
+         "  -S, --skip-busy-wait\n"
+         "                      sleep while the program polls in a loop until\n"
+         "                      a device changes\n"
+         "  -T, --virtual-time  count guest time in clock cycles at the target\n"
+         "                      speed, running as fast as possible\n"
+         "  -v, --version       show the emulator version\n"
+         "  -y, --symbols FILE  name functions with a symbol map written by\n"
+         "                      irid-ld --map\n");
 }
 
 static int parse_int(const char *num)
@@ -45,10 +77,51 @@ static int parse_int(const char *num)
     return base * strtol(num, NULL, 10);
 }
 
+static int parse_ips(const char *str)
+{
+    int ips;
+
+    /* An unlimited speed is represented as 0 IPS. */
+    if (!strcmp(str, "max"))
+        return 0;
+
+    ips = parse_int(str);
+    if (ips <= 0)
+        die("invalid target IPS: %s", str);
+
+    return ips;
+}
+
+static size_t parse_memory_size(const char *str)
+{
+    size_t size;
+    char *end;
+
+    size = strtoul(str, &end, 10);
+    if (tolower(*end) == 'k')
+        size *= 1024;
+    else if (tolower(*end) == 'm')
+        size *= 1024 * 1024;
+    else if (*end)
+        die("invalid memory size: %s", str);
+
+    /* Round up to whole banks. Frame numbers are 16-bit, which limits the
+       memory to 64M. */
+    size = (size + memory::bank_size - 1) / memory::bank_size
+         * memory::bank_size;
+    if (!size || size > (size_t) 64 * 1024 * 1024)
+        die("invalid memory size: %s", str);
+
+    return size;
+}
+
 static image_argument parse_image_argument(const char *str)
 {
     image_argument image;
     const char *middle;
+    const char *second;
+
+    image.bank = 0;
 
     middle = strchr(str, ':');
     if (!middle) {
@@ -57,18 +130,27 @@ static image_argument parse_image_argument(const char *str)
         return image;
     }
 
-    /* Split the image name and offset. */
+    /* Split the image name, bank and offset. */
 
     image.path[middle - str] = 0;
     strncpy(image.path, str, middle - str);
+
+    second = strchr(middle + 1, ':');
+    if (second) {
+        image.bank = strtol(middle + 1, NULL, 16);
+        middle = second;
+    }
+
     image.offset = strtol(middle + 1, NULL, 16);
 
     return image;
 }
 
-static serial_argument parse_serial_argument(char *str)
+/* Parse a name=NAME,file=FILE parameter string, where socket=FILE may be
+   used instead of file. */
+static void parse_device_argument(char *str, std::string& name,
+                                  std::string& file)
 {
-    serial_argument serial;
     char *p;
     char *q;
 
@@ -84,37 +166,159 @@ static serial_argument parse_serial_argument(char *str)
         q++;
 
         if (!strncmp("name", str, q - str - 1))
-            serial.name = std::string(q).substr(0, p - q);
-        if (!strncmp("file", str, q - str - 1))
-            serial.file = std::string(q).substr(0, p - q);
+            name = std::string(q).substr(0, p - q);
+        if (!strncmp("file", str, q - str - 1)
+            || !strncmp("socket", str, q - str - 1))
+            file = std::string(q).substr(0, p - q);
 
         if (!p[0])
             break;
         str = p + 1;
     }
+}
+
+/* Instructions by their name in the assembler, with all of their opcodes. */
+static const struct
+{
+    const char *name;
+    u8 ops[3];
+    int n;
+} cycle_names[] = {
+    {"nop", {I_NOP}, 1},
+    {"cpucall", {I_CPUCALL}, 1},
+    {"rti", {I_RTI}, 1},
+    {"sti", {I_STI}, 1},
+    {"dsi", {I_DSI}, 1},
+    {"wfi", {I_WFI}, 1},
+    {"push", {I_PUSH, I_PUSH8, I_PUSH16}, 3},
+    {"pop", {I_POP}, 1},
+    {"mov", {I_MOV, I_MOV8, I_MOV16}, 3},
+    {"load", {I_LOAD, I_LOAD16}, 2},
+    {"store", {I_STORE, I_STORE16}, 2},
+    {"null", {I_NULL}, 1},
+    {"cmp", {I_CMP, I_CMP8, I_CMP16}, 3},
+    {"cmg", {I_CMG, I_CMG8, I_CMG16}, 3},
+    {"cml", {I_CML, I_CML8, I_CML16}, 3},
+    {"cfs", {I_CFS}, 1},
+    {"jmp", {I_JMP}, 1},
+    {"jnz", {I_JNZ}, 1},
+    {"jeq", {I_JEQ}, 1},
+    {"call", {I_CALL, I_CALLR}, 2},
+    {"ret", {I_RET}, 1},
+    {"add", {I_ADD, I_ADD8, I_ADD16}, 3},
+    {"sub", {I_SUB, I_SUB8, I_SUB16}, 3},
+    {"and", {I_AND, I_AND8, I_AND16}, 3},
+    {"or", {I_OR, I_OR8, I_OR16}, 3},
+    {"not", {I_NOT}, 1},
+    {"shr", {I_SHR, I_SHR8}, 2},
+    {"shl", {I_SHL, I_SHL8}, 2},
+    {"mul", {I_MUL, I_MUL8, I_MUL16}, 3},
+};
+
+static void parse_cycle_costs(char *str, cycle_costs& costs)
+{
+    char *value;
+    char *p;
+    size_t i;
+    int n;
+
+    while (1) {
+        p = strchr(str, ',');
+        if (p)
+            *p = 0;
+
+        value = strchr(str, '=');
+        if (!value)
+            die("malformed cycle cost: %s", str);
+        *value++ = 0;
+
+        n = parse_int(value);
+        if (n < 1 || n > 0xff)
+            die("invalid cycle cost for %s: %s", str, value);
+
+        for (i = 0; i < sizeof(cycle_names) / sizeof(*cycle_names); i++) {
+            if (!strcmp(cycle_names[i].name, str))
+                break;
+        }
+        if (i == sizeof(cycle_names) / sizeof(*cycle_names))
+            die("unknown instruction: %s", str);
+
+        for (int j = 0; j < cycle_names[i].n; j++)
+            costs.of[cycle_names[i].ops[j]] = n;
+
+        if (!p)
+            break;
+        str = p + 1;
+    }
+}
+
+static serial_argument parse_serial_argument(char *str)
+{
+    serial_argument serial;
 
+    parse_device_argument(str, serial.name, serial.file);
     return serial;
 }
 
+static disk_argument parse_disk_argument(char *str)
+{
+    disk_argument disk;
+
+    disk.name = "disk";
+    parse_device_argument(str, disk.name, disk.file);
+    if (disk.file.empty())
+        die("missing disk image: %s", str);
+
+    return disk;
+}
+
+static net_argument parse_net_argument(char *str)
+{
+    net_argument net;
+
+    net.name = "net";
+    parse_device_argument(str, net.name, net.file);
+    if (net.file.empty())
+        die("missing net socket: %s", str);
+
+    return net;
+}
+
 void parse_args(struct settings& settings, int argc, char **argv)
 {
     int opt_index;
     int c;
 
     static struct option long_opts[] = {
+        {"cycles", required_argument, 0, 'c'},
+        {"disk", required_argument, 0, 'd'},
+        {"callgraph", required_argument, 0, 'g'},
         {"help", no_argument, 0, 'h'},    {"ips", required_argument, 0, 'i'},
-        {"perf", no_argument, 0, 'p'},    {"serial", required_argument, 0, 's'},
+        {"histogram", no_argument, 0, 'H'},
+        {"jit", no_argument, 0, 'j'},     {"perf", no_argument, 0, 'p'},
+        {"perf-json", required_argument, 0, 'P'},
+        {"profile", required_argument, 0, 'r'},
+        {"sample-every", required_argument, 0, 'e'},
+        {"symbols", required_argument, 0, 'y'},
+        {"no-fusion", no_argument, 0, 'F'},
+        {"memory", required_argument, 0, 'm'},
+        {"net", required_argument, 0, 'n'},
+        {"serial", required_argument, 0, 's'},
+        {"skip-busy-wait", no_argument, 0, 'S'},
+        {"virtual-time", no_argument, 0, 'T'},
         {"version", no_argument, 0, 'v'}, {0, 0, 0, 0}};
 
     opt_index = 0;
 
-    if (argc == 1) {
+    /* AOT programs run their embedded image without any arguments. */
+    if (argc == 1 && !aot_builtin) {
         short_usage();
         exit(0);
     }
 
     while (1) {
-        c = getopt_long(argc, argv, "hi:ps:v", long_opts, &opt_index);
+        c = getopt_long(argc, argv, "Fc:d:e:g:hHi:jm:n:pP:r:s:STvy:", long_opts,
+                        &opt_index);
         if (c == -1)
             break;
 
@@ -125,14 +329,58 @@ void parse_args(struct settings& settings, int argc, char **argv)
         case 'v':
             printf("irid-emul %s\n", IRID_EMUL_VERSION);
             exit(0);
+        case 'j':
+            settings.jit = true;
+            break;
+        case 'F':
+            settings.no_fusion = true;
+            break;
+        case 'm':
+            settings.memory_size = parse_memory_size(optarg);
+            break;
+        case 'n':
+            settings.nets.push_back(parse_net_argument(optarg));
+            break;
         case 'p':
             settings.show_perf_results = true;
             break;
+        case 'P':
+            settings.perf_json = optarg;
+            break;
+        case 'H':
+            settings.histogram = true;
+            break;
+        case 'g':
+            settings.callgraph = optarg;
+            break;
+        case 'r':
+            settings.profile = optarg;
+            break;
+        case 'e':
+            if (parse_int(optarg) <= 0)
+                die("invalid sample interval: %s", optarg);
+            settings.sample_every = parse_int(optarg);
+            break;
+        case 'y':
+            settings.symbol_maps.push_back(optarg);
+            break;
+        case 'c':
+            parse_cycle_costs(optarg, settings.cycles);
+            break;
+        case 'd':
+            settings.disks.push_back(parse_disk_argument(optarg));
+            break;
         case 's':
             settings.serials.push_back(parse_serial_argument(optarg));
             break;
         case 'i':
-            settings.target_ips = parse_int(optarg);
+            settings.target_ips = parse_ips(optarg);
+            break;
+        case 'S':
+            settings.spin_detection = true;
+            break;
+        case 'T':
+            settings.virtual_time = true;
             break;
         }
     }
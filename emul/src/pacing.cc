@@ -0,0 +1,91 @@
+/* Pacing
+   Copyright (c) 2023-2024 bellrise */
+
+#include "emul.h"
+
+#include <errno.h>
+#include <time.h>
+
+/* How often the wall clock is checked, in nanoseconds of guest time. */
+#define PACE_QUANTUM_NS 1000000
+
+/* If the CPU falls behind by more than this, give up on catching up. */
+#define PACE_MAX_LAG_NS 100000000
+
+long long now_ns()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+pacer::pacer()
+    : m_target_ips(0)
+    , m_quantum(0)
+    , m_epoch_ns(0)
+    , m_epoch_instructions(0)
+{ }
+
+void pacer::set_target_ips(int target_ips)
+{
+    if (target_ips < 0)
+        target_ips = 0;
+
+    m_target_ips = target_ips;
+    m_quantum = (size_t) target_ips * PACE_QUANTUM_NS / 1000000000;
+    if (!m_quantum)
+        m_quantum = 1;
+}
+
+int pacer::target_ips() const
+{
+    return m_target_ips;
+}
+
+size_t pacer::start(size_t instructions)
+{
+    m_epoch_ns = now_ns();
+    m_epoch_instructions = instructions;
+
+    return next(instructions);
+}
+
+size_t pacer::pace(size_t instructions)
+{
+    struct timespec sleep_time;
+    long long expected;
+    long long elapsed;
+
+    if (!m_target_ips)
+        return next(instructions);
+
+    /* Compare how long the executed instructions should have taken with how
+       long they actually took, and sleep off the difference in one go. */
+
+    elapsed = now_ns() - m_epoch_ns;
+    expected = (double) (instructions - m_epoch_instructions) * 1000000000
+             / m_target_ips;
+
+    if (expected > elapsed) {
+        sleep_time.tv_sec = (expected - elapsed) / 1000000000;
+        sleep_time.tv_nsec = (expected - elapsed) % 1000000000;
+        if (nanosleep(&sleep_time, NULL) == -1 && errno != EINTR)
+            die("something interrupted the clock cycle (%d)", errno);
+    } else if (elapsed - expected > PACE_MAX_LAG_NS) {
+        /* The host cannot keep up, so start counting from here instead of
+           bursting through a backlog of instructions. */
+        m_epoch_ns = now_ns();
+        m_epoch_instructions = instructions;
+    }
+
+    return next(instructions);
+}
+
+size_t pacer::next(size_t instructions)
+{
+    /* In unlimited mode, the clock is never checked. */
+    if (!m_target_ips)
+        return SIZE_MAX;
+    return instructions + m_quantum;
+}
@@ -0,0 +1,171 @@
+/* Sampling profiler
+   Copyright (c) 2023-2024 bellrise */
+
+#include "emul.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Deepest stack taken for a sample, in functions. */
+#define PROFILE_MAX_DEPTH 64
+
+/* Offsets from bp of the caller's bp & the return address, in the frame lc
+   sets up: bp & r4-r7 are pushed after the call, & bp points at the last
+   one. */
+#define FRAME_SAVED_BP 8
+#define FRAME_RETURN   10
+
+void symbol_table::load(const std::string& path)
+{
+    char name[256];
+    unsigned addr;
+    FILE *in;
+
+    in = fopen(path.c_str(), "r");
+    if (!in)
+        die("failed to open %s: %s", path.c_str(), strerror(errno));
+
+    while (fscanf(in, "%x %255s", &addr, name) == 2) {
+        if (addr > IRID_MAX_ADDR)
+            die("invalid symbol address in %s: %x", path.c_str(), addr);
+        m_symbols.push_back({(u16) addr, name});
+    }
+
+    if (!feof(in))
+        die("invalid symbol map: %s", path.c_str());
+    fclose(in);
+
+    std::stable_sort(m_symbols.begin(), m_symbols.end(),
+                     [](const symbol& a, const symbol& b) {
+        return a.addr < b.addr;
+    });
+}
+
+const symbol_table::symbol *symbol_table::find(u16 addr) const
+{
+    auto it = std::upper_bound(
+        m_symbols.begin(), m_symbols.end(), addr,
+        [](u16 addr, const symbol& sym) { return addr < sym.addr; });
+
+    if (it == m_symbols.begin())
+        return nullptr;
+    return &*--it;
+}
+
+u16 symbol_table::function(u16 addr) const
+{
+    const symbol *sym;
+
+    sym = find(addr);
+    return sym ? sym->addr : addr;
+}
+
+std::string symbol_table::name(u16 addr) const
+{
+    const symbol *sym;
+    char buf[8];
+
+    sym = find(addr);
+    if (sym && sym->addr == addr)
+        return sym->name;
+
+    snprintf(buf, sizeof(buf), "0x%04x", addr);
+    return buf;
+}
+
+void cpu::load_symbols(const std::string& path)
+{
+    m_symbols.load(path);
+}
+
+void cpu::enable_profile(size_t interval)
+{
+    m_profile = true;
+    m_sample_interval = interval;
+    m_sample_next = m_cycles + interval;
+}
+
+/* Take the stack of functions the program is in. Only code which sets up the
+   frame like lc does can be walked through, the caller of any other function
+   is missing from its stack. */
+void cpu::sample()
+{
+    std::vector<u16> stack;
+
+    m_sample_next = m_cycles + m_sample_interval;
+
+    /* A handler runs on the stack of the code it interrupted, below the sp
+       it had. That code is then walked from its own registers. */
+    if (m_in_interrupt) {
+        walk_stack(stack, m_reg.ip, m_reg.bp, m_reg_cache.sp);
+        walk_stack(stack, m_reg_cache.ip, m_reg_cache.bp, IRID_MAX_ADDR + 1);
+    } else {
+        walk_stack(stack, m_reg.ip, m_reg.bp, IRID_MAX_ADDR + 1);
+    }
+
+    std::reverse(stack.begin(), stack.end());
+    m_samples[stack]++;
+}
+
+/* Add the function at `ip` & its callers to the stack, innermost first,
+   following the frames as long as bp is below `limit`. */
+void cpu::walk_stack(std::vector<u16>& stack, u16 ip, u16 bp, size_t limit)
+{
+    u16 caller_bp;
+    u16 ret;
+
+    while (1) {
+        stack.push_back(m_symbols.function(ip));
+
+        /* A bp of 0 is left by the reset, before there is any frame. */
+        if (!bp || bp >= limit || bp > IRID_MAX_ADDR - FRAME_RETURN - 1
+            || stack.size() >= PROFILE_MAX_DEPTH)
+            break;
+
+        if (!m_mem.peek16(bp + FRAME_SAVED_BP, caller_bp)
+            || !m_mem.peek16(bp + FRAME_RETURN, ret))
+            break;
+
+        /* Older frames are always higher up, & a return address is always
+           after a call. */
+        if (caller_bp <= bp || ret < 4)
+            break;
+
+        ip = ret - 4;
+        bp = caller_bp;
+    }
+}
+
+/* Write the samples as folded stacks, one line for each stack with its
+   functions outermost first & the number of samples, which flame graph
+   tools take as they are. */
+void cpu::write_profile(const std::string& path)
+{
+    std::map<std::string, size_t> folded;
+    std::string line;
+    FILE *out;
+
+    for (const auto& stack : m_samples) {
+        line.clear();
+        for (u16 addr : stack.first) {
+            if (!line.empty())
+                line += ';';
+            line += m_symbols.name(addr);
+        }
+        folded[line] += stack.second;
+    }
+
+    out = fopen(path.c_str(), "w");
+    if (!out) {
+        warn("failed to open %s: %s", path.c_str(), strerror(errno));
+        return;
+    }
+
+    for (const auto& stack : folded)
+        fprintf(out, "%s %zu\n", stack.first.c_str(), stack.second);
+
+    if (fclose(out))
+        warn("failed to write %s: %s", path.c_str(), strerror(errno));
+}
@@ -5,8 +5,6 @@
 
 #include <ctype.h>
 #include <fcntl.h>
-#include <poll.h>
-#include <queue>
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <termios.h>
@@ -20,6 +18,17 @@ struct serial_state
 static u8 serial_read(device&);
 static void serial_write(device&, u8);
 static bool serial_poll(device&);
+static void serial_close(device&);
+static void serial_write_range(device&, const u8 *, size_t);
+static size_t serial_read_range(device&, u8 *, size_t);
+
+static const device_ops serial_ops = {
+    serial_close, serial_write,       serial_read,
+    serial_poll,  serial_write_range, serial_read_range,
+    nullptr,      nullptr,            nullptr,
+    nullptr,      nullptr,            nullptr,
+    nullptr,      nullptr,            nullptr,
+};
 
 static inline serial_state *state(device& self)
 {
@@ -38,10 +47,9 @@ device serial_create(u16 id, const std::string& name, const std::string& file)
     if (state->fd == -1)
         die("failed to open serial device %s @ %s", name.c_str(), file.c_str());
 
-    serial.read = serial_read;
-    serial.write = serial_write;
-    serial.poll = serial_poll;
-    serial.close = nullptr;
+    serial.input = new device_input(state->fd);
+    serial.output = new device_output(state->fd);
+    serial.ops = &serial_ops;
 
     return serial;
 }
@@ -50,11 +58,10 @@ static u8 serial_read(device& self)
 {
     u8 c;
 
-    /* Make this non-blocking by returning a NUL if stdin is empty. */
-    if (!serial_poll(self))
-        return 0;
+    self.output->flush();
 
-    if (read(state(self)->fd, &c, 1) <= 0)
+    /* Make this non-blocking by returning a NUL if no input is queued. */
+    if (!self.input->read(c))
         return 0;
 
     return c;
@@ -62,17 +69,31 @@ static u8 serial_read(device& self)
 
 static void serial_write(device& self, u8 byte)
 {
-    write(state(self)->fd, &byte, 1);
+    self.output->put(byte);
 }
 
-static bool serial_poll(device& self)
+static void serial_write_range(device& self, const u8 *buf, size_t n)
 {
-    struct pollfd poll_rq;
-    poll_rq.fd = state(self)->fd;
-    poll_rq.events = POLLIN;
+    self.output->put(buf, n);
+}
 
-    if (poll(&poll_rq, 1, 0) == -1)
-        return false;
+static size_t serial_read_range(device& self, u8 *buf, size_t n)
+{
+    self.output->flush();
+    return self.input->read(buf, n);
+}
 
-    return poll_rq.revents & POLLIN;
+static bool serial_poll(device& self)
+{
+    self.output->flush();
+    return self.input->ready();
+}
+
+static void serial_close(device& self)
+{
+    self.output->flush();
+    close(state(self)->fd);
+    delete state(self);
+    delete self.input;
+    delete self.output;
 }
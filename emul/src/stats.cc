@@ -0,0 +1,446 @@
+/* Execution statistics
+   Copyright (c) 2023-2024 bellrise */
+
+#include "emul.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *fusion_names[FUSE_COUNT] = {
+    "cmp+jeq",       "cfs+jeq",   "mov+sub", "mov+sub+load",
+    "mov+sub+store", "push+push", "pop+pop", "add+jmp"};
+
+static const char *opcode_name(int op)
+{
+    switch (op) {
+    case I_NOP:
+        return "nop";
+    case I_CPUCALL:
+        return "cpucall";
+    case I_RTI:
+        return "rti";
+    case I_STI:
+        return "sti";
+    case I_DSI:
+        return "dsi";
+    case I_WFI:
+        return "wfi";
+    case I_PUSH:
+        return "push";
+    case I_PUSH8:
+        return "push8";
+    case I_PUSH16:
+        return "push16";
+    case I_POP:
+        return "pop";
+    case I_MOV:
+        return "mov";
+    case I_MOV8:
+        return "mov8";
+    case I_MOV16:
+        return "mov16";
+    case I_LOAD:
+        return "load";
+    case I_STORE:
+        return "store";
+    case I_NULL:
+        return "null";
+    case I_CMP:
+        return "cmp";
+    case I_CMP8:
+        return "cmp8";
+    case I_CMP16:
+        return "cmp16";
+    case I_CMG:
+        return "cmg";
+    case I_CMG8:
+        return "cmg8";
+    case I_CMG16:
+        return "cmg16";
+    case I_CML:
+        return "cml";
+    case I_CML8:
+        return "cml8";
+    case I_CML16:
+        return "cml16";
+    case I_LOAD16:
+        return "load16";
+    case I_STORE16:
+        return "store16";
+    case I_CFS:
+        return "cfs";
+    case I_JMP:
+        return "jmp";
+    case I_JNZ:
+        return "jnz";
+    case I_JEQ:
+        return "jeq";
+    case I_CALL:
+        return "call";
+    case I_CALLR:
+        return "callr";
+    case I_RET:
+        return "ret";
+    case I_ADD:
+        return "add";
+    case I_ADD8:
+        return "add8";
+    case I_ADD16:
+        return "add16";
+    case I_SUB:
+        return "sub";
+    case I_SUB8:
+        return "sub8";
+    case I_SUB16:
+        return "sub16";
+    case I_AND:
+        return "and";
+    case I_AND8:
+        return "and8";
+    case I_AND16:
+        return "and16";
+    case I_OR:
+        return "or";
+    case I_OR8:
+        return "or8";
+    case I_OR16:
+        return "or16";
+    case I_NOT:
+        return "not";
+    case I_SHR:
+        return "shr";
+    case I_SHR8:
+        return "shr8";
+    case I_SHL:
+        return "shl";
+    case I_SHL8:
+        return "shl8";
+    case I_MUL:
+        return "mul";
+    case I_MUL8:
+        return "mul8";
+    case I_MUL16:
+        return "mul16";
+    default:
+        return nullptr;
+    }
+}
+
+static const char *cpucall_name(int fn)
+{
+    switch (fn) {
+    case CPUCALL_POWEROFF:
+        return "poweroff";
+    case CPUCALL_RESTART:
+        return "restart";
+    case CPUCALL_FAULT:
+        return "fault";
+    case CPUCALL_DEVICELIST:
+        return "devicelist";
+    case CPUCALL_DEVICEINFO:
+        return "deviceinfo";
+    case CPUCALL_DEVICEINTR:
+        return "deviceintr";
+    case CPUCALL_DEVICEMAP:
+        return "devicemap";
+    case CPUCALL_CLOCK:
+        return "clock";
+    case CPUCALL_IRQPRIORITY:
+        return "irqpriority";
+    case CPUCALL_IRQMASK:
+        return "irqmask";
+    case CPUCALL_PERFREAD:
+        return "perfread";
+    case CPUCALL_PERFSNAPSHOT:
+        return "perfsnapshot";
+    case CPUCALL_PERFRESET:
+        return "perfreset";
+    case CPUCALL_DEVICEWRITE:
+        return "devicewrite";
+    case CPUCALL_DEVICEREAD:
+        return "deviceread";
+    case CPUCALL_DEVICEPOLL:
+        return "devicepoll";
+    case CPUCALL_DEVICEWRITEN:
+        return "devicewriten";
+    case CPUCALL_DEVICEREADN:
+        return "devicereadn";
+    case CPUCALL_SECTORREAD:
+        return "sectorread";
+    case CPUCALL_SECTORWRITE:
+        return "sectorwrite";
+    case CPUCALL_SECTORCOUNT:
+        return "sectorcount";
+    case CPUCALL_DEVICERING:
+        return "devicering";
+    case CPUCALL_DEVICENOTIFY:
+        return "devicenotify";
+    case CPUCALL_TIMERSET:
+        return "timerset";
+    case CPUCALL_PAGEMAP:
+        return "pagemap";
+    case CPUCALL_PAGEINFO:
+        return "pageinfo";
+    case CPUCALL_BANKSWITCH:
+        return "bankswitch";
+    case CPUCALL_MEMINFO:
+        return "meminfo";
+    default:
+        return nullptr;
+    }
+}
+
+/* Name of an opcode or cpucall, or its number if it has none. */
+static const char *name_of(const char *name, int n)
+{
+    static char buf[8];
+
+    if (name)
+        return name;
+
+    snprintf(buf, sizeof(buf), "0x%02x", n);
+    return buf;
+}
+
+/* Indices of the non-zero counters, the highest first. */
+static std::vector<int> by_count(const size_t *counts, int n)
+{
+    std::vector<int> order;
+
+    for (int i = 0; i < n; i++) {
+        if (counts[i])
+            order.push_back(i);
+    }
+
+    std::stable_sort(order.begin(), order.end(),
+                     [counts](int a, int b) { return counts[a] > counts[b]; });
+    return order;
+}
+
+void cpu::print_perf()
+{
+    size_t instructions;
+    double elapsed;
+    double avg_ips;
+    double avg_cycle;
+    char prefix = ' ';
+
+    instructions = m_cycles - m_extra_cycles;
+
+    /* Short runs still get a rate, so the time is not rounded to seconds. */
+    elapsed = std::max<uint64_t>(m_elapsed_ns, 1) / 1e9;
+    avg_ips = instructions / elapsed;
+
+    if (avg_ips > 1000000) {
+        prefix = 'M';
+        avg_ips /= 1000000;
+    } else if (avg_ips > 1000) {
+        prefix = 'k';
+        avg_ips /= 1000;
+    }
+
+    avg_cycle = instructions ? elapsed / instructions * 1000000 : 0;
+
+    puts("\nCPU performance results:\n");
+    printf("  elapsed time          %.6lf s\n", elapsed);
+    printf("  total instructions    %zu\n", instructions);
+    printf("  average IPS           %.2lf %.1sHz\n", avg_ips,
+           prefix == ' ' ? "" : &prefix);
+    printf("  average cycle time    %.4lf us\n", avg_cycle);
+    if (m_pacer.target_ips())
+        printf("  target IPS            %d Hz\n", m_pacer.target_ips());
+    else
+        printf("  target IPS            max\n");
+    if (m_virtual_time)
+        printf("  virtual clock         %d Hz\n", m_clock_hz);
+    if (!m_cycle_costs.uniform())
+        printf("  total cycles          %zu\n", m_cycles);
+    if (m_irq_count) {
+        printf("  interrupts            %zu (%zu chained on rti)\n",
+               m_irq_count, m_irq_chained);
+        printf("  interrupt latency     %.2lf us avg, %.2lf us max\n",
+               m_stats.irq_latency_ns / 1e3 / m_irq_count,
+               m_stats.irq_latency_max_ns / 1e3);
+    }
+    if (m_spin_parks) {
+        printf("  busy-wait skipped     %" PRIu64 " instructions (%zu parks)\n",
+               m_spin_skipped, m_spin_parks);
+    }
+    if (m_idle_cycles) {
+        printf("  idle cycles           %" PRIu64 " (%zu waits)\n",
+               m_idle_cycles, m_idle_waits);
+    } else if (m_idle_waits) {
+        printf("  idle time             %.2lf s (%zu waits)\n",
+               m_idle_ns / 1e9, m_idle_waits);
+    }
+
+    /* How many times each superinstruction ran. */
+    if (std::any_of(m_fused, m_fused + FUSE_COUNT, [](size_t n) { return n; })) {
+        puts("\n  fused instructions:");
+        for (int i = 0; i < FUSE_COUNT; i++) {
+            if (m_fused[i])
+                printf("    %-18s  %zu\n", fusion_names[i], m_fused[i]);
+        }
+    }
+
+    if (m_histogram) {
+        puts("\n  opcodes:");
+        for (int op : by_count(m_stats.opcodes, 256)) {
+            printf("    %-18s  %-12zu  %5.2lf%%\n",
+                   name_of(opcode_name(op), op), m_stats.opcodes[op],
+                   100.0 * m_stats.opcodes[op] / instructions);
+        }
+
+        puts("\n  branches:");
+        printf("    jeq                 %zu taken, %zu not taken\n",
+               m_stats.jeq_taken, m_stats.jeq_not_taken);
+        printf("    jnz                 %zu taken, %zu not taken\n",
+               m_stats.jnz_taken, m_stats.jnz_not_taken);
+    }
+
+    if (std::any_of(m_stats.cpucalls, m_stats.cpucalls + 256,
+                    [](size_t n) { return n; })) {
+        puts("\n  cpu calls:");
+        for (int fn : by_count(m_stats.cpucalls, 256)) {
+            printf("    %-18s  %zu\n", name_of(cpucall_name(fn), fn),
+                   m_stats.cpucalls[fn]);
+        }
+    }
+
+    if (std::any_of(m_devices.begin(), m_devices.end(), [](const device& dev) {
+            return dev.bytes_in || dev.bytes_out;
+        })) {
+        puts("\n  device bytes:");
+        for (const device& dev : m_devices) {
+            if (dev.bytes_in || dev.bytes_out) {
+                printf("    %-10s %04x     %zu in, %zu out\n", dev.name.c_str(),
+                       dev.id, dev.bytes_in, dev.bytes_out);
+            }
+        }
+    }
+
+    fputc('\n', stdout);
+}
+
+/* Write a JSON string, escaping what has to be. */
+static void json_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fprintf(out, "\\%c", *str);
+        else if ((u8) *str < 0x20)
+            fprintf(out, "\\u%04x", *str);
+        else
+            fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+/* Write the counters which are not zero as a JSON object, keyed by name. */
+static void json_counts(FILE *out, const size_t *counts, int n,
+                        const char *(*name)(int))
+{
+    bool first = true;
+
+    fputc('{', out);
+    for (int i = 0; i < n; i++) {
+        if (!counts[i])
+            continue;
+
+        fputs(first ? "\n    " : ",\n    ", out);
+        json_string(out, name_of(name(i), i));
+        fprintf(out, ": %zu", counts[i]);
+        first = false;
+    }
+    fputs(first ? "}" : "\n  }", out);
+}
+
+/* The same results as print_perf(), as a single JSON object. Times are in
+   nanoseconds, & the opcodes & branches are null without --histogram. */
+void cpu::write_perf_json(const std::string& path)
+{
+    size_t instructions;
+    FILE *out;
+
+    out = fopen(path.c_str(), "w");
+    if (!out) {
+        warn("failed to open %s: %s", path.c_str(), strerror(errno));
+        return;
+    }
+
+    instructions = m_cycles - m_extra_cycles;
+
+    fputs("{\n", out);
+    fprintf(out, "  \"version\": \"%s\",\n", IRID_EMUL_VERSION);
+    fprintf(out, "  \"elapsed_ns\": %" PRIu64 ",\n", m_elapsed_ns);
+    fprintf(out, "  \"instructions\": %zu,\n", instructions);
+    fprintf(out, "  \"cycles\": %zu,\n", m_cycles);
+    fprintf(out, "  \"ips\": %.2lf,\n",
+            instructions / (std::max<uint64_t>(m_elapsed_ns, 1) / 1e9));
+    fprintf(out, "  \"target_ips\": %d,\n", m_pacer.target_ips());
+    fprintf(out, "  \"virtual_clock_hz\": %d,\n",
+            m_virtual_time ? m_clock_hz : 0);
+
+    fprintf(out,
+            "  \"interrupts\": {\"count\": %zu, \"chained\": %zu, "
+            "\"latency_avg_ns\": %" PRIu64 ", \"latency_max_ns\": %" PRIu64
+            "},\n",
+            m_irq_count, m_irq_chained,
+            m_irq_count ? m_stats.irq_latency_ns / m_irq_count : 0,
+            m_stats.irq_latency_max_ns);
+    fprintf(out,
+            "  \"idle\": {\"waits\": %zu, \"ns\": %" PRIu64
+            ", \"cycles\": %" PRIu64 "},\n",
+            m_idle_waits, m_idle_ns, m_idle_cycles);
+    fprintf(out,
+            "  \"busy_wait\": {\"parks\": %zu, \"skipped\": %" PRIu64 "},\n",
+            m_spin_parks, m_spin_skipped);
+
+    fputs("  \"fused\": {", out);
+    for (int i = 0; i < FUSE_COUNT; i++) {
+        fprintf(out, "%s\"%s\": %zu", i ? ", " : "", fusion_names[i],
+                m_fused[i]);
+    }
+    fputs("},\n", out);
+
+    fputs("  \"opcodes\": ", out);
+    if (m_histogram)
+        json_counts(out, m_stats.opcodes, 256, opcode_name);
+    else
+        fputs("null", out);
+    fputs(",\n", out);
+
+    if (m_histogram) {
+        fprintf(out,
+                "  \"branches\": {\"jeq\": {\"taken\": %zu, \"not_taken\": "
+                "%zu}, \"jnz\": {\"taken\": %zu, \"not_taken\": %zu}},\n",
+                m_stats.jeq_taken, m_stats.jeq_not_taken, m_stats.jnz_taken,
+                m_stats.jnz_not_taken);
+    } else {
+        fputs("  \"branches\": null,\n", out);
+    }
+
+    fputs("  \"cpucalls\": ", out);
+    json_counts(out, m_stats.cpucalls, 256, cpucall_name);
+    fputs(",\n", out);
+
+    fputs("  \"devices\": [", out);
+    for (size_t i = 0; i < m_devices.size(); i++) {
+        const device& dev = m_devices[i];
+
+        fputs(i ? ",\n    {\"id\": " : "\n    {\"id\": ", out);
+        fprintf(out, "%d, \"name\": ", dev.id);
+        json_string(out, dev.name.c_str());
+        fprintf(out, ", \"bytes_in\": %zu, \"bytes_out\": %zu}", dev.bytes_in,
+                dev.bytes_out);
+    }
+    fputs(m_devices.empty() ? "]\n" : "\n  ]\n", out);
+    fputs("}\n", out);
+
+    if (fclose(out))
+        warn("failed to write %s: %s", path.c_str(), strerror(errno));
+}
@@ -0,0 +1,153 @@
+/* Timer device
+   Copyright (c) 2023-2024 bellrise */
+
+#include "emul.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+/* Each expiration count in the input is a u64, as read from a timerfd. */
+#define TIMER_COUNT_SIZE 8
+
+struct timer_state
+{
+    /* A timerfd watched by the I/O thread, or -1 in virtual time. */
+    int fd;
+
+    /* Virtual time: the next expiration, & the period or 0 if the timer
+       only expires once. */
+    uint64_t deadline;
+    uint64_t period;
+
+    /* Part of an expiration count taken out of the input. */
+    u8 count[TIMER_COUNT_SIZE];
+    size_t have;
+};
+
+static u8 timer_read(device&);
+static bool timer_poll(device&);
+static void timer_close(device&);
+static void timer_arm(device&, uint64_t, uint64_t, bool);
+static uint64_t timer_tick(device&, uint64_t);
+
+static const device_ops timer_ops = {
+    timer_close, nullptr, timer_read, timer_poll, nullptr, nullptr,
+    nullptr,     nullptr, nullptr,    nullptr,    nullptr, nullptr,
+    nullptr,     timer_arm, timer_tick,
+};
+
+static inline timer_state *state(device& self)
+{
+    return static_cast<timer_state *>(self.state);
+}
+
+device timer_create(u16 id, bool virtual_time)
+{
+    device timer = {id, "timer"};
+    timer_state *state;
+
+    state = new timer_state;
+    state->deadline = UINT64_MAX;
+    state->period = 0;
+    state->have = 0;
+    timer.state = state;
+    timer.ops = &timer_ops;
+
+    state->fd = -1;
+    if (!virtual_time) {
+        state->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (state->fd == -1)
+            die("failed to create a timer: %s", strerror(errno));
+    }
+
+    timer.input = new device_input(state->fd);
+    return timer;
+}
+
+/* Take all expirations so far, which also acknowledges the interrupt. */
+static u8 timer_read(device& self)
+{
+    timer_state *timer = state(self);
+    uint64_t expired;
+    uint64_t count;
+
+    expired = 0;
+    while (1) {
+        timer->have += self.input->read(timer->count + timer->have,
+                                        TIMER_COUNT_SIZE - timer->have);
+        if (timer->have < TIMER_COUNT_SIZE)
+            break;
+
+        memcpy(&count, timer->count, TIMER_COUNT_SIZE);
+        expired += count;
+        timer->have = 0;
+    }
+
+    return std::min<uint64_t>(expired, 0xff);
+}
+
+static bool timer_poll(device& self)
+{
+    return self.input->ready();
+}
+
+static void timer_arm(device& self, uint64_t now, uint64_t ns, bool periodic)
+{
+    timer_state *timer = state(self);
+    struct itimerspec spec = {};
+
+    if (timer->fd == -1) {
+        timer->deadline = ns ? now + ns : UINT64_MAX;
+        timer->period = periodic ? ns : 0;
+        return;
+    }
+
+    /* A zero value disarms the timerfd. */
+    spec.it_value.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+    if (periodic)
+        spec.it_interval = spec.it_value;
+
+    if (timerfd_settime(timer->fd, 0, &spec, NULL))
+        warn("failed to set the timer: %s", strerror(errno));
+}
+
+static uint64_t timer_tick(device& self, uint64_t now)
+{
+    timer_state *timer = state(self);
+    uint64_t expired;
+    u8 count[TIMER_COUNT_SIZE];
+
+    if (timer->deadline > now)
+        return timer->deadline;
+
+    if (timer->period) {
+        expired = (now - timer->deadline) / timer->period + 1;
+        timer->deadline += expired * timer->period;
+    } else {
+        expired = 1;
+        timer->deadline = UINT64_MAX;
+    }
+
+    /* Queue the count the same way the I/O thread does for a timerfd. If the
+       program never takes them, the new ones are lost. */
+    memcpy(count, &expired, TIMER_COUNT_SIZE);
+    if (self.input->ring.space() >= TIMER_COUNT_SIZE) {
+        for (u8 byte : count)
+            self.input->ring.push(byte);
+        self.input->notify();
+    }
+
+    return timer->deadline;
+}
+
+static void timer_close(device& self)
+{
+    if (state(self)->fd != -1)
+        close(state(self)->fd);
+    delete state(self);
+    delete self.input;
+}
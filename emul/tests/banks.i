@@ -0,0 +1,190 @@
+; banks.i
+; Pages mapped onto other frames & switched to other banks, for data & for
+; code: a function is called at the same address in two banks, & patched
+; through a second mapping of its page.
+; args: -m 192k
+
+.export main
+
+.valuefile "arch.i"
+
+main:
+    push r4
+    push r5
+
+    mov r0, CPUCALL_MEMINFO
+    cpucall
+    mov r0, r1
+    call show
+    call newline
+
+    ; Page 17 mapped onto frame 16, so 0x4400 is 0x4000.
+    mov r0, 0x1111
+    store r0, 0x4000
+    mov r1, 17
+    mov r2, 16
+    call map
+    load r0, 0x4400
+    call show
+    mov r0, 0x2222
+    store r0, 0x4404
+    load r0, 0x4004
+    call show
+    mov r0, CPUCALL_PAGEINFO
+    mov r1, 17
+    cpucall
+    mov r4, r3
+    mov r0, r2
+    call show
+    mov r0, r4
+    call show
+    mov r1, 17
+    mov r2, 17
+    call map
+    load r0, 0x4400
+    call show
+    call newline
+
+    ; Page 16 in other banks, each keeping its own contents.
+    mov r1, 16
+    mov r3, 1
+    call switch
+    load r0, 0x4000
+    call show
+    mov r0, 0x3333
+    store r0, 0x4000
+    mov r0, CPUCALL_PAGEINFO
+    mov r1, 16
+    cpucall
+    mov r0, r2
+    call show
+    mov r1, 16
+    mov r3, 2
+    call switch
+    load r0, 0x4000
+    call show
+    mov r1, 16
+    mov r3, 0
+    call switch
+    load r0, 0x4000
+    call show
+    mov r1, 16
+    mov r3, 1
+    call switch
+    load r0, 0x4000
+    call show
+    mov r1, 16
+    mov r3, 0
+    call switch
+    call newline
+
+    ; A different function at 0x5000 in banks 0 & 1.
+    mov r0, 0x5000
+    mov r1, fn_one
+    call copy
+    mov r1, 20
+    mov r3, 1
+    call switch
+    mov r0, 0x5000
+    mov r1, fn_two
+    call copy
+    mov r1, 20
+    mov r3, 0
+    call switch
+
+    call sum
+    call show
+    mov r1, 20
+    mov r3, 1
+    call switch
+    call sum
+    call show
+    mov r1, 20
+    mov r3, 0
+    call switch
+    call sum
+    call show
+    call newline
+
+    ; Page 21 mapped onto the code, patching the function through it.
+    mov r1, 21
+    mov r2, 20
+    call map
+    mov r0, 5
+    store r0, 0x5402
+    call sum
+    call show
+    mov r0, 7
+    store r0, 0x5402
+    call 0x5400
+    call show
+    call newline
+
+    pop r5
+    pop r4
+    mov r0, CPUCALL_POWEROFF
+    cpucall
+
+; Sum the results of 20 calls to 0x5000.
+; sum()
+sum:
+    push r4
+    push r5
+    mov r4, 0
+    mov r5, 20
+@loop:
+    call 0x5000
+    add r4, r0
+    sub r5, 1
+    jnz r5, @loop
+    mov r0, r4
+    pop r5
+    pop r4
+    ret
+
+; Map page r1 onto frame r2 of bank 0, with every access bit.
+map:
+    mov r0, CPUCALL_PAGEMAP
+    mov h3, 0x0f
+    cpucall
+    ret
+
+; Switch page r1 to bank r3.
+switch:
+    mov r0, CPUCALL_BANKSWITCH
+    mov r2, 1
+    cpucall
+    ret
+
+; Copy the 8 bytes of a function.
+; copy(void *dest, void *src)
+copy:
+    mov r3, 4
+@loop:
+    load r2, r1
+    store r2, r0
+    add r0, 2
+    add r1, 2
+    sub r3, 1
+    jnz r3, @loop
+    ret
+
+fn_one:
+    mov r0, 1
+    ret
+
+fn_two:
+    mov r0, 2
+    ret
+
+; show(int)
+show:
+    call putx
+    mov r0, ' '
+    call putc
+    ret
+
+newline:
+    mov r0, 10
+    call putc
+    ret
@@ -0,0 +1,174 @@
+; fused.i
+; Every instruction sequence which gets fused into a superinstruction, with
+; both outcomes of each branch & jumps into the middle of a sequence. The
+; body runs often enough to get translated by the JIT, & every result is
+; mixed into a checksum printed after each round.
+
+.export main
+
+.valuefile "arch.i"
+
+main:
+    push r4
+    push r5
+    mov r4, 0               ; checksum
+    mov r5, 20              ; round
+
+@round:
+    mov r0, r5
+    call body
+    mov r0, r4
+    call putx
+    mov r0, ' '
+    call putc
+    mov r0, r5
+    sub r0, 1
+    and r0, 3
+    jnz r0, @next
+    mov r0, 10
+    call putc
+@next:
+    sub r5, 1
+    jnz r5, @round
+
+    pop r5
+    pop r4
+    mov r0, CPUCALL_POWEROFF
+    cpucall
+
+; Mix r1 into the checksum.
+mix:
+    mul r4, 5
+    add r4, r1
+    ret
+
+; Run each sequence once, with some of the values taken from the round n.
+; body(int n)
+body:
+    push bp
+    mov bp, sp
+    push r0                 ; int n, at bp - 2
+    push r0                 ; scratch, at bp - 4
+
+    ; cmp & jeq, with each mix of half registers.
+    mov r1, r0
+    mov r2, 10
+    cmp r1, r2
+    jeq @ww
+    add r4, 1
+@ww:
+    cmp r1, h2
+    jeq @wh
+    add r4, 2
+@wh:
+    cmp h1, r2
+    jeq @hw
+    add r4, 3
+@hw:
+    cmp h1, h2
+    jeq @hh
+    add r4, 4
+@hh:
+    cmp r1, 7
+    jeq @w8
+    add r4, 5
+@w8:
+    cmp h1, 7
+    jeq @h8
+    add r4, 6
+@h8:
+    add r1, 0x0100
+    cmp r1, 0x0105
+    jeq @w16
+    add r4, 7
+@w16:
+    call mix
+
+    ; cfs & jeq, once taken & once not.
+    cmp r0, 3
+    cfs
+    jeq @cfs1
+    add r4, 8
+@cfs1:
+    cmp r0, 100
+    cfs
+    jeq @cfs2
+    add r4, 9
+@cfs2:
+
+    ; Locals addressed from bp, of both widths.
+    mov r2, bp
+    sub r2, 2
+    load r1, r2
+    call mix
+    mov r2, bp
+    sub r2, 2
+    load h1, r2
+    add r1, 0x4000
+    mov r2, bp
+    sub r2, 4
+    store r1, r2
+    mov r2, bp
+    sub r2, 4
+    store h0, r2
+    load r1, r2
+    call mix
+    mov r3, bp
+    sub r3, 0x0100
+    store r4, r3
+    mov r1, bp
+    sub r1, 0x0100
+    load r1, r1
+    call mix
+    mov r3, bp
+    sub r3, 6
+    mov r1, r3
+    call mix
+
+    ; Pairs of pushes & pops.
+    mov r2, 0x1111
+    mov r3, r0
+    push r2
+    push r3
+    pop r1
+    pop r2
+    call mix
+    mov r1, r2
+    call mix
+
+    ; add & jmp, of each width.
+    mov r1, r0
+    add r1, 3
+    jmp @add1
+    add r1, 0x0100
+@add1:
+    add h1, 0x80
+    jmp @add2
+    add r1, 0x0200
+@add2:
+    add r1, 0x1234
+    jmp @add3
+    add r1, 0x0300
+@add3:
+    call mix
+
+    ; Jumps to the second instruction of a sequence, skipping the compare.
+    mov r1, r0
+    cmp r1, 15
+    jmp @mid1
+    cmp r1, r1
+@mid1:
+    jeq @mid2
+    add r4, 10
+@mid2:
+    mov r2, bp
+    jmp @mid3
+    mov r2, bp
+@mid3:
+    sub r2, 2
+    load r1, r2
+    call mix
+
+    mov sp, bp
+    pop bp
+    ret
@@ -0,0 +1,47 @@
+; halt.i
+; Interrupts keep being handled once main returns, while the console has
+; input nobody reads.
+
+.export main
+
+.valuefile "arch.i"
+
+.value TIMER 0x1001
+
+main:
+    mov r0, CPUCALL_DEVICEINTR
+    mov r1, TIMER
+    mov r2, on_timer
+    cpucall
+    push r4
+    mov r0, CPUCALL_TIMERSET
+    mov r1, TIMER
+    mov r2, 1000
+    mov r3, 0
+    mov r4, TIMER_PERIODIC
+    cpucall
+    pop r4
+    sti
+    ret
+
+; Print a T for each of the first 5 expirations, then stop.
+on_timer:
+    mov r0, CPUCALL_DEVICEREAD
+    mov r1, TIMER
+    cpucall
+    mov r0, 'T'
+    call putc
+    load r0, ticks
+    add r0, 1
+    store r0, ticks
+    cmp r0, 5
+    jeq @done
+    rti
+@done:
+    mov r0, 10
+    call putc
+    mov r0, CPUCALL_POWEROFF
+    cpucall
+
+ticks:
+    .resv 2
@@ -0,0 +1,192 @@
+; irq.i
+; Interrupts of the console & the timer, both pending at once, delivered by
+; priority, held back while masked, & woken up for by wfi.
+
+.export main
+
+.valuefile "arch.i"
+
+.value CONSOLE 0x1000
+.value TIMER   0x1001
+
+main:
+    mov r0, CPUCALL_DEVICEINTR
+    mov r1, CONSOLE
+    mov r2, on_console
+    cpucall
+    mov r0, CPUCALL_DEVICEINTR
+    mov r1, TIMER
+    mov r2, on_timer
+    cpucall
+
+    ; The timer goes first with a higher priority, even though the console
+    ; is listed before it. The console handler masks the console.
+    mov r0, CPUCALL_IRQPRIORITY
+    mov r1, TIMER
+    mov r2, 5
+    cpucall
+    call expire
+    mov r0, CONSOLE
+    call poll
+    mov r0, 2
+    call deliver
+    call newline
+
+    ; The console has the higher priority now, but is masked.
+    mov r0, CPUCALL_IRQPRIORITY
+    mov r1, TIMER
+    mov r2, 0
+    cpucall
+    mov r0, CPUCALL_IRQPRIORITY
+    mov r1, CONSOLE
+    mov r2, 7
+    cpucall
+    call expire
+    mov r0, CONSOLE
+    call poll
+    mov r0, 1
+    call deliver
+    mov r0, '|'
+    call putc
+    mov r0, CPUCALL_IRQMASK
+    mov r1, CONSOLE
+    mov h2, 0
+    cpucall
+    mov r0, 1
+    call deliver
+    call newline
+
+    ; Nothing is delivered with every device masked.
+    mov r0, CPUCALL_IRQMASK
+    mov r1, ALL_DEVICES
+    mov h2, 1
+    cpucall
+    call expire
+    mov r0, 0
+    store r0, count
+    sti
+    mov r0, 100
+@spin:
+    sub r0, 1
+    jnz r0, @spin
+    dsi
+    load r0, count
+    call putx
+    mov r0, '|'
+    call putc
+    mov r0, CPUCALL_IRQMASK
+    mov r1, ALL_DEVICES
+    mov h2, 0
+    cpucall
+    mov r0, 1
+    call deliver
+    call newline
+
+    ; wfi wakes up for the timer with interrupts disabled, which is then
+    ; polled, & calls the handler with interrupts enabled.
+    mov r0, 1000
+    call arm
+    wfi
+    mov r0, TIMER
+    call poll
+    mov r0, CPUCALL_DEVICEREAD
+    mov r1, TIMER
+    cpucall
+    mov r0, 'W'
+    call putc
+    mov r0, 0
+    store r0, count
+    mov r0, 1000
+    call arm
+    sti
+    wfi
+    dsi
+    load r0, count
+    call putx
+    call newline
+
+    mov r0, CPUCALL_POWEROFF
+    cpucall
+
+; Enable interrupts until n handlers have run.
+; deliver(int n)
+deliver:
+    mov r1, 0
+    store r1, count
+    sti
+@wait:
+    load r1, count
+    cmp r1, r0
+    jeq @done
+    jmp @wait
+@done:
+    dsi
+    ret
+
+; Arm the timer to expire once after n microseconds.
+; arm(int n)
+arm:
+    push r4
+    mov r2, r0
+    mov r0, CPUCALL_TIMERSET
+    mov r1, TIMER
+    mov r3, 0
+    mov r4, TIMER_ONESHOT
+    cpucall
+    pop r4
+    ret
+
+; Arm the timer & wait until it expires.
+; expire()
+expire:
+    mov r0, 1
+    call arm
+    mov r0, TIMER
+    call poll
+    ret
+
+; Wait until the device has input.
+; poll(int dev)
+poll:
+    mov r1, r0
+    mov r0, CPUCALL_DEVICEPOLL
+@wait:
+    cpucall
+    cmp h2, 0
+    jeq @wait
+    ret
+
+; Print each byte of input, masking the console after each.
+on_console:
+    mov r0, CPUCALL_DEVICEREAD
+    mov r1, CONSOLE
+    cpucall
+    mov r0, CPUCALL_DEVICEWRITE
+    cpucall
+    mov r0, CPUCALL_IRQMASK
+    mov h2, 1
+    cpucall
+    load r0, count
+    add r0, 1
+    store r0, count
+    rti
+
+; Take the expirations & print a T.
+on_timer:
+    mov r0, CPUCALL_DEVICEREAD
+    mov r1, TIMER
+    cpucall
+    mov r0, 'T'
+    call putc
+    load r0, count
+    add r0, 1
+    store r0, count
+    rti
+
+newline:
+    mov r0, 10
+    call putc
+    ret
+
+count:
+    .resv 2
@@ -0,0 +1,73 @@
+; restart.i
+; A restart in the middle of an interrupt handler, with the console masked &
+; given a priority. The program starts over without any of it: the console
+; wakes up wfi, & its old handler is never called.
+
+.export main
+
+.valuefile "arch.i"
+
+.value CONSOLE 0x1000
+
+main:
+    load r0, restarted
+    jnz r0, @again
+
+    mov r0, 1
+    store r0, restarted
+    mov r0, CPUCALL_DEVICEINTR
+    mov r1, CONSOLE
+    mov r2, on_console
+    cpucall
+    mov r0, CPUCALL_IRQPRIORITY
+    mov r1, CONSOLE
+    mov r2, 7
+    cpucall
+
+    ; Restart from the handler, once the console has input.
+    sti
+@wait:
+    jmp @wait
+
+@again:
+    mov r0, 'R'
+    call putc
+    wfi
+    mov r0, CPUCALL_DEVICEREAD
+    mov r1, CONSOLE
+    cpucall
+    mov r0, h2
+    call putc
+
+    ; Nothing is left to interrupt.
+    sti
+    mov r0, 100
+@spin:
+    sub r0, 1
+    jnz r0, @spin
+    dsi
+    mov r0, 10
+    call putc
+
+    mov r0, CPUCALL_POWEROFF
+    cpucall
+
+on_console:
+    load r0, restarted
+    add r0, 1
+    store r0, restarted
+    cmp r0, 2
+    jeq @restart
+    mov r0, '!'
+    call putc
+    rti
+@restart:
+    mov r0, CPUCALL_IRQMASK
+    mov r1, CONSOLE
+    mov h2, 1
+    cpucall
+    mov r0, CPUCALL_RESTART
+    cpucall
+
+restarted:
+    .resv 2
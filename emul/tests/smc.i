@@ -0,0 +1,127 @@
+; smc.i
+; Code patching itself while it runs hot: the immediate of a called function,
+; the target of a fused compare & branch, the instruction right after the
+; store, & a function at the very end of memory.
+
+.export main
+
+.valuefile "arch.i"
+
+main:
+    push r4
+    push r5
+
+    ; fn: mov r1, <r4>, for each r4 from 200 down to 1.
+    mov r5, 0
+    mov r4, 200
+@imm:
+    mov r2, fn
+    add r2, 2
+    store r4, r2
+    call fn
+    sub r4, 1
+    jnz r4, @imm
+    mov r0, r5
+    call show
+
+    ; pick: jeq to pick_one & pick_two in turns.
+    mov r5, 0
+    mov r4, 20
+@target:
+    mov r2, pick_one
+    mov r0, r4
+    and r0, 1
+    jnz r0, @odd
+    mov r2, pick_two
+@odd:
+    mov r1, pick_jeq
+    add r1, 1
+    store r2, r1
+    call pick
+    add r5, r0
+    sub r4, 1
+    jnz r4, @target
+    mov r0, r5
+    call show
+
+    ; The next instruction: mov r0, <r4>.
+    mov r5, 0
+    mov r4, 20
+@next:
+    mov r1, @patched
+    add r1, 2
+    store r4, r1
+@patched:
+    mov r0, 0
+    add r5, r0
+    sub r4, 1
+    jnz r4, @next
+    mov r0, r5
+    call show
+
+    ; Copy tail to 0xfff4, patching it to mov r0, 3 half way through.
+    mov r1, tail
+    mov r2, 0xfff4
+    mov r3, 6
+@copy:
+    load r0, r1
+    store r0, r2
+    add r1, 2
+    add r2, 2
+    sub r3, 1
+    jnz r3, @copy
+    mov r5, 0
+    mov r4, 40
+@end:
+    call 0xfff4
+    cmp r4, 20
+    jeq @patch
+    jmp @skip
+@patch:
+    mov r0, 3
+    store r0, 0xfff6
+@skip:
+    sub r4, 1
+    jnz r4, @end
+    mov r0, r5
+    call show
+
+    mov r0, 10
+    call putc
+
+    pop r5
+    pop r4
+    mov r0, CPUCALL_POWEROFF
+    cpucall
+
+fn:
+    mov r1, 0x1234
+    add r5, r1
+    ret
+
+pick:
+    cmp r0, r0
+pick_jeq:
+    jeq pick_one
+    mov r0, 0
+    ret
+
+pick_one:
+    mov r0, 1
+    ret
+
+pick_two:
+    mov r0, 2
+    ret
+
+tail:
+    mov r0, 1
+    add r5, r0
+    ret
+
+; show(int)
+show:
+    call putx
+    mov r0, ' '
+    call putc
+    ret
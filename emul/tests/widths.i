@@ -0,0 +1,220 @@
+; widths.i
+; Each instruction with 8-bit, 16-bit & half register operands, including
+; writes to one half which must leave the other one alone. Printing trashes
+; r0, r1 & r2, so they are set again after each value.
+
+.export main
+
+.valuefile "arch.i"
+
+main:
+    ; Halves of a register: h is the low byte, l the high one.
+    mov r0, 0x1234
+    mov h0, 0xab
+    call show
+    mov r0, 0x1234
+    mov l0, 0xcd
+    call show
+    mov r1, 0x5678
+    mov r0, 0
+    mov h0, l1
+    call show
+    mov r1, 0x5678
+    mov r0, 0xffff
+    mov l0, h1
+    call show
+    mov r1, 0x00c3
+    mov r0, h1
+    call show
+    call newline
+
+    ; Arithmetic wraps at the width of the destination.
+    mov r0, 0x12ff
+    add h0, 1
+    call show
+    mov r0, 0xff00
+    add l0, 0x02
+    call show
+    mov r0, 0x0001
+    sub h0, 2
+    call show
+    mov r0, 0xfffe
+    add r0, 0x0003
+    call show
+    mov r0, 0x1234
+    add r0, 0x1111
+    call show
+    mov r0, 0x0100
+    sub r0, 0x0001
+    call show
+    mov r0, 0x1234
+    mov r1, 0x00f0
+    add h0, h1
+    call show
+    mov r0, 0x00f0
+    mov r1, 0x1234
+    add r0, h1
+    call show
+    call newline
+
+    ; Logic & shifts.
+    mov r0, 0xf0f0
+    and h0, 0x3c
+    call show
+    mov r0, 0xf0f0
+    or l0, 0x0f
+    call show
+    mov r0, 0x1234
+    and r0, 0x0ff0
+    call show
+    mov r0, 0x1200
+    or r0, 0x0034
+    call show
+    mov r0, 0x8181
+    shl h0, 1
+    call show
+    mov r0, 0x8181
+    shr l0, 1
+    call show
+    mov r0, 0x8001
+    shl r0, 4
+    call show
+    mov r0, 0x8001
+    mov h1, 3
+    shr r0, h1
+    call show
+    .byte 0x42                  ; not h0
+    .byte 0x10
+    .byte 0x00
+    .byte 0x00
+    call show
+    .byte 0x42                  ; not r0
+    .byte 0x00
+    .byte 0x00
+    .byte 0x00
+    call show
+    call newline
+
+    ; Multiplication.
+    mov r0, 0x0123
+    mul r0, 0x0010
+    call show
+    mov r0, 0x1234
+    mul h0, 3
+    call show
+    mov r0, 0x0300
+    mul l0, 0x60
+    call show
+    mov r0, 0x0102
+    mov r1, 0x0304
+    mul r0, r1
+    call show
+    call newline
+
+    ; Compares of each width, as 1 for true & 0 for false. Only r3 outlives
+    ; the calls to print them.
+    mov r3, 0x01ff
+    cmp h3, 0xff
+    call flag
+    cmp r3, 0xff
+    call flag
+    cmp r3, 0x01ff
+    call flag
+    mov r1, 0x02ff
+    cmp h3, h1
+    call flag
+    mov r1, 0x02ff
+    cmp r3, r1
+    call flag
+    cmg h3, 0x10
+    call flag
+    cml l3, 0x02
+    call flag
+    cmg r3, 0x0200
+    call flag
+    cml r3, 0x0200
+    call flag
+    mov r1, 0x0001
+    cmg r3, h1
+    call flag
+    cfs
+    call flag
+    call newline
+
+    ; The stack with both widths.
+    mov r1, 0x1234
+    push r1
+    push h1
+    pop h0
+    mov l0, 0
+    call show
+    pop r0
+    call show
+    .byte 0x11                  ; push8 0x5a
+    .byte 0x5a
+    .byte 0x00
+    .byte 0x00
+    .byte 0x12                  ; push16 0xbeef
+    .byte 0xef
+    .byte 0xbe
+    .byte 0x00
+    pop r0
+    call show
+    mov r0, 0xffff
+    pop h0
+    call show
+    call newline
+
+    ; Loads & stores of both widths.
+    mov r1, buffer
+    mov r0, 0xa1b2
+    store r0, r1
+    load h0, r1
+    mov l0, 0
+    call show
+    mov r1, buffer
+    mov r0, 0x77
+    store h0, r1
+    load r0, r1
+    call show
+    mov r0, 0xc3d4
+    store r0, buffer
+    load r0, buffer
+    call show
+    .byte 0x19                  ; null r0
+    .byte 0x00
+    .byte 0x00
+    .byte 0x00
+    call show
+    call newline
+
+    mov r0, CPUCALL_POWEROFF
+    cpucall
+
+; Print r0 in hex.
+; show(int)
+show:
+    call putx
+    mov r0, ' '
+    call putc
+    ret
+
+; Print the compare flag.
+; flag()
+flag:
+    mov r0, 1
+    jeq @set
+    mov r0, 0
+@set:
+    call putx
+    mov r0, ' '
+    call putc
+    ret
+
+newline:
+    mov r0, 10
+    call putc
+    ret
+
+buffer:
+    .resv 4
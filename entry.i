@@ -0,0 +1,24 @@
+; Generated by irid-lc
+
+.org 0
+
+_entry:
+    mov sp, 0x8000
+    mov bp, 0x8000
+    mov r0, 4096
+    call iosel
+    call main
+    call _halt
+@E:
+    ret
+
+_halt:
+    mov r0, 0x19
+    mov r1, 0xffff
+    mov h2, 1
+    cpucall
+    @wait:
+    wfi
+    jmp @wait
+@E:
+    ret
@@ -0,0 +1,16 @@
+; halt.i
+; Copyright (c) 2023-2024 bellrise
+
+.valuefile "arch.i"
+
+; Stop for good. Every device is masked first, as input which is never read
+; stays pending & would wake wfi straight away.
+.export halt
+halt:
+    mov r0, CPUCALL_IRQMASK
+    mov r1, ALL_DEVICES
+    mov h2, 1
+    cpucall
+@wait:
+    wfi
+    jmp @wait
@@ -8,11 +8,21 @@
 
 #define IRID_PAGE_SIZE      0x0400
 #define IRID_MAX_ADDR       0xffff
-#define IRID_MAX_PAGES      (IRID_MAX_ADDR + 1) / IRID_PAGE_SIZE
+#define IRID_MAX_PAGES      ((IRID_MAX_ADDR + 1) / IRID_PAGE_SIZE)
 #define IRID_PAGE_SIZE_BITS 10
 #define IRID_PAGE_MASK      0xfc00
 #define IRID_PTR_WIDTH      16
 
+/*
+ * Page access bits. A page has to be present & allow the kind of access,
+ * otherwise it causes a page fault.
+ */
+
+#define IRID_PAGE_PRESENT 0x01
+#define IRID_PAGE_READ    0x02
+#define IRID_PAGE_WRITE   0x04
+#define IRID_PAGE_EXEC    0x08
+
 /*
  * Irid regular int & half int. All full 16-bit registers use the rint type
  * instead of the iint type, because the signed bit needs to be ignored.
@@ -59,6 +69,7 @@ typedef unsigned char u8;
 #define I_RTI     0x02
 #define I_STI     0x03
 #define I_DSI     0x04
+#define I_WFI     0x05
 /* reserved */
 #define I_PUSH    0x10
 #define I_PUSH8   0x11
@@ -115,15 +126,101 @@ typedef unsigned char u8;
  * call the I_CPUCALL instruction with the correct function in r0.
  */
 
-#define CPUCALL_POWEROFF    0x10
-#define CPUCALL_RESTART     0x11
-#define CPUCALL_FAULT       0x12
-#define CPUCALL_DEVICELIST  0x13
-#define CPUCALL_DEVICEINFO  0x14
-#define CPUCALL_DEVICEINTR  0x15
-#define CPUCALL_DEVICEWRITE 0x20
-#define CPUCALL_DEVICEREAD  0x21
-#define CPUCALL_DEVICEPOLL  0x22
+#define CPUCALL_POWEROFF     0x10
+#define CPUCALL_RESTART      0x11
+#define CPUCALL_FAULT        0x12
+#define CPUCALL_DEVICELIST   0x13
+#define CPUCALL_DEVICEINFO   0x14
+#define CPUCALL_DEVICEINTR   0x15
+#define CPUCALL_DEVICEMAP    0x16
+#define CPUCALL_CLOCK        0x17
+#define CPUCALL_IRQPRIORITY  0x18
+#define CPUCALL_IRQMASK      0x19
+#define CPUCALL_PERFREAD     0x1a
+#define CPUCALL_PERFSNAPSHOT 0x1b
+#define CPUCALL_PERFRESET    0x1c
+#define CPUCALL_DEVICEWRITE  0x20
+#define CPUCALL_DEVICEREAD   0x21
+#define CPUCALL_DEVICEPOLL   0x22
+#define CPUCALL_DEVICEWRITEN 0x23
+#define CPUCALL_DEVICEREADN  0x24
+#define CPUCALL_SECTORREAD   0x25
+#define CPUCALL_SECTORWRITE  0x26
+#define CPUCALL_SECTORCOUNT  0x27
+#define CPUCALL_DEVICERING   0x28
+#define CPUCALL_DEVICENOTIFY 0x29
+#define CPUCALL_TIMERSET     0x2a
+#define CPUCALL_PAGEMAP      0x30
+#define CPUCALL_PAGEINFO     0x31
+#define CPUCALL_BANKSWITCH   0x32
+#define CPUCALL_MEMINFO      0x33
+
+/*
+ * Registers of a device mapped into memory with CPUCALL_DEVICEMAP, as offsets
+ * into its page. Reading the data register takes the next input byte (0 if
+ * there is none), writing it outputs a byte.
+ */
+
+#define IRID_MMIO_DATA   0x00
+#define IRID_MMIO_STATUS 0x01
+#define IRID_MMIO_READY  0x01 /* Status: there is input to read */
+
+/*
+ * Block devices are transferred in whole sectors with CPUCALL_SECTORREAD &
+ * CPUCALL_SECTORWRITE.
+ */
+
+#define IRID_SECTOR_SIZE 512
+
+/*
+ * Packet devices move packets through two rings of descriptors in memory, one
+ * for received & one for sent packets, set with CPUCALL_DEVICERING. The
+ * program hands a descriptor over to the device by setting IRID_DESC_AVAIL,
+ * and the device hands it back with IRID_DESC_DONE once it is filled or sent.
+ */
+
+#define IRID_DESC_AVAIL 0x01 /* Owned by the device */
+#define IRID_DESC_DONE  0x02 /* Filled or sent by the device */
+#define IRID_DESC_TRUNC 0x04 /* The packet did not fit, the rest is lost */
+
+struct irid_desc
+{
+    u16 d_addr;
+    u16 d_len;
+    u16 d_flags;
+};
+
+/*
+ * Interrupt priorities for CPUCALL_IRQPRIORITY. When several devices wait for
+ * an interrupt, the one with the highest priority is called first.
+ */
+
+#define IRID_IRQ_LEVELS 8
+
+/* Device ID which stands for every device in CPUCALL_IRQMASK. */
+#define IRID_ALL_DEVICES 0xffff
+
+/*
+ * Timer modes for CPUCALL_TIMERSET.
+ */
+
+#define IRID_TIMER_STOP     0x00
+#define IRID_TIMER_ONESHOT  0x01
+#define IRID_TIMER_PERIODIC 0x02
+
+/*
+ * Performance counters for CPUCALL_PERFREAD & CPUCALL_PERFSNAPSHOT. Each one
+ * is 32 bits wide & wraps around. Loads & stores include the stack accesses
+ * of push, pop, call & ret.
+ */
+
+#define IRID_PERF_INSTRUCTIONS 0x00
+#define IRID_PERF_CYCLES       0x01
+#define IRID_PERF_LOADS        0x02
+#define IRID_PERF_STORES       0x03
+#define IRID_PERF_BRANCHES     0x04 /* Taken branches */
+#define IRID_PERF_INTERRUPTS   0x05
+#define IRID_PERF_COUNT        0x06
 
 struct irid_deviceinfo
 {
@@ -143,6 +240,7 @@ struct irid_deviceinfo
 #define CPUFAULT_INS     0x05 /* Illegal instruction */
 #define CPUFAULT_USER    0x06 /* Forced fault */
 #define CPUFAULT_CPUCALL 0x07 /* Invalid CPU call */
+#define CPUFAULT_PAGE    0x08 /* Page fault */
 
 #define _irid_joined_register(ID)                                              \
     union                                                                      \
@@ -0,0 +1,206 @@
+; io.i
+; Library for input/output routines.
+; Copyright (c) 2023-2024 bellrise
+
+.export putc
+.export puts
+.export putx
+.export getc
+.export printf
+.export iosel
+.export __io_write
+
+.valuefile "arch.i"
+
+
+; Write a character to the selected I/O device.
+; putc(char c)
+putc:
+    mov h2, r0
+    mov r0, CPUCALL_DEVICEWRITE
+    load r1, __io_dev
+    cpucall
+    ret
+
+; Write a string to the selected I/O device.
+; puts(char *str)
+puts:
+    mov r2, r0      ; char *str
+    mov r3, r0
+
+@loop:
+    load h0, r3     ; load char
+    cmp h0, 0       ; check if string end
+    jeq @end
+    add r3, 1       ; move to next char
+    jmp @loop
+
+@end:
+    sub r3, r2      ; write the whole string at once
+    mov r0, CPUCALL_DEVICEWRITEN
+    load r1, __io_dev
+    cpucall
+    ret
+
+; Print a hex number.
+; putx(int)
+putx:
+    push bp
+    push r4
+    push r5
+    mov bp, sp
+
+    mov r4, r0      ; int num
+    mov r5, 4       ; counter
+
+@loop:
+    cmp r5, 0
+    jeq @end
+
+    mov r0, r4
+    and r0, 0xf000
+    shr r0, 12
+
+    add r0, '0'
+    cmg r0, '9'     ; if char > '9'
+    jeq @over_9
+    jmp @print
+
+@over_9:
+    add r0, 7       ; move to 'A-F'
+
+@print:
+    call putc
+
+    shl r4, 4
+    sub r5, 1
+    jmp @loop
+
+@end:
+    pop r5
+    pop r4
+    pop bp
+    ret
+
+; Read a single character.
+; getc()
+getc:
+    push bp
+
+    mov r0, CPUCALL_DEVICEPOLL
+@wait:
+    load r1, __io_dev
+    cpucall
+    cmp h2, 0       ; read queue empty
+    jeq @wait
+
+    mov r0, CPUCALL_DEVICEREAD
+    load r1, __io_dev
+    cpucall
+    mov r0, h2      ; read char from device
+
+    pop bp
+    ret
+
+; Print a formatted string.
+; printf(char *fmt, ...)
+printf:
+    push bp
+    push r4
+    push r5
+    mov bp, sp
+
+    mov r4, r0      ; char *fmt
+    mov r5, bp      ; &...
+    add r5, 8
+
+@loop:
+    load h0, r4     ; load char
+    cmp h0, 0       ; check for end of string
+    jeq @end
+
+    cmp h0, '%'     ; compare char
+    jeq @format
+
+    mov r1, r4      ; find the end of non-formatted chars
+
+@literal:
+    add r1, 1
+    load h0, r1
+    cmp h0, 0
+    jeq @write
+    cmp h0, '%'
+    jeq @write
+    jmp @literal
+
+@write:
+    mov r0, r4      ; print them at once
+    sub r1, r4
+    add r4, r1      ; move fmt pointer past them
+    call __io_write
+    jmp @loop
+
+@format:
+    add r4, 1       ; move to next char
+    load h0, r4     ; load char
+
+    cmp h0, '%'     ; regular percent
+    jeq @LF0
+    cmp h0, 'x'     ; hex number
+    jeq @LFx
+    cmp h0, 's'     ; string
+    jeq @LFs
+
+    push r0         ; print unknown %_ otherwise
+    mov r0, '%'
+    call putc
+    pop r0
+    call putc
+    jmp @LFend
+
+@LF0:
+    mov h0, '%'
+    call putc
+    jmp @LFend
+
+@LFx:
+    load r0, r5     ; get argument from stack
+    add r5, 2       ; move to next arg
+    call putx
+    jmp @LFend
+
+@LFs:
+    load r0, r5     ; char * from stack
+    add r5, 2       ; move to next arg
+    call puts
+    jmp @LFend
+
+@LFend:
+    add r4, 1       ; move to next char
+    jmp @loop
+
+@end:
+    mov sp, bp
+    pop r5
+    pop r4
+    pop bp
+    ret
+
+; Select the I/O device to use.
+; iosel(int dev)
+iosel:
+    store r0, __io_dev
+    ret
+
+; Write to the selected device.
+; __io_write(char *bytes, int len)
+__io_write:
+    mov r2, r0
+    mov r3, r1
+    mov r0, CPUCALL_DEVICEWRITEN
+    load r1, __io_dev
+    cpucall
+    ret
+
+__io_dev:
+.resv 2
@@ -54,6 +54,7 @@ int main(int argc, char **argv)
     linker = ld_linker_new();
     linker->first_object = first_object;
     linker->verbose = opts.verbose;
+    linker->map_path = opts.map;
     ld_linker_link(linker, opts.output);
 
 end:
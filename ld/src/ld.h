@@ -50,6 +50,7 @@ void buffer_free(struct buffer *);
 struct options
 {
     const char *output;
+    const char *map;
     struct strlist inputs;
     bool dump_symbols;
     bool only_exported;
@@ -142,6 +143,7 @@ struct ld_linker
     struct ld_symbol **symbols;
     int n_symbols;
     bool verbose;
+    const char *map_path;
     struct ld_region *_region_chain;
     struct buffer *output;
 };
@@ -4,6 +4,7 @@
 #include "ld.h"
 
 #include <irid/arch.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -302,6 +303,60 @@ static void link_section(struct ld_linker *self, struct ld_section_entry *entry)
     }
 }
 
+static int compare_symbols(const void *a, const void *b)
+{
+    const struct ld_symbol *left = a;
+    const struct ld_symbol *right = b;
+
+    return left->real_addr - right->real_addr;
+}
+
+/* Write the final address of each symbol, so tools like the emulator's
+   profiler can name the code they see. Labels local to a symbol, which have
+   an @ in their name, are left out. */
+static void write_map(struct ld_linker *self)
+{
+    struct ld_section_entry *entry;
+    struct ld_symbol *symbols;
+    struct iof_symbol *symv;
+    const char *name;
+    int n_symbols;
+    FILE *out;
+
+    symbols = NULL;
+    n_symbols = 0;
+
+    for (int i = 0; i < self->n_entries; i++) {
+        entry = self->entries[i];
+        symv = entry->section->base_ptr + entry->section->header.s_symbols_addr;
+
+        for (int j = 0; j < entry->section->header.s_symbols_count; j++) {
+            name = ld_section_string_by_id(entry->section, symv[j].l_strid);
+            if (strchr(name, '@'))
+                continue;
+
+            symbols = realloc(symbols, sizeof(*symbols) * (n_symbols + 1));
+            symbols[n_symbols].symbol = (char *) name;
+            symbols[n_symbols].real_addr =
+                entry->region->start + symv[j].l_addr;
+            symbols[n_symbols].entry = entry;
+            n_symbols++;
+        }
+    }
+
+    qsort(symbols, n_symbols, sizeof(*symbols), compare_symbols);
+
+    out = fopen(self->map_path, "w");
+    if (!out)
+        die("failed to open %s", self->map_path);
+
+    for (int i = 0; i < n_symbols; i++)
+        fprintf(out, "%04x %s\n", symbols[i].real_addr, symbols[i].symbol);
+
+    fclose(out);
+    free(symbols);
+}
+
 static void create_output_buffer(struct ld_linker *self)
 {
     struct ld_region *walker;
@@ -383,6 +438,9 @@ void ld_linker_link(struct ld_linker *self, const char *output_path)
         link_section(self, self->entries[i]);
 
     buffer_write_file(self->output, output_path);
+
+    if (self->map_path)
+        write_map(self);
 }
 
 void ld_linker_free(struct ld_linker *self)
@@ -13,6 +13,7 @@ static void usage();
 void opt_set_defaults(struct options *opts)
 {
     opts->output = "out.bin";
+    opts->map = NULL;
     opts->inputs.strings = NULL;
     opts->inputs.size = 0;
     opts->dump_symbols = false;
@@ -29,6 +30,7 @@ void opt_parse(struct options *opts, int argc, char **argv)
 
     static struct option long_opts[] = {{"help", no_argument, 0, 'h'},
                                         {"output", required_argument, 0, 'o'},
+                                        {"map", required_argument, 0, 'm'},
                                         {"portability", no_argument, 0, 'P'},
                                         {"version", no_argument, 0, 'v'},
                                         {"verbose", no_argument, 0, 'V'},
@@ -40,7 +42,7 @@ void opt_parse(struct options *opts, int argc, char **argv)
     opt_index = 0;
 
     while (1) {
-        c = getopt_long(argc, argv, "hHo:PtTvV", long_opts, &opt_index);
+        c = getopt_long(argc, argv, "hHm:o:PtTvV", long_opts, &opt_index);
         if (c == -1)
             break;
 
@@ -51,6 +53,9 @@ void opt_parse(struct options *opts, int argc, char **argv)
         case 'H':
             opts->dump_header = true;
             break;
+        case 'm':
+            opts->map = optarg;
+            break;
         case 'o':
             opts->output = optarg;
             break;
@@ -89,6 +94,7 @@ void usage()
     printf("Options:\n"
            "  -h, --help            show this usage page\n"
            "  -H, --headers         display all section headers\n"
+           "  -m, --map FILE        write the address of each symbol to FILE\n"
            "  -o, --output OUTPUT   output to a file (default out.bin)\n"
            "  -P, --portability     use portable output\n"
            "  -t, --symbols         display all symbols\n"
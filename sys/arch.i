@@ -3,15 +3,34 @@
 
 ; Functions built-into the CPU itself.
 
-.value CPUCALL_POWEROFF    0x10
-.value CPUCALL_RESTART     0x11
-.value CPUCALL_FAULT       0x12
-.value CPUCALL_DEVICELIST  0x13
-.value CPUCALL_DEVICEINFO  0x14
-.value CPUCALL_DEVICEINTR  0x15
-.value CPUCALL_DEVICEWRITE 0x20
-.value CPUCALL_DEVICEREAD  0x21
-.value CPUCALL_DEVICEPOLL  0x22
+.value CPUCALL_POWEROFF     0x10
+.value CPUCALL_RESTART      0x11
+.value CPUCALL_FAULT        0x12
+.value CPUCALL_DEVICELIST   0x13
+.value CPUCALL_DEVICEINFO   0x14
+.value CPUCALL_DEVICEINTR   0x15
+.value CPUCALL_DEVICEMAP    0x16
+.value CPUCALL_CLOCK        0x17
+.value CPUCALL_IRQPRIORITY  0x18
+.value CPUCALL_IRQMASK      0x19
+.value CPUCALL_PERFREAD     0x1a
+.value CPUCALL_PERFSNAPSHOT 0x1b
+.value CPUCALL_PERFRESET    0x1c
+.value CPUCALL_DEVICEWRITE  0x20
+.value CPUCALL_DEVICEREAD   0x21
+.value CPUCALL_DEVICEPOLL   0x22
+.value CPUCALL_DEVICEWRITEN 0x23
+.value CPUCALL_DEVICEREADN  0x24
+.value CPUCALL_SECTORREAD   0x25
+.value CPUCALL_SECTORWRITE  0x26
+.value CPUCALL_SECTORCOUNT  0x27
+.value CPUCALL_DEVICERING   0x28
+.value CPUCALL_DEVICENOTIFY 0x29
+.value CPUCALL_TIMERSET     0x2a
+.value CPUCALL_PAGEMAP      0x30
+.value CPUCALL_PAGEINFO     0x31
+.value CPUCALL_BANKSWITCH   0x32
+.value CPUCALL_MEMINFO      0x33
 
 ; CPU fault numbers
 
@@ -22,6 +41,54 @@
 .value CPUFAULT_INS     0x05 ; Illegal instruction
 .value CPUFAULT_USER    0x06 ; Forced fault
 .value CPUFAULT_CPUCALL 0x07 ; Invalid CPU call
+.value CPUFAULT_PAGE    0x08 ; Page fault
+
+; Registers of a memory-mapped device
+
+.value MMIO_DATA   0x00
+.value MMIO_STATUS 0x01
+.value MMIO_READY  0x01
+
+; Size of a block device sector
+
+.value SECTOR_SIZE 0x200
+
+; Packet descriptors: u16 address, u16 length, u16 flags
+
+.value DESC_AVAIL 0x01
+.value DESC_DONE  0x02
+.value DESC_TRUNC 0x04
+
+; Amount of interrupt priorities
+
+.value IRQ_LEVELS 0x08
+
+; Device ID for masking every device at once
+
+.value ALL_DEVICES 0xffff
+
+; Timer modes
+
+.value TIMER_STOP     0x00
+.value TIMER_ONESHOT  0x01
+.value TIMER_PERIODIC 0x02
+
+; Performance counters, each 32 bits wide
+
+.value PERF_INSTRUCTIONS 0x00
+.value PERF_CYCLES       0x01
+.value PERF_LOADS        0x02
+.value PERF_STORES       0x03
+.value PERF_BRANCHES     0x04
+.value PERF_INTERRUPTS   0x05
+.value PERF_COUNT        0x06
+
+; Page access bits
+
+.value PAGE_PRESENT 0x01
+.value PAGE_READ    0x02
+.value PAGE_WRITE   0x04
+.value PAGE_EXEC    0x08
 
 ; Console
 
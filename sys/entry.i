@@ -13,6 +13,7 @@ _entry:
     ret
 
 _halt:
+    wfi
     jmp _halt
 @E:
     ret
@@ -3,4 +3,5 @@
 
 .export halt
 halt:
+    wfi
     jmp halt
@@ -25,23 +25,21 @@ putc:
 ; Write a string to the selected I/O device.
 ; puts(char *str)
 puts:
-    push bp
-    push r4
-    mov bp, sp
-
-    mov r4, r0      ; char *str
+    mov r2, r0      ; char *str
+    mov r3, r0
 
 @loop:
-    load h0, r4     ; load char
+    load h0, r3     ; load char
     cmp h0, 0       ; check if string end
     jeq @end
-    call putc       ; print char
-    add r4, 1       ; move to next char
+    add r3, 1       ; move to next char
     jmp @loop
 
 @end:
-    pop r4
-    pop bp
+    sub r3, r2      ; write the whole string at once
+    mov r0, CPUCALL_DEVICEWRITEN
+    load r1, __io_dev
+    cpucall
     ret
 
 ; Print a hex number.
@@ -124,8 +122,22 @@ printf:
     cmp h0, '%'     ; compare char
     jeq @format
 
-    call putc       ; print non-formatted char
-    add r4, 1       ; increment fmt pointer
+    mov r1, r4      ; find the end of non-formatted chars
+
+@literal:
+    add r1, 1
+    load h0, r1
+    cmp h0, 0
+    jeq @write
+    cmp h0, '%'
+    jeq @write
+    jmp @literal
+
+@write:
+    mov r0, r4      ; print them at once
+    sub r1, r4
+    add r4, r1      ; move fmt pointer past them
+    call __io_write
     jmp @loop
 
 @format:
@@ -183,29 +195,11 @@ iosel:
 ; Write to the selected device.
 ; __io_write(char *bytes, int len)
 __io_write:
-    push bp
-    push r4
-    push r5
-    mov bp, sp
-
-    mov r4, r0
-    mov r5, r1
-
-@loop:
-    load h0, r4     ; load char
-    call putc       ; print char
-    add r4, 1       ; move pointer
-    sub r5, 1       ; decrement counter
-
-    cmp r5, 0       ; check if end of buffer
-    jeq @end
-    jmp @loop
-
-@end:
-    mov sp, bp
-    pop r5
-    pop r4
-    pop bp
+    mov r2, r0
+    mov r3, r1
+    mov r0, CPUCALL_DEVICEWRITEN
+    load r1, __io_dev
+    cpucall
     ret
 
 __io_dev: